@@ -0,0 +1,233 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+// Load generator for bpserver: several clients, each on its own connection,
+// send encode or decode requests for slices of an input file and time them.
+//
+// clang++ --std=c++11 -O3 -pthread bpbench.cpp -o bpbench
+// 
+// A request's latency runs from copying its payload into the arena to reading
+// its reply. With --depth=N, each client sends N requests at a time, and each
+// is timed from the start of its batch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "bpclient.h"
+
+// Distinct payloads each client cycles through
+#define BP_BENCH_PAYLOADS  (64)
+
+static inline int imax(int x, int y) {return (x > y)? x : y;}
+
+static inline double GetNanoseconds() {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchConfig {
+    const char * path;
+    const std::vector<uint8_t> * input;
+    bool decode;
+    int flags;
+    int numRequests;
+    size_t size;
+    int depth;
+};
+
+struct BenchResult {
+    std::vector<double> latencies;
+    size_t failed;
+};
+
+static void RunClient(const BenchConfig & cfg, int clientIdx, BenchResult & result)
+{
+    result.failed = 0;
+    size_t size = std::min(cfg.size, cfg.input->size());
+    size_t slotSize = (2*size + 4096 + 63) & ~(size_t)63;
+    ServerClient client;
+    if(!client.Connect(cfg.path, cfg.depth*slotSize*2)) {
+        printf("Client %d could not connect to %s\n", clientIdx, cfg.path);
+        result.failed = cfg.numRequests;
+        return;
+    }
+    
+    // Slices spread through the input, offset per client, and their encodings
+    // if decoding is being measured
+    std::vector<std::vector<uint8_t> > raw(BP_BENCH_PAYLOADS), payloads(BP_BENCH_PAYLOADS);
+    size_t span = cfg.input->size() - size;
+    for(int j = 0; j < BP_BENCH_PAYLOADS; ++j)
+    {
+        size_t offset = span? (span*j/BP_BENCH_PAYLOADS + clientIdx*4099) % span : 0;
+        raw[j].assign(cfg.input->begin() + offset, cfg.input->begin() + offset + size);
+        payloads[j] = raw[j];
+        if(cfg.decode && client.Encode(&raw[j][0], size, payloads[j], cfg.flags) != BP_SERVER_OK) {
+            printf("Client %d could not encode its payloads\n", clientIdx);
+            result.failed = cfg.numRequests;
+            return;
+        }
+    }
+    
+    uint8_t * arena = client.Arena();
+    std::vector<double> done(cfg.depth);
+    for(int r = 0; r < cfg.numRequests; r += cfg.depth)
+    {
+        int batch = std::min(cfg.depth, cfg.numRequests - r);
+        double startT = GetNanoseconds();
+        for(int d = 0; d < batch; ++d)
+        {
+            const std::vector<uint8_t> & payload = payloads[(r + d) % BP_BENCH_PAYLOADS];
+            size_t inOffset = 2*d*slotSize, outOffset = inOffset + slotSize;
+            memcpy(arena + inOffset, &payload[0], payload.size());
+            client.Queue(cfg.decode? BP_SERVER_DECODE : BP_SERVER_ENCODE, cfg.flags,
+                inOffset, payload.size(), outOffset, slotSize);
+        }
+        if(!client.Submit()) {
+            result.failed += cfg.numRequests - r;
+            return;
+        }
+        
+        for(int d = 0; d < batch; ++d)
+        {
+            ServerReply reply;
+            if(!client.Wait(reply)) {
+                result.failed += cfg.numRequests - r - d;
+                return;
+            }
+            done[d] = GetNanoseconds();
+            
+            // Decoded output must match the original slice
+            const std::vector<uint8_t> & orig = raw[(r + d) % BP_BENCH_PAYLOADS];
+            uint8_t * out = arena + 2*d*slotSize + slotSize;
+            if(reply.status != BP_SERVER_OK ||
+               (cfg.decode && (reply.outSize != orig.size() || memcmp(out, &orig[0], orig.size()) != 0)))
+                ++result.failed;
+        }
+        for(int d = 0; d < batch; ++d)
+            result.latencies.push_back(done[d] - startT);
+    }
+}
+
+static double Percentile(const std::vector<double> & sorted, double p)
+{
+    if(sorted.empty())
+        return 0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(p*sorted.size()));
+    return sorted[idx];
+}
+
+int main(int argc, char * argv[])
+{
+    BenchConfig cfg;
+    cfg.decode = true;
+    cfg.flags = 0;
+    cfg.numRequests = 10000;
+    cfg.size = 4096;
+    cfg.depth = 1;
+    int numClients = 1;
+    std::vector<const char *> fileArgs;
+    for(int j = 1; j < argc; ++j)
+    {
+        std::string arg = argv[j];
+        if(arg == "--encode")
+            cfg.decode = false;
+        else if(arg == "--decode")
+            cfg.decode = true;
+        else if(arg == "--crc")
+            cfg.flags |= BP_SERVER_CHECKSUM;
+        else if(arg.compare(0, 10, "--clients=") == 0)
+            numClients = imax(1, atoi(arg.c_str() + 10));
+        else if(arg.compare(0, 11, "--requests=") == 0)
+            cfg.numRequests = imax(1, atoi(arg.c_str() + 11));
+        else if(arg.compare(0, 7, "--size=") == 0)
+            cfg.size = imax(1, atoi(arg.c_str() + 7));
+        else if(arg.compare(0, 8, "--depth=") == 0)
+            cfg.depth = imax(1, atoi(arg.c_str() + 8));
+        else
+            fileArgs.push_back(argv[j]);
+    }
+    
+    if(fileArgs.size() != 2) {
+        printf("Usage: bpbench [--encode | --decode] [--crc] [--clients=N] [--requests=N] [--size=N] [--depth=N] SOCKET INFILE\n");
+        exit(EXIT_FAILURE);
+    }
+    cfg.path = fileArgs[0];
+    
+    FILE * fin = fopen(fileArgs[1], "rb");
+    if(!fin) {
+        printf("Could not open %s\n", fileArgs[1]);
+        exit(EXIT_FAILURE);
+    }
+    std::vector<uint8_t> input;
+    uint8_t bfr[1 << 16];
+    size_t n;
+    while((n = fread(bfr, 1, sizeof(bfr), fin)) > 0)
+        input.insert(input.end(), bfr, bfr + n);
+    fclose(fin);
+    if(input.empty()) {
+        printf("%s is empty\n", fileArgs[1]);
+        exit(EXIT_FAILURE);
+    }
+    cfg.input = &input;
+    
+    std::vector<BenchResult> results(numClients);
+    std::vector<std::thread> clients;
+    double startT = GetNanoseconds();
+    for(int c = 0; c < numClients; ++c)
+        clients.push_back(std::thread(RunClient, std::cref(cfg), c, std::ref(results[c])));
+    for(auto & t : clients)
+        t.join();
+    double elapsed = (GetNanoseconds() - startT)/1e9;
+    
+    std::vector<double> latencies;
+    size_t failed = 0;
+    for(auto & r : results) {
+        latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+        failed += r.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    
+    size_t payloadSize = std::min(cfg.size, input.size());
+    printf("%s, %d clients, %lu requests of %lu bytes, depth %d\n", cfg.decode? "Decode" : "Encode",
+        numClients, latencies.size(), payloadSize, cfg.depth);
+    printf("Failed: %lu\n", failed);
+    printf("Throughput: %.0f requests/s, %.1f MB/s\n", latencies.size()/elapsed,
+        latencies.size()*payloadSize/elapsed/1e6);
+    printf("Latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        Percentile(latencies, 0.5)/1e3, Percentile(latencies, 0.9)/1e3, Percentile(latencies, 0.99)/1e3,
+        Percentile(latencies, 0.999)/1e3, latencies.empty()? 0 : latencies.back()/1e3);
+    return failed? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPCLIENT_H
+#define BPCLIENT_H
+
+// Client side of the bpserver protocol. Payloads don't go through the socket:
+// the client maps a memfd arena, hands the descriptor to the server once when
+// it connects, and requests only name regions of it. Requests are queued and
+// sent together, and replies come back in request order.
+// 
+// The arena is sealed against shrinking before it is handed over, and the
+// server refuses one that isn't, so a client can't truncate it under the
+// server's mapping.
+// 
+// Connection: (ServerHello + arena fd as SCM_RIGHTS) -> (ServerReply)
+// Then any number of: (ServerRequest...) -> (ServerReply...)
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <vector>
+
+#define BP_SERVER_MAGIC    (0x42505356)// "BPSV"
+#define BP_SERVER_VERSION  (2)
+
+// Operations
+#define BP_SERVER_ENCODE  (1)
+#define BP_SERVER_DECODE  (2)
+
+// Request flags
+#define BP_SERVER_CHECKSUM  (0x0001)// encode with block checksums
+#define BP_SERVER_ENTROPY   (0x0002)// entropy code block data where it helps
+
+// Reply status
+#define BP_SERVER_OK        (0)
+#define BP_SERVER_EBADREQ   (-1)// unknown operation, or region outside the arena
+#define BP_SERVER_ESPACE    (-2)// output region too small, outSize is the size needed
+#define BP_SERVER_ECORRUPT  (-3)// input is not a valid stream, or fails its checksums
+
+struct ServerHello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t arenaSize;
+};
+
+struct ServerRequest {
+    uint16_t op;
+    uint16_t flags;
+    uint32_t id;
+    uint64_t inOffset, inSize;
+    uint64_t outOffset, outCapacity;
+};
+
+struct ServerReply {
+    uint32_t id;
+    int32_t status;
+    uint64_t outSize;
+};
+
+// Write all of size bytes, resuming after short writes
+static inline bool SendAll(int fd, const void * bfr, size_t size)
+{
+    const uint8_t * b = (const uint8_t *)bfr;
+    while(size)
+    {
+        ssize_t n = send(fd, b, size, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        b += n;
+        size -= n;
+    }
+    return true;
+}
+
+static inline bool RecvAll(int fd, void * bfr, size_t size)
+{
+    uint8_t * b = (uint8_t *)bfr;
+    while(size)
+    {
+        ssize_t n = recv(fd, b, size, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        b += n;
+        size -= n;
+    }
+    return true;
+}
+
+class ServerClient {
+  public:
+    ServerClient(): sock(-1), arena(NULL), arenaSize(0), nextId(0) {}
+    ~ServerClient() {Close();}
+    
+    bool Connect(const char * path, size_t _arenaSize)
+    {
+        Close();
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(strlen(path) >= sizeof(addr.sun_path))
+            return false;
+        strcpy(addr.sun_path, path);
+        
+        int memFd = memfd_create("bpclient", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if(memFd < 0 || ftruncate(memFd, _arenaSize) != 0 ||
+           fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) != 0)
+        {
+            if(memFd >= 0)
+                close(memFd);
+            return false;
+        }
+        void * mem = mmap(NULL, _arenaSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(mem == MAP_FAILED || sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            if(mem != MAP_FAILED)
+                munmap(mem, _arenaSize);
+            close(memFd);
+            Close();
+            return false;
+        }
+        arena = (uint8_t *)mem;
+        arenaSize = _arenaSize;
+        
+        // The arena descriptor goes along with the hello
+        ServerHello hello = {BP_SERVER_MAGIC, BP_SERVER_VERSION, _arenaSize};
+        struct iovec iov = {&hello, sizeof(hello)};
+        union {
+            char bfr[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } ctrl;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.bfr;
+        msg.msg_controllen = sizeof(ctrl.bfr);
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memFd, sizeof(int));
+        
+        ServerReply reply;
+        bool ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hello) &&
+                  RecvAll(sock, &reply, sizeof(reply)) && reply.status == BP_SERVER_OK;
+        close(memFd);
+        if(!ok)
+            Close();
+        return ok;
+    }
+    
+    void Close()
+    {
+        if(arena)
+            munmap(arena, arenaSize);
+        if(sock >= 0)
+            close(sock);
+        arena = NULL;
+        arenaSize = 0;
+        sock = -1;
+        queued.clear();
+    }
+    
+    uint8_t * Arena() const {return arena;}
+    size_t ArenaSize() const {return arenaSize;}
+    
+    // Queue a request on regions of the arena. Nothing is sent until Submit().
+    // Returns the request id, which its reply carries.
+    uint32_t Queue(int op, int flags, size_t inOffset, size_t inSize, size_t outOffset, size_t outCapacity)
+    {
+        ServerRequest req = {(uint16_t)op, (uint16_t)flags, nextId++, inOffset, inSize, outOffset, outCapacity};
+        queued.push_back(req);
+        return req.id;
+    }
+    
+    // Send every queued request in one write
+    bool Submit()
+    {
+        bool ok = queued.empty() || SendAll(sock, &queued[0], queued.size()*sizeof(ServerRequest));
+        queued.clear();
+        return ok;
+    }
+    
+    // Wait for the next reply
+    bool Wait(ServerReply & reply) {
+        return RecvAll(sock, &reply, sizeof(reply));
+    }
+    
+    // Synchronous calls: in is copied into the start of the arena, and the
+    // output region is the rest of it. Returns the reply status, or
+    // BP_SERVER_EBADREQ if the request could not be made.
+    int Encode(const uint8_t * in, size_t inSize, std::vector<uint8_t> & out, int flags = 0) {
+        return Call(BP_SERVER_ENCODE, flags, in, inSize, out);
+    }
+    int Decode(const uint8_t * in, size_t inSize, std::vector<uint8_t> & out) {
+        return Call(BP_SERVER_DECODE, 0, in, inSize, out);
+    }
+    
+  private:
+    int sock;
+    uint8_t * arena;
+    size_t arenaSize;
+    uint32_t nextId;
+    std::vector<ServerRequest> queued;
+    
+    int Call(int op, int flags, const uint8_t * in, size_t inSize, std::vector<uint8_t> & out)
+    {
+        size_t outOffset = (inSize + 63) & ~(size_t)63;
+        if(!arena || outOffset > arenaSize)
+            return BP_SERVER_EBADREQ;
+        memcpy(arena, in, inSize);
+        Queue(op, flags, 0, inSize, outOffset, arenaSize - outOffset);
+        ServerReply reply;
+        if(!Submit() || !Wait(reply))
+            return BP_SERVER_EBADREQ;
+        if(reply.status == BP_SERVER_OK)
+            out.assign(arena + outOffset, arena + outOffset + reply.outSize);
+        return reply.status;
+    }
+};
+
+#endif // BPCLIENT_H
@@ -0,0 +1,2284 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPCODEC_H
+#define BPCODEC_H
+
+// Block-level encoding and record-level decoding, shared by bpenc, bpdec and
+// bpserver. The stream format is described in bpenc.cpp.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#include "bpcrc.h"
+#include "bpfse.h"
+#include "bpkernels.h"
+#include "bptrace.h"
+#include "bpperf.h"
+#include "bpqueue.h"
+#include "misc/flexints.h"
+
+// #define NUMPASSES  (128)
+// #define NUMPASSES  (64)
+#define NUMPASSES  (32)
+// #define NUMPASSES  (16)
+// #define NUMPASSES  (8)
+
+// Largest raw block. Block sizes of 0x0000 and 0xFFFF mark other records.
+#define BP_MAX_BLOCK_SIZE  (65534)
+
+// Most a block in a 2-byte size record may expand to. Earlier encoders wrote
+// raw blocks of up to 65535 bytes, and their files must still decode.
+#define BP_MAX_EXPANSION  (65535)
+
+// Long blocks: default raw size limit for --long-blocks, largest block a long
+// block record may hold, and the most bytes its varint size may take
+#define BP_LONG_BLOCK_SIZE  (4 << 20)
+#define BP_LONG_MAX_BLOCK   (1 << 24)
+#define BP_LONG_SIZE_BYTES  (4)
+
+// Most bytes the keys of a byte block may expand to together. Keys that each
+// double the last up to a whole long block take twice its size.
+#define BP_MAX_TABLE  (4*BP_LONG_MAX_BLOCK)
+
+#define BP_EXT_RECORD        (0xFFFF)
+#define BP_EXT_MASKED_TABLE  (0x01)
+#define BP_EXT_CHECKSUM      (0x02)
+#define BP_EXT_ARCHIVE_TOC   (0x03)
+#define BP_EXT_WIDE_BLOCK    (0x04)
+#define BP_EXT_LONG_BLOCK    (0x05)
+#define BP_EXT_CODED_BLOCK   (0x06)
+#define BP_EXT_MATCHES       (0x07)
+
+// Wide blocks: raw bytes taken per block by the encoder, the largest raw size
+// and total key expansion a decoder accepts, and the default and greatest
+// number of passes the encoder runs
+#define BP_WIDE_BLOCK_SIZE  (1 << 20)
+#define BP_WIDE_MAX_BLOCK   (1 << 24)
+#define BP_WIDE_MAX_TABLE   (1 << 24)
+#define BP_WIDE_PASSES      (256)
+#define BP_WIDE_MAX_PASSES  (1024)
+
+// Symbols a wide block decoder unpacks at a time, a multiple of 8 so every
+// run starts on a byte boundary
+#define BP_WIDE_CHUNK  (4096)
+
+// Long-range matches: input taken per segment, how far back a match may
+// reach, the shortest match kept, and the size of the match finder's hash
+// table
+#define BP_MATCH_SEGMENT    (1 << 20)
+#define BP_MATCH_WINDOW     (8 << 20)
+#define BP_MATCH_MIN        (32)
+#define BP_MATCH_HASH_BITS  (16)
+
+// ParseRecord() result for malformed input
+#define BP_BAD_RECORD  ((size_t)-1)
+
+// Aligned container: magic, version, flags, and the alignment of the header
+// arrays and block payloads
+#define BP_CONTAINER_MAGIC     "BPAC"
+#define BP_CONTAINER_VERSION   (1)
+#define BP_CONTAINER_HEADER    (32)
+#define BP_CONTAINER_ALIGN     (64)
+#define BP_CONTAINER_MASKED    (0x01)
+#define BP_CONTAINER_CHECKSUM  (0x02)
+
+// *****************************************************************************
+// Encoding
+
+struct PairCount {
+    size_t count;
+    uint8_t first;
+    uint8_t second;
+};
+
+// One pass as applied to a block, recorded for --stats
+struct PassRecord {
+    int sub;
+    uint8_t first, second;
+    size_t count;// occurrences replaced
+    size_t numBlocks;// blocks the pass was applied to
+    double searchTime, subsTime;// seconds in GetBestPair() and DoSubs()
+};
+
+// Limits on what a block may cost to decode, 0 for none: how deeply keys nest,
+// how many bytes one key expands to, and how many passes are applied
+struct DecodeLimits {
+    int maxDepth;
+    size_t maxLength;
+    int maxPasses;
+    
+    bool Any() const {return maxDepth || maxLength || maxPasses;}
+};
+
+// Predicted decode cost of a block: passes applied, deepest nesting and
+// longest expansion of any key in the data, and the bytes a decoder undoing
+// one pass at a time reads and writes
+struct DecodeCost {
+    int passes;
+    int depth;
+    size_t length;
+    size_t passBytes;
+    
+    void Max(const DecodeCost & other) {
+        passes = std::max(passes, other.passes);
+        depth = std::max(depth, other.depth);
+        length = std::max(length, other.length);
+        passBytes = std::max(passBytes, other.passBytes);
+    }
+};
+
+// Search settings for an effort level. batch is the most passes taken from
+// one pair count (see GetBestPairs()). With sample above 1, pairs are counted
+// in one of every sample windows of a block, or one of every sample blocks in
+// a shared table search, and the best candidates are confirmed with exact
+// counts over everything.
+// With quickReuse, the last table is kept without a search when it does
+// about as well on a block as the last new table's ratio predicts, which
+// can cost a little size for the searches it saves. Otherwise it is only
+// kept when it does no worse than a new table would.
+// A beam above 1 turns on BeamSearchPairs() for each new table, until the
+// deadline (in GetTimerSeconds() time, 0 for none) has passed.
+struct Effort {
+    int batch;
+    int sample;
+    bool quickReuse;
+    int beam;
+    double deadline;
+};
+
+#define BP_MIN_EFFORT      (1)
+#define BP_MAX_EFFORT      (9)
+#define BP_SAMPLE_WINDOW   (256)
+
+// Level 9 is the exhaustive search
+static inline Effort BP_Effort(int level)
+{
+    static const Effort levels[BP_MAX_EFFORT] = {
+        {8, 16, true, 1, 0}, {8, 8, true, 1, 0}, {8, 4, true, 1, 0}, {8, 2, true, 1, 0},
+        {4, 2, true, 1, 0}, {4, 1, true, 1, 0}, {2, 1, true, 1, 0}, {1, 1, true, 1, 0},
+        {1, 1, false, 1, 0}
+    };
+    level = std::max(BP_MIN_EFFORT, std::min(BP_MAX_EFFORT, level));
+    return levels[level - 1];
+}
+
+static inline double GetTimerSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+struct Block {
+    std::vector<uint8_t> data;// 
+    std::vector<uint8_t> unused;
+    std::vector<uint8_t> subs;
+    std::vector<uint8_t> passMask;// passes applied, only used with elided keys
+    uint32_t dataCRC;// CRC-32C of the raw block, if checksums are enabled
+    size_t rawSize;// size before substitution
+    std::vector<uint8_t> matches;// match record of the segment the block starts, if any
+    std::vector<PassRecord> passLog;// passes applied, if they are being logged
+    double discardedTime;// time spent on passes that were tried and not kept
+    
+    // Nesting depth and expanded length of each byte value, 0 and 1 for
+    // bytes that aren't keys
+    uint8_t keyDepth[256];
+    uint32_t keyLength[256];
+    DecodeCost cost;
+    
+    Block(const uint8_t *& _data, const uint8_t * dataEnd, size_t maxSize = BP_MAX_BLOCK_SIZE);
+    
+    
+    void CollectUnused();
+    bool DoSubs(int sub, uint8_t first, uint8_t second, bool elide = false);
+    void DoSubsMany(const PairCount * pairs, int n, size_t * counts);
+    bool CanBatch(const PairCount * pairs, int n) const;
+    bool Allows(uint8_t first, uint8_t second, const DecodeLimits & limits) const;
+    bool Within(const DecodeLimits & limits) const;
+    
+  private:
+    void AddKey(uint8_t key, uint8_t first, uint8_t second, size_t count, size_t sizeBefore);
+};
+
+inline Block::Block(const uint8_t *& _data, const uint8_t * dataEnd, size_t maxSize)
+{
+    BP_TRACE_SCOPE("partition");
+    PerfScope perf("partition", 0);
+    // Variable-size blocks
+    // Grow block until we run out of data, reach the maximum allowable block size, or
+    // number of unused byte values drops to NUMPASSES.
+    bool usedTbl[256];
+    for(int j = 0; j < 256; ++j)
+        usedTbl[j] = false;
+    
+    int usedCount = 0;
+    size_t rawSize = 0;
+    const uint8_t * b = _data;
+    while((b != dataEnd) && (rawSize < maxSize) && (256 - usedCount != NUMPASSES))
+    {
+        if(!usedTbl[*b]) {
+            usedTbl[*b] = true;
+            ++usedCount;
+        }
+        ++b;
+        ++rawSize;
+    }
+    if(rawSize == 0)
+        exit(-1);
+    data.assign(_data, _data + rawSize);
+    this->rawSize = rawSize;
+    perf.bytes = rawSize;
+    discardedTime = 0;
+    _data += rawSize;
+    
+    for(int j = 0; j < 256; ++j) {
+        keyDepth[j] = 0;
+        keyLength[j] = 1;
+    }
+    cost.passes = cost.depth = 0;
+    cost.length = 1;
+    cost.passBytes = 0;
+    
+    for(int j = 0; j < 256; ++j)
+        if(!usedTbl[j])
+            unused.push_back(j);
+    // printf("unused words: %lu\n", blocks.back()->unused.size());
+}
+
+inline void Block::CollectUnused()
+{
+    bool usedTbl[256];
+    for(int j = 0; j < 256; ++j)
+        usedTbl[j] = false;
+    
+    for(auto b : data)
+        usedTbl[b] = true;
+    
+    unused.clear();
+    for(int j = 0; j < 256; ++j)
+        if(!usedTbl[j])
+            unused.push_back(j);
+}
+
+// Record the cost of a pass that replaced count occurrences of first, second
+// with key. Keys that don't occur don't count toward the block's depth or
+// length, as the decoder never expands them.
+inline void Block::AddKey(uint8_t key, uint8_t first, uint8_t second, size_t count, size_t sizeBefore)
+{
+    keyDepth[key] = 1 + std::max(keyDepth[first], keyDepth[second]);
+    keyLength[key] = (uint32_t)std::min((uint64_t)UINT32_MAX, (uint64_t)keyLength[first] + keyLength[second]);
+    ++cost.passes;
+    cost.passBytes += 2*sizeBefore - count;
+    if(count) {
+        cost.depth = std::max(cost.depth, (int)keyDepth[key]);
+        cost.length = std::max(cost.length, (size_t)keyLength[key]);
+    }
+}
+
+// Whether the next pass could substitute first, second without going over
+// limits
+inline bool Block::Allows(uint8_t first, uint8_t second, const DecodeLimits & limits) const
+{
+    if(limits.maxPasses && cost.passes >= limits.maxPasses)
+        return false;
+    if(limits.maxDepth && 1 + std::max(keyDepth[first], keyDepth[second]) > limits.maxDepth)
+        return false;
+    return !limits.maxLength || (size_t)keyLength[first] + keyLength[second] <= limits.maxLength;
+}
+
+inline bool Block::Within(const DecodeLimits & limits) const
+{
+    return (!limits.maxPasses || cost.passes <= limits.maxPasses) &&
+           (!limits.maxDepth || cost.depth <= limits.maxDepth) &&
+           (!limits.maxLength || cost.length <= limits.maxLength);
+}
+
+// If elide is set and the pair does not occur in the block, no key is used up
+// and the pass is left clear in passMask. Returns true if a key was allocated.
+inline bool Block::DoSubs(int sub, uint8_t first, uint8_t second, bool elide)
+{
+    BP_TRACE_SCOPE("substitute");
+    PerfScope perf("substitute", data.size());
+    if(!unused.empty())
+    {
+        // Substitution runs out of place, buffers are swapped afterward
+        static thread_local std::vector<uint8_t> scratch;
+        if(scratch.size() < data.size())
+            scratch.resize(data.size());
+        uint8_t key = unused.back();
+        size_t size = bp_kernels.substitute(&scratch[0], &data[0], data.size(), first, second, key);
+        
+        // Every replacement shortens the block by one
+        if(elide)
+        {
+            if(passMask.size() <= (size_t)(sub >> 3))
+                passMask.resize((sub >> 3) + 1, 0);
+            if(size == data.size())
+                return false;
+            passMask[sub >> 3] |= 1 << (sub & 7);
+        }
+        
+        subs.push_back(key);
+        unused.pop_back();
+        AddKey(key, first, second, data.size() - size, data.size());
+        
+        // printf("%d %d -> %d\n", first, second, key);
+        // printf("compressed block from: %lu to %lu\n", data.size(), size);
+        if(size != data.size()) {
+            data.swap(scratch);
+            data.resize(size);
+        }
+        
+        // Substitutions may have freed up some more substitution values, do another search when we run out
+        // Not necessary with current setup, blocks are guaranteed to have available byte values.
+        // if(unused.empty())
+        //     CollectUnused();
+        return true;
+    }
+    return false;
+}
+
+// Next n passes in one sweep, which the caller has checked with CanBatch().
+// counts[i] receives the occurrences of pair i replaced.
+inline void Block::DoSubsMany(const PairCount * pairs, int n, size_t * counts)
+{
+    BP_TRACE_SCOPE("substitute");
+    PerfScope perf("substitute", data.size());
+    static thread_local std::vector<uint8_t> scratch;
+    if(scratch.size() < data.size())
+        scratch.resize(data.size());
+    uint8_t pairBytes[2*BP_MAX_BATCH], keys[BP_MAX_BATCH];
+    for(int i = 0; i < n; ++i) {
+        pairBytes[2*i] = pairs[i].first;
+        pairBytes[2*i + 1] = pairs[i].second;
+        keys[i] = unused.back();
+        subs.push_back(keys[i]);
+        unused.pop_back();
+    }
+    size_t size = bp_kernels.substituteMany(&scratch[0], &data[0], data.size(), pairBytes, keys, n, counts);
+    
+    // The decoder undoes them one at a time
+    size_t sizeBefore = data.size();
+    for(int i = 0; i < n; ++i) {
+        AddKey(keys[i], pairs[i].first, pairs[i].second, counts[i], sizeBefore);
+        sizeBefore -= counts[i];
+    }
+    if(size != data.size()) {
+        data.swap(scratch);
+        data.resize(size);
+    }
+}
+
+// The next n passes can be applied in one sweep with the same result as one
+// at a time if no byte value is in two of the pairs, or in a pair and one of
+// the keys they will get.
+inline bool Block::CanBatch(const PairCount * pairs, int n) const
+{
+    if(n > BP_MAX_BATCH || (size_t)n > unused.size())
+        return false;
+    bool taken[256] = {false};
+    for(int i = 0; i < n; ++i)
+        taken[unused[unused.size() - 1 - i]] = true;
+    for(int i = 0; i < n; ++i)
+    {
+        if(taken[pairs[i].first] || (pairs[i].second != pairs[i].first && taken[pairs[i].second]))
+            return false;
+        taken[pairs[i].first] = taken[pairs[i].second] = true;
+    }
+    return true;
+}
+
+// Lane histograms for GetBestPair(), zeroed once per thread and left zeroed
+// by every search
+static inline uint16_t * BP_PairLanes() {
+    static thread_local std::vector<uint16_t> lanes(BP_PAIR_LANES*65536, 0);
+    return &lanes[0];
+}
+
+static inline uint32_t * BP_PairLanesWide() {
+    static thread_local std::vector<uint32_t> lanes(BP_PAIR_LANES*65536, 0);
+    return &lanes[0];
+}
+
+// Sort candidates from a sampled count by their exact counts, most frequent
+// first and the lowest index first on a tie
+static inline void SortCandidates(int * idx, uint32_t * counts, int n)
+{
+    for(int c = 1; c < n; ++c)
+    {
+        int i = idx[c];
+        uint32_t count = counts[c];
+        int t = c;
+        for(; t > 0 && (counts[t - 1] < count || (counts[t - 1] == count && idx[t - 1] > i)); --t) {
+            idx[t] = idx[t - 1];
+            counts[t] = counts[t - 1];
+        }
+        idx[t] = i;
+        counts[t] = count;
+    }
+}
+
+static inline void CandidateBytes(const int * idx, int n, uint8_t * pairBytes)
+{
+    for(int c = 0; c < n; ++c) {
+        pairBytes[2*c] = idx[c] >> 8;
+        pairBytes[2*c + 1] = idx[c] & 0xFF;
+    }
+}
+
+// Counts are 32 bits wide, so the blocks searched together can hold at most
+// 4 GiB of any one pair. With sample above 1, only one in sample of the
+// blocks still being substituted is counted, and the best candidates are
+// then counted exactly over all of them.
+static inline void GetBestPair(std::vector<Block *> & blocks, PairCount & bestPair, int sample = 1)
+{
+    BP_TRACE_SCOPE("count pairs");
+    PerfScope perf("count pairs", 0);
+    uint32_t * lanes = BP_PairLanesWide();
+    // table index is concatenation of bytes, first byte being the high byte
+    
+    size_t numSearched = 0;
+    for(auto & blk : blocks)
+    {
+        if(!blk->unused.empty() && numSearched++ % sample == 0) {
+            perf.bytes += blk->data.size();
+            bp_kernels.countPairsWide(lanes, &blk->data[0], blk->data.size());
+        }
+    }
+    
+    if(sample > 1)
+    {
+        int idx[BP_MAX_CANDIDATES];
+        uint32_t counts[BP_MAX_CANDIDATES];
+        BP_TopPairs(lanes, idx, counts, BP_MAX_CANDIDATES);
+        
+        BP_TRACE_SCOPE("confirm pairs");
+        PerfScope confirm("confirm pairs", 0);
+        uint8_t pairBytes[2*BP_MAX_CANDIDATES];
+        CandidateBytes(idx, BP_MAX_CANDIDATES, pairBytes);
+        for(int c = 0; c < BP_MAX_CANDIDATES; ++c)
+            counts[c] = 0;
+        for(auto & blk : blocks)
+        {
+            if(!blk->unused.empty()) {
+                confirm.bytes += blk->data.size();
+                bp_kernels.countPairsOf(&blk->data[0], blk->data.size(), pairBytes, BP_MAX_CANDIDATES, counts);
+            }
+        }
+        SortCandidates(idx, counts, BP_MAX_CANDIDATES);
+        
+        bestPair.count = counts[0];
+        bestPair.first = idx[0] >> 8;
+        bestPair.second = idx[0] & 0xFF;
+        return;
+    }
+    
+    uint32_t bestPairCount;
+    int bestPairIdx = bp_kernels.bestPairWide(lanes, bestPairCount);
+    
+    bestPair.count = bestPairCount;
+    bestPair.first = bestPairIdx >> 8;
+    bestPair.second = bestPairIdx & 0xFF;
+    
+    // printf("best count: %d, %d: %lu\n", (int)bestPairIdx >> 8, (int)bestPairIdx & 0xFF, bestPair.count);
+}
+
+// Blocks too large for 16-bit counts are counted in the wide histograms
+static inline void GetBestPair(const Block * block, PairCount & bestPair)
+{
+    BP_TRACE_SCOPE("count pairs");
+    PerfScope perf("count pairs", block->data.size());
+    // table index is concatenation of bytes, first byte being the high byte
+    
+    uint32_t bestPairCount;
+    int bestPairIdx;
+    if(block->data.size() <= BP_MAX_BLOCK_SIZE) {
+        uint16_t * lanes = BP_PairLanes();
+        bp_kernels.countPairs(lanes, &block->data[0], block->data.size());
+        bestPairIdx = bp_kernels.bestPair(lanes, bestPairCount);
+    }
+    else {
+        uint32_t * lanes = BP_PairLanesWide();
+        bp_kernels.countPairsWide(lanes, &block->data[0], block->data.size());
+        bestPairIdx = bp_kernels.bestPairWide(lanes, bestPairCount);
+    }
+    
+    bestPair.count = bestPairCount;
+    bestPair.first = bestPairIdx >> 8;
+    bestPair.second = bestPairIdx & 0xFF;
+    
+    // printf("best count: %d, %d: %lu\n", (int)bestPairIdx >> 8, (int)bestPairIdx & 0xFF, bestPair.count);
+}
+
+
+// Zero the counts of pairs the next pass of block can't take under limits.
+// Only pairs with a key in them can break a limit on depth or length.
+template<typename T>
+static inline void MaskPairs(T * lanes, const Block * block, DecodeLimits limits)
+{
+    limits.maxPasses = 0;
+    for(uint8_t key : block->subs)
+    {
+        for(int b = 0; b < 256; ++b)
+        {
+            int masked[2] = {-1, -1};
+            if(!block->Allows(key, b, limits))
+                masked[0] = (key << 8) | b;
+            if(!block->Allows(b, key, limits))
+                masked[1] = (b << 8) | key;
+            for(int m = 0; m < 2; ++m)
+                if(masked[m] >= 0)
+                    for(int l = 0; l < BP_PAIR_LANES; ++l)
+                        lanes[l*65536 + masked[m]] = 0;
+        }
+    }
+}
+
+// The k most frequent pairs in one of every sample windows of the block,
+// leaving out any limits rule out. A sample touches few of the 65536 pairs,
+// so they are counted in one lane and tracked in a list, and only the pairs
+// on it are searched and zeroed. Returns the number of bytes counted.
+template<typename T>
+static inline size_t CountSampledPairs(const Block * block, T * lane, int sample, const DecodeLimits * limits,
+                                       int * idx, uint32_t * counts, int k)
+{
+    const uint8_t * data = &block->data[0];
+    size_t size = block->data.size();
+    static thread_local std::vector<int> touched;
+    touched.clear();
+    size_t numCounted = 0;
+    for(size_t start = 0; start + 1 < size; start += (size_t)sample*BP_SAMPLE_WINDOW)
+    {
+        // A window takes one byte more so the pair it ends on is counted
+        size_t end = std::min(start + BP_SAMPLE_WINDOW, size - 1);
+        for(size_t j = start; j < end; ++j)
+        {
+            int pair = (data[j] << 8) | data[j + 1];
+            if(lane[pair]++ == 0)
+                touched.push_back(pair);
+        }
+        numCounted += end - start + 1;
+    }
+    
+    for(int t = 0; t < k; ++t) {
+        idx[t] = t;
+        counts[t] = 0;
+    }
+    for(int pair : touched)
+    {
+        uint32_t c = lane[pair];
+        lane[pair] = 0;
+        if(limits && !block->Allows(pair >> 8, pair & 0xFF, *limits))
+            continue;
+        if(c < counts[k - 1] || (c == counts[k - 1] && pair > idx[k - 1]))
+            continue;
+        int t = k - 1;
+        for(; t > 0 && (counts[t - 1] < c || (counts[t - 1] == c && idx[t - 1] > pair)); --t) {
+            idx[t] = idx[t - 1];
+            counts[t] = counts[t - 1];
+        }
+        idx[t] = pair;
+        counts[t] = c;
+    }
+    return numCounted;
+}
+
+// The k most frequent pairs of block, counted exactly, leaving out any limits
+// rule out. Ties go to the lowest pair, see BP_TopPairs().
+static inline void CountTopPairs(const Block * block, int * idx, uint32_t * counts, int k,
+                                 const DecodeLimits * limits)
+{
+    size_t size = block->data.size();
+    const uint8_t * data = &block->data[0];
+    if(size <= BP_MAX_BLOCK_SIZE) {
+        uint16_t * lanes = BP_PairLanes();
+        bp_kernels.countPairs(lanes, data, size);
+        if(limits)
+            MaskPairs(lanes, block, *limits);
+        BP_TopPairs(lanes, idx, counts, k);
+    }
+    else {
+        uint32_t * lanes = BP_PairLanesWide();
+        bp_kernels.countPairsWide(lanes, data, size);
+        if(limits)
+            MaskPairs(lanes, block, *limits);
+        BP_TopPairs(lanes, idx, counts, k);
+    }
+}
+
+// Up to max pairs for the next passes of block from one count: the best pair,
+// then the next best that can be batched with the pairs before it (see
+// Block::CanBatch()) and occur at least half as often as the best. Returns the
+// number found, at least 1.
+// With sample above 1, pairs are counted in one of every sample windows of
+// BP_SAMPLE_WINDOW bytes, and the best BP_MAX_CANDIDATES are counted exactly
+// before any are chosen.
+// If limits are given, only pairs within them are chosen. If no pair within
+// them occurs, the pair is one that can't occur, of an unused byte.
+static inline int GetBestPairs(const Block * block, PairCount * pairs, int max, int sample = 1,
+                               const DecodeLimits * limits = NULL)
+{
+    size_t size = block->data.size();
+    const uint8_t * data = &block->data[0];
+    if(size <= 2*BP_SAMPLE_WINDOW)
+        sample = 1;
+    if(max <= 1 && sample <= 1 && !limits) {
+        GetBestPair(block, pairs[0]);
+        return 1;
+    }
+    
+    BP_TRACE_SCOPE("count pairs");
+    PerfScope perf("count pairs", 0);
+    
+    // A few candidates per pair, as many near the top will share bytes
+    const int maxCandidates = 4*BP_MAX_BATCH;
+    int idx[maxCandidates];
+    uint32_t counts[maxCandidates];
+    int numCandidates = maxCandidates;
+    if(sample <= 1) {
+        perf.bytes += size;
+        CountTopPairs(block, idx, counts, maxCandidates, limits);
+    }
+    else {
+        numCandidates = BP_MAX_CANDIDATES;
+        if(size <= BP_MAX_BLOCK_SIZE)
+            perf.bytes += CountSampledPairs(block, BP_PairLanes(), sample, limits, idx, counts, numCandidates);
+        else
+            perf.bytes += CountSampledPairs(block, BP_PairLanesWide(), sample, limits, idx, counts, numCandidates);
+        
+        BP_TRACE_SCOPE("confirm pairs");
+        PerfScope confirm("confirm pairs", size);
+        uint8_t pairBytes[2*BP_MAX_CANDIDATES];
+        CandidateBytes(idx, numCandidates, pairBytes);
+        for(int c = 0; c < numCandidates; ++c)
+            counts[c] = 0;
+        bp_kernels.countPairsOf(data, size, pairBytes, numCandidates, counts);
+        SortCandidates(idx, counts, numCandidates);
+    }
+    
+    int n = 0;
+    for(int c = 0; c < numCandidates && n < max; ++c)
+    {
+        if(n > 0 && (counts[c] == 0 || 2*counts[c] < counts[0]))
+            break;
+        pairs[n].count = counts[c];
+        pairs[n].first = idx[c] >> 8;
+        pairs[n].second = idx[c] & 0xFF;
+        if(n == 0 || block->CanBatch(pairs, n + 1))
+            ++n;
+    }
+    if(limits && pairs[0].count == 0)
+        pairs[0].first = pairs[0].second = block->unused.front();
+    return n;
+}
+
+// An encoded block on its way to the serializer. If pairs is not empty, a pair
+// table record is written ahead of the block.
+struct EncodedBlock {
+    Block * blk;
+    std::vector<PairCount> pairs;
+    bool masked;
+};
+
+// Apply one pass to blk, recording it in passLog if log is set. searchTime is
+// the time it took to find the pair.
+static inline bool RunPass(Block * blk, int sub, const PairCount & pair, bool elide, bool log, double searchTime = 0)
+{
+    if(!log)
+        return blk->DoSubs(sub, pair.first, pair.second, elide);
+    
+    size_t sizeBefore = blk->data.size();
+    double startT = GetTimerSeconds();
+    bool applied = blk->DoSubs(sub, pair.first, pair.second, elide);
+    PassRecord rec = {sub, pair.first, pair.second, sizeBefore - blk->data.size(), 1, searchTime, GetTimerSeconds() - startT};
+    if(applied)
+        blk->passLog.push_back(rec);
+    return applied;
+}
+
+// Apply n passes to blk in one sweep, which must pass Block::CanBatch(). The
+// sweep's time is split evenly over the passes in passLog.
+static inline void RunPasses(Block * blk, int sub, const PairCount * pairs, int n, bool log, double searchTime = 0)
+{
+    if(n == 1) {
+        RunPass(blk, sub, pairs[0], false, log, searchTime);
+        return;
+    }
+    
+    size_t counts[BP_MAX_BATCH];
+    double startT = log? GetTimerSeconds() : 0;
+    blk->DoSubsMany(pairs, n, counts);
+    if(!log)
+        return;
+    double subsTime = GetTimerSeconds() - startT;
+    for(int i = 0; i < n; ++i) {
+        PassRecord rec = {sub + i, pairs[i].first, pairs[i].second, counts[i], 1, searchTime/n, subsTime/n};
+        blk->passLog.push_back(rec);
+    }
+}
+
+// Apply one pass of a shared table to blk, unless the pair doesn't occur or
+// would take blk over limits. The pass is left clear in passMask if so.
+static inline bool RunSharedPass(Block * blk, int sub, const PairCount & pair, bool log, const DecodeLimits * limits)
+{
+    if(limits && !blk->Allows(pair.first, pair.second, *limits))
+        return false;
+    return RunPass(blk, sub, pair, true, log);
+}
+
+static inline double PassLogTime(const Block * blk)
+{
+    double t = 0;
+    for(auto & rec : blk->passLog)
+        t += rec.searchTime + rec.subsTime;
+    return t;
+}
+
+static inline bool SamePairs(const std::vector<PairCount> & a, const std::vector<PairCount> & b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(size_t j = 0; j < a.size(); ++j)
+        if(a[j].first != b[j].first || a[j].second != b[j].second)
+            return false;
+    return true;
+}
+
+// Beam search: default and widest beam, and the candidate pairs each table
+// in the beam is extended with per pass
+#define BP_BEAM_WIDTH       (4)
+#define BP_MAX_BEAM         (16)
+#define BP_BEAM_CANDIDATES  (8)
+
+// A partial table in a beam search, with the block its passes have been
+// applied to and the counts of every adjacent pair in the block. seen lists
+// each pair counted once, so only those need to be searched or copied; some
+// may no longer occur. The greedy node is the one greedy search would have
+// reached.
+struct BeamNode {
+    Block * blk;
+    std::vector<uint32_t> counts;
+    std::vector<uint16_t> seen;
+    std::vector<PairCount> pairs;
+    bool greedy;
+};
+
+// One pass more on a beam node, scored by the bytes it would have saved in
+// all: the node's own and the count of the new pair. rank is the pair's
+// place in the node's count, -1 for an extension that is always kept.
+struct BeamChild {
+    size_t node;
+    int rank;
+    PairCount pair;
+    size_t score;
+};
+
+static inline void RunLoop(LoopPool * pool, size_t n, const std::function<void(size_t)> & fn)
+{
+    if(pool)
+        pool->Run(n, fn);
+    else
+        for(size_t i = 0; i < n; ++i)
+            fn(i);
+}
+
+// Whether two tables hold the same pairs in some order. Passes that don't
+// interact give the same size in either order, so only one is kept.
+static inline bool SamePairSet(std::vector<PairCount> a, std::vector<PairCount> b)
+{
+    auto less = [](const PairCount & x, const PairCount & y) {
+        return (x.first << 8 | x.second) < (y.first << 8 | y.second);
+    };
+    std::sort(a.begin(), a.end(), less);
+    std::sort(b.begin(), b.end(), less);
+    return SamePairs(a, b);
+}
+
+static inline void CountBeamPair(BeamNode & node, int pair)
+{
+    if(node.counts[pair]++ == 0)
+        node.seen.push_back(pair);
+}
+
+// Substituting a pair only changes the counts of the pairs that overlap a
+// replacement. UncountReplaced() takes the old ones out before the pass,
+// finding replacements as the substitute kernels do, and CountKeyPairs()
+// adds the new ones after it, which all hold the new key.
+static inline void UncountReplaced(BeamNode & node, uint8_t first, uint8_t second)
+{
+    const uint8_t * d = &node.blk->data[0];
+    size_t size = node.blk->data.size();
+    uint32_t * counts = &node.counts[0];
+    bool replaced = false;// the byte before j ended a replacement
+    for(size_t j = 0; j + 1 < size; )
+    {
+        if(d[j] != first || d[j + 1] != second) {
+            const uint8_t * p = (const uint8_t *)memchr(d + j + 1, first, size - j - 1);
+            if(!p)
+                break;
+            replaced = false;
+            j = p - d;
+            continue;
+        }
+        // A pair that ended the last replacement was taken out with it
+        if(j > 0 && !replaced)
+            --counts[(d[j - 1] << 8) | first];
+        --counts[(first << 8) | second];
+        if(j + 2 < size)
+            --counts[(second << 8) | d[j + 2]];
+        replaced = true;
+        j += 2;
+    }
+}
+
+static inline void CountKeyPairs(BeamNode & node, uint8_t key)
+{
+    const uint8_t * d = &node.blk->data[0];
+    size_t size = node.blk->data.size();
+    for(const uint8_t * p = d; (p = (const uint8_t *)memchr(p, key, d + size - p)) != NULL; ++p)
+    {
+        size_t j = p - d;
+        if(j > 0 && d[j - 1] != key)
+            CountBeamPair(node, (d[j - 1] << 8) | key);
+        if(j + 1 < size)
+            CountBeamPair(node, (key << 8) | d[j + 1]);
+    }
+}
+
+// The k most frequent pairs of a beam node from its counts, as
+// CountTopPairs() would find them in its block. Pairs that no longer occur
+// are dropped from seen.
+static inline void TopNodePairs(BeamNode & node, int * idx, uint32_t * counts, int k, const DecodeLimits * limits)
+{
+    for(int t = 0; t < k; ++t) {
+        idx[t] = t;
+        counts[t] = 0;
+    }
+    size_t numSeen = 0;
+    for(size_t s = 0; s < node.seen.size(); ++s)
+    {
+        int pair = node.seen[s];
+        uint32_t c = node.counts[pair];
+        if(!c)
+            continue;
+        node.seen[numSeen++] = pair;
+        if(c < counts[k - 1] || (c == counts[k - 1] && pair > idx[k - 1]))
+            continue;
+        if(limits && !node.blk->Allows(pair >> 8, pair & 0xFF, *limits))
+            continue;
+        int t = k - 1;
+        for(; t > 0 && (counts[t - 1] < c || (counts[t - 1] == c && idx[t - 1] > pair)); --t) {
+            idx[t] = idx[t - 1];
+            counts[t] = counts[t - 1];
+        }
+        idx[t] = pair;
+        counts[t] = c;
+    }
+    node.seen.resize(numSeen);
+}
+
+// Apply one pass to a beam node, keeping its counts up to date
+static inline void RunBeamPass(BeamNode & node, int sub, const PairCount & pair, bool log)
+{
+    BP_TRACE_SCOPE("count pairs");
+    uint8_t key = node.blk->unused.back();
+    UncountReplaced(node, pair.first, pair.second);
+    RunPass(node.blk, sub, pair, false, log);
+    CountKeyPairs(node, key);
+}
+
+// Table for blk found by a beam search, applied to blk. Each pass, every
+// table in the beam is extended with its BP_BEAM_CANDIDATES most frequent
+// pairs, and the width extensions that save the most go on. Each node keeps
+// the pair counts of its block up to date from pass to pass, so extensions
+// are scored without counting the block again, and a node's block and
+// counts are only copied for its second and later extensions kept. The
+// greedy path always stays in the beam, so the result is never larger than
+// greedy search's. Passes for the tables in the beam run on pool. Once
+// deadline (0 for none) has passed, the greedy table and the best so far are
+// each finished greedily. If passes are logged, the time of the whole search
+// is split over the passes of the table kept.
+static inline void BeamSearchPairs(Block * blk, int numPasses, int width, const DecodeLimits * limits,
+                                   LoopPool * pool, double deadline, bool log, std::vector<PairCount> & pairs)
+{
+    BP_TRACE_SCOPE("beam search");
+    double startT = log? GetTimerSeconds() : 0;
+    size_t startSize = blk->data.size(), startLog = blk->passLog.size();
+    std::vector<BeamNode> beam(1), next;
+    beam[0].blk = new Block(*blk);
+    beam[0].counts.assign(65536, 0);
+    for(size_t j = 0; j + 1 < startSize; ++j)
+        CountBeamPair(beam[0], (blk->data[j] << 8) | blk->data[j + 1]);
+    beam[0].greedy = true;
+    
+    // Counts of nodes dropped, cleared for copies to use again
+    std::vector<std::vector<uint32_t>> spare;
+    
+    // The greedy node is always first in the beam
+    bool finishing = false;
+    std::vector<std::vector<BeamChild>> children;
+    for(int sub = 0; sub < numPasses; ++sub)
+    {
+        if(!finishing && deadline && GetTimerSeconds() > deadline)
+        {
+            size_t best = 0;
+            for(size_t i = 1; i < beam.size(); ++i)
+                if(beam[i].blk->data.size() < beam[best].blk->data.size())
+                    best = i;
+            for(size_t i = 1; i < beam.size(); ++i)
+                if(i != best)
+                    delete beam[i].blk;
+            if(best > 1)
+                std::swap(beam[1], beam[best]);
+            beam.resize(best? 2 : 1);
+            finishing = true;
+        }
+        
+        // Greedy extensions are always kept: the greedy node's, or every
+        // node's once finishing
+        children.assign(beam.size(), std::vector<BeamChild>());
+        RunLoop(pool, beam.size(), [&](size_t i) {
+            BeamNode & node = beam[i];
+            size_t saved = startSize - node.blk->data.size();
+            int idx[BP_BEAM_CANDIDATES];
+            uint32_t counts[BP_BEAM_CANDIDATES];
+            TopNodePairs(node, idx, counts, BP_BEAM_CANDIDATES, limits);
+            for(int c = 0; c < BP_BEAM_CANDIDATES; ++c)
+            {
+                bool keep = (c == 0) && (node.greedy || finishing);
+                if(!keep && (!counts[c] || finishing))
+                    break;
+                PairCount pair = {counts[c], (uint8_t)(idx[c] >> 8), (uint8_t)(idx[c] & 0xFF)};
+                if(limits && !counts[c])
+                    pair.first = pair.second = node.blk->unused.front();
+                BeamChild child = {i, keep? -1 : c, pair, saved + pair.count};
+                children[i].push_back(child);
+            }
+        });
+        
+        // The kept extensions go on first, then the best of the rest
+        std::vector<BeamChild> all, chosen;
+        for(auto & list : children)
+            for(auto & child : list) {
+                if(child.rank < 0)
+                    chosen.push_back(child);
+                else
+                    all.push_back(child);
+            }
+        std::stable_sort(all.begin(), all.end(), [](const BeamChild & a, const BeamChild & b) {
+            return a.score > b.score;
+        });
+        for(size_t c = 0; c < all.size() && (int)chosen.size() < width; ++c)
+        {
+            std::vector<PairCount> table = beam[all[c].node].pairs;
+            table.push_back(all[c].pair);
+            bool repeat = false;
+            for(size_t k = 0; k < chosen.size() && !repeat; ++k) {
+                if(chosen[k].score != all[c].score)
+                    continue;
+                std::vector<PairCount> other = beam[chosen[k].node].pairs;
+                other.push_back(chosen[k].pair);
+                repeat = SamePairSet(table, other);
+            }
+            if(!repeat)
+                chosen.push_back(all[c]);
+        }
+        
+        // A node's first extension kept takes over its block and counts,
+        // once any others have copied them
+        std::vector<int> owner(beam.size(), -1);
+        next.assign(chosen.size(), BeamNode());
+        for(size_t c = 0; c < chosen.size(); ++c)
+        {
+            if(owner[chosen[c].node] < 0) {
+                owner[chosen[c].node] = c;
+                continue;
+            }
+            if(spare.empty())
+                next[c].counts.assign(65536, 0);
+            else {
+                next[c].counts.swap(spare.back());
+                spare.pop_back();
+            }
+        }
+        RunLoop(pool, chosen.size(), [&](size_t c) {
+            const BeamNode & parent = beam[chosen[c].node];
+            if(owner[chosen[c].node] != (int)c) {
+                next[c].blk = new Block(*parent.blk);
+                for(uint16_t pair : parent.seen)
+                    next[c].counts[pair] = parent.counts[pair];
+                next[c].seen = parent.seen;
+            }
+            next[c].pairs = parent.pairs;
+            next[c].pairs.push_back(chosen[c].pair);
+            next[c].greedy = parent.greedy && chosen[c].rank < 0;
+        });
+        for(size_t i = 0; i < beam.size(); ++i)
+        {
+            BeamNode & node = beam[i];
+            if(owner[i] >= 0) {
+                next[owner[i]].blk = node.blk;
+                next[owner[i]].counts.swap(node.counts);
+                next[owner[i]].seen.swap(node.seen);
+                continue;
+            }
+            delete node.blk;
+            for(uint16_t pair : node.seen)
+                node.counts[pair] = 0;
+            spare.push_back(std::vector<uint32_t>());
+            spare.back().swap(node.counts);
+        }
+        RunLoop(pool, next.size(), [&](size_t c) {
+            RunBeamPass(next[c], sub, next[c].pairs.back(), log);
+        });
+        beam.swap(next);
+    }
+    
+    // Ties go to the greedy table
+    size_t best = 0;
+    for(size_t i = 1; i < beam.size(); ++i)
+        if(beam[i].blk->data.size() < beam[best].blk->data.size())
+            best = i;
+    std::swap(*blk, *beam[best].blk);
+    pairs.insert(pairs.end(), beam[best].pairs.begin(), beam[best].pairs.end());
+    for(auto & node : beam)
+        delete node.blk;
+    
+    if(log && blk->passLog.size() > startLog)
+    {
+        double searchTime = GetTimerSeconds() - startT;
+        for(size_t j = startLog; j < blk->passLog.size(); ++j)
+            searchTime -= blk->passLog[j].subsTime;
+        searchTime = std::max(0.0, searchTime)/(blk->passLog.size() - startLog);
+        for(size_t j = startLog; j < blk->passLog.size(); ++j)
+            blk->passLog[j].searchTime = searchTime;
+    }
+}
+
+// Type 1 pair table search for one stream. Carries the last table written,
+// and the sizes of the block it was searched for, from block to block.
+struct TableSearch {
+    std::vector<PairCount> prevPairs;
+    size_t prevRawSize, prevCompSize;
+    bool logPasses;// record passes in each block's passLog
+    Effort effort;// full search settings
+    DecodeLimits limits;// a table has maxPasses pairs if that is set
+    LoopPool * pool;// threads for a beam search, NULL to run it on this one
+    
+    TableSearch(): prevRawSize(0), prevCompSize(0), logPasses(false), effort(BP_Effort(BP_MAX_EFFORT)), limits(),
+        pool(NULL) {}
+    
+    // Substitutes blk in place. enc.pairs is only filled in if the block
+    // needs a new table. Returns true if the previous table was reused.
+    bool Encode(Block * blk, EncodedBlock & enc);
+};
+
+inline bool TableSearch::Encode(Block * blk, EncodedBlock & enc)
+{
+    const int numPasses = limits.maxPasses? std::min(limits.maxPasses, NUMPASSES) : NUMPASSES;
+    const size_t tableSize = 3 + 2*numPasses;
+    size_t rawSize = blk->data.size();
+    std::vector<PairCount> pairs;
+    
+    // Warm start: apply the previous table, and keep it if it does no
+    // worse than a new table would, allowing for the table that is saved.
+    // With quickReuse, it is kept without a search if it does no worse than
+    // the previous new table's ratio would predict. Keys nest differently in
+    // each block, so the result is checked against limits.
+    Block * trial = NULL;
+    if(!prevPairs.empty())
+    {
+        // Runs of passes that don't interact share a sweep, which gives the
+        // same result as applying them one at a time
+        trial = new Block(*blk);
+        for(int sub = 0; sub < numPasses; )
+        {
+            int n = 1;
+            while(sub + n < numPasses && trial->CanBatch(&prevPairs[sub], n + 1))
+                ++n;
+            RunPasses(trial, sub, &prevPairs[sub], n, logPasses);
+            sub += n;
+        }
+        if(!trial->Within(limits)) {
+            blk->discardedTime += PassLogTime(trial);
+            delete trial;
+            trial = NULL;
+        }
+    }
+    if(trial && effort.quickReuse)
+    {
+        size_t expectedSize = rawSize*prevCompSize/prevRawSize;
+        if(trial->data.size() <= expectedSize + tableSize) {
+            std::swap(*blk, *trial);
+            pairs = prevPairs;
+        }
+    }
+    
+    if(pairs.empty())
+    {
+        if(effort.beam > 1 && (!effort.deadline || GetTimerSeconds() < effort.deadline))
+            BeamSearchPairs(blk, numPasses, effort.beam, limits.Any()? &limits : NULL, pool, effort.deadline,
+                            logPasses, pairs);
+        for(int sub = pairs.size(); sub < numPasses; )
+        {
+            PairCount bestPairs[BP_MAX_BATCH];
+            double startT = logPasses? GetTimerSeconds() : 0;
+            int n = GetBestPairs(blk, bestPairs, std::min(effort.batch, numPasses - sub), effort.sample,
+                                 limits.Any()? &limits : NULL);
+            double searchTime = logPasses? GetTimerSeconds() - startT : 0;
+            pairs.insert(pairs.end(), bestPairs, bestPairs + n);
+            RunPasses(blk, sub, bestPairs, n, logPasses, searchTime);
+            sub += n;
+        }
+        
+        if(trial && trial->data.size() <= blk->data.size() + tableSize) {
+            // Full search did not gain enough to pay for a new table
+            std::swap(*blk, *trial);
+            pairs = prevPairs;
+        }
+        else if(!SamePairs(pairs, prevPairs)) {
+            prevRawSize = rawSize;
+            prevCompSize = blk->data.size();
+        }
+    }
+    if(trial)
+        blk->discardedTime += PassLogTime(trial);
+    delete trial;
+    
+    int numSubs = blk->subs.size();
+    if(numSubs != numPasses)
+    {
+        fprintf(stderr, "Block had %d substitutions, %d expected\n", numSubs, numPasses);
+        exit(EXIT_FAILURE);
+    }
+    
+    enc.blk = blk;
+    enc.masked = false;
+    enc.pairs.clear();
+    if(SamePairs(pairs, prevPairs))
+        return true;
+    enc.pairs = pairs;
+    prevPairs = pairs;
+    return false;
+}
+
+// Find a shared table over blocks, substituting each pass as it is chosen and
+// skipping blocks that don't contain the pair.
+// If tableLog is given, each pass is recorded there with its totals over all
+// blocks, and in the passLog of each block it was applied to. Pairs are
+// counted in one of every sample blocks, see GetBestPair(). Blocks skip passes
+// that would take them over limits.
+static inline void BuildSharedTable(std::vector<Block *> & blocks, std::vector<PairCount> & pairs,
+                                    std::vector<PassRecord> * tableLog = NULL, int sample = 1,
+                                    const DecodeLimits * limits = NULL)
+{
+    for(int sub = 0; sub < NUMPASSES; ++sub)
+    {
+        // find best pair across all blocks
+        PairCount bestPair;
+        double startT = tableLog? GetTimerSeconds() : 0;
+        GetBestPair(blocks, bestPair, sample);
+        double searchTime = tableLog? GetTimerSeconds() - startT : 0;
+        pairs.push_back(bestPair);
+        
+        // Do substitution, skipping blocks that don't contain the pair
+        startT = tableLog? GetTimerSeconds() : 0;
+        for(auto & blk : blocks)
+            RunSharedPass(blk, sub, bestPair, tableLog != NULL, limits);
+        
+        if(tableLog)
+        {
+            PassRecord rec = {sub, bestPair.first, bestPair.second, 0, 0, searchTime, GetTimerSeconds() - startT};
+            for(auto & blk : blocks)
+                if(!blk->passLog.empty() && blk->passLog.back().sub == sub) {
+                    rec.count += blk->passLog.back().count;
+                    ++rec.numBlocks;
+                }
+            tableLog->push_back(rec);
+        }
+    }
+}
+
+// Pad out the pass mask of a block encoded against a shared table, and check
+// it has a key for each pass applied.
+static inline void FinishMasked(Block * blk)
+{
+    int numSubs = blk->subs.size();
+    blk->passMask.resize((NUMPASSES + 7)/8, 0);
+    
+    int maskedSubs = 0;
+    for(int sub = 0; sub < NUMPASSES; ++sub)
+        if(blk->passMask[sub >> 3] & (1 << (sub & 7)))
+            ++maskedSubs;
+    if(numSubs != maskedSubs)
+    {
+        fprintf(stderr, "Block had %d substitutions, %d expected\n", numSubs, maskedSubs);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void PutU32(uint8_t * bfr, uint32_t val)
+{
+    bfr[0] = val >> 24;
+    bfr[1] = (val >> 16) & 0xFF;
+    bfr[2] = (val >> 8) & 0xFF;
+    bfr[3] = val & 0xFF;
+}
+
+static inline void SerializeTable(const std::vector<PairCount> & pairs, bool masked, std::vector<uint8_t> & out)
+{
+    if(masked) {
+        out.push_back((BP_EXT_RECORD >> 8) & 0xFF);
+        out.push_back(BP_EXT_RECORD & 0xFF);
+        out.push_back(BP_EXT_MASKED_TABLE);
+    }
+    else {
+        out.push_back(0x00);
+        out.push_back(0x00);
+    }
+    out.push_back(pairs.size());
+    for(auto & pair : pairs) {
+        // printf("pair: %d, %d\n", (int)pair.first, (int)pair.second);
+        out.push_back(pair.first);
+        out.push_back(pair.second);
+    }
+}
+
+// Serialize a block, and its pair table if it has one, into one contiguous
+// buffer.
+// With entropy set, the data is entropy coded if that makes it smaller.
+static inline void SerializeBlock(const EncodedBlock & enc, std::vector<uint8_t> & out, bool checksum,
+                                  bool entropy = false)
+{
+    BP_TRACE_SCOPE("serialize");
+    PerfScope perf("serialize", enc.blk->data.size());
+    const Block * blk = enc.blk;
+    out.insert(out.end(), blk->matches.begin(), blk->matches.end());
+    if(!enc.pairs.empty())
+        SerializeTable(enc.pairs, enc.masked, out);
+    
+    // Checksum record is filled in once the block record is complete
+    size_t crcPos = out.size();
+    if(checksum) {
+        out.push_back((BP_EXT_RECORD >> 8) & 0xFF);
+        out.push_back(BP_EXT_RECORD & 0xFF);
+        out.push_back(BP_EXT_CHECKSUM);
+        out.resize(out.size() + 8);
+    }
+    
+    // printf("Block size: %d, num subs: %d\n", blockSize, numSubs);
+    // Blocks that decode to more than fits a 16-bit size take a long block
+    // record, so the decoder knows to allow them to
+    size_t blockPos = out.size();
+    size_t blockSize = blk->data.size();
+    static thread_local std::vector<uint8_t> coded;
+    coded.clear();
+    if(entropy)
+    {
+        PerfScope perf("entropy code", blockSize);
+        entropy = BP_EncodeFSE(blk->data.data(), blockSize, coded);
+    }
+    if(entropy) {
+        uint8_t size[10];
+        out.push_back((BP_EXT_RECORD >> 8) & 0xFF);
+        out.push_back(BP_EXT_RECORD & 0xFF);
+        out.push_back(BP_EXT_CODED_BLOCK);
+        out.insert(out.end(), size, size + BP_EncodeFlexInt(blockSize, size));
+        out.insert(out.end(), size, size + BP_EncodeFlexInt(coded.size(), size));
+    }
+    else if(blk->rawSize > BP_MAX_BLOCK_SIZE) {
+        uint8_t size[10];
+        out.push_back((BP_EXT_RECORD >> 8) & 0xFF);
+        out.push_back(BP_EXT_RECORD & 0xFF);
+        out.push_back(BP_EXT_LONG_BLOCK);
+        out.insert(out.end(), size, size + BP_EncodeFlexInt(blockSize, size));
+    }
+    else {
+        out.push_back((blockSize >> 8) & 0xFF);
+        out.push_back(blockSize & 0xFF);
+    }
+    if(enc.masked)
+        out.insert(out.end(), blk->passMask.begin(), blk->passMask.end());
+    out.insert(out.end(), blk->subs.begin(), blk->subs.end());
+    if(entropy)
+        out.insert(out.end(), coded.begin(), coded.end());
+    else
+        out.insert(out.end(), blk->data.begin(), blk->data.end());
+    
+    if(checksum) {
+        // The match record the block starts its segment with is covered too
+        uint32_t recordCRC = BP_CRC32C(blk->matches.data(), blk->matches.size());
+        recordCRC = BP_CRC32C_Append(recordCRC, &out[blockPos], out.size() - blockPos);
+        PutU32(&out[crcPos + 3], recordCRC);
+        PutU32(&out[crcPos + 7], blk->dataCRC);
+    }
+}
+// *****************************************************************************
+// Wide blocks. Symbols are 16 bits: 0-255 stand for themselves, and pass i
+// replaces its pair with symbol 256 + i. No byte value has to be missing from
+// a block to serve as a key, so blocks can be as large as memory allows and
+// run hundreds of passes.
+
+struct WideBlock {
+    std::vector<uint16_t> symbols;
+    std::vector<uint16_t> pairs;// first and second symbol of each pass
+    size_t rawSize;
+    uint32_t dataCRC;// CRC-32C of the raw block, if checksums are enabled
+};
+
+// Bits per symbol for a block with numSubs passes
+static inline int WideWidth(int numSubs)
+{
+    int width = 8;
+    while(256 + numSubs > (1 << width))
+        ++width;
+    return width;
+}
+
+// Pair search for wide blocks. Counts of every pair of symbols are kept in a
+// dense table and updated as each pass is substituted, so the block is only
+// counted once. The best pair is found from the largest count in each row,
+// which is only searched for again after a count that may have been it goes
+// down.
+struct WideEncoder {
+    int maxPasses;
+    std::vector<uint32_t> counts;// (first*(256 + maxPasses) + second)
+    std::vector<uint32_t> rowMax;
+    std::vector<uint8_t> stale;// rowMax may be above the row's largest count
+    std::vector<uint16_t> saved;// symbols before the width last went up
+    
+    WideEncoder(int _maxPasses): maxPasses(_maxPasses) {}
+    
+    void Encode(const uint8_t * data, size_t size, WideBlock & blk);
+    
+  private:
+    void Inc(int first, int second);
+    void Dec(int first, int second);
+    uint32_t Best(int numSymbols, int & first, int & second);
+    void Substitute(std::vector<uint16_t> & symbols, int first, int second, int key);
+};
+
+inline void WideEncoder::Inc(int first, int second)
+{
+    uint32_t c = ++counts[(size_t)first*(256 + maxPasses) + second];
+    rowMax[first] = std::max(rowMax[first], c);
+}
+
+inline void WideEncoder::Dec(int first, int second)
+{
+    if(counts[(size_t)first*(256 + maxPasses) + second]-- == rowMax[first])
+        stale[first] = 1;
+}
+
+// Most frequent pair among the first numSymbols symbols, the lowest on a tie
+inline uint32_t WideEncoder::Best(int numSymbols, int & first, int & second)
+{
+    const size_t stride = 256 + maxPasses;
+    uint32_t best = 0;
+    first = second = 0;
+    for(int r = 0; r < numSymbols; ++r)
+    {
+        if(stale[r]) {
+            const uint32_t * row = &counts[r*stride];
+            uint32_t most = 0;
+            for(int c = 0; c < numSymbols; ++c)
+                most = std::max(most, row[c]);
+            rowMax[r] = most;
+            stale[r] = 0;
+        }
+        if(rowMax[r] > best) {
+            best = rowMax[r];
+            first = r;
+        }
+    }
+    const uint32_t * row = &counts[first*stride];
+    while(best && row[second] != best)
+        ++second;
+    return best;
+}
+
+// Replace the pair with key, scanning from the front, in place. Each
+// replacement takes the pair and its links to its neighbours out of the
+// counts, and adds the key's links to them. Most passes replace few pairs, so
+// runs without one are found with a loop the compiler vectorizes, and moved
+// down whole.
+inline void WideEncoder::Substitute(std::vector<uint16_t> & symbols, int first, int second, int key)
+{
+    BP_TRACE_SCOPE("substitute");
+    PerfScope perf("substitute", symbols.size());
+    const size_t run = 32;
+    const uint16_t a = first, b = second;
+    uint16_t * x = &symbols[0];
+    size_t n = symbols.size(), in = 0, out = 0;
+    while(in < n)
+    {
+        size_t end = std::min(n, in + run);
+        if(end < n)
+        {
+            uint16_t found = 0;
+            for(size_t j = in; j < end; ++j)
+                found |= (x[j] == a) & (x[j + 1] == b);
+            if(!found) {
+                if(out != in)
+                    memmove(x + out, x + in, run*sizeof(uint16_t));
+                in = end;
+                out += run;
+                continue;
+            }
+        }
+        
+        while(in < end)
+        {
+            if(x[in] != a || in + 1 == n || x[in + 1] != b) {
+                x[out++] = x[in++];
+                continue;
+            }
+            if(out) {
+                Dec(x[out - 1], a);
+                Inc(x[out - 1], key);
+            }
+            Dec(a, b);
+            if(in + 2 < n) {
+                Dec(b, x[in + 2]);
+                Inc(key, x[in + 2]);
+            }
+            x[out++] = key;
+            in += 2;
+        }
+    }
+    symbols.resize(out);
+}
+
+// Passes stop when a pair no longer saves more than the 4 bytes it takes to
+// store, or the keys' expansions would not fit in a decoder's table. Every
+// symbol grows by a bit when the alphabet passes a power of two, which the
+// passes after it may not make up for, so the symbols are saved each time
+// and the block goes back to them if it ends up larger.
+static inline size_t WideSize(size_t numSymbols, int numSubs) {
+    return 4*numSubs + (numSymbols*WideWidth(numSubs) + 7)/8;
+}
+
+inline void WideEncoder::Encode(const uint8_t * data, size_t size, WideBlock & blk)
+{
+    BP_TRACE_SCOPE("encode wide block");
+    const size_t stride = 256 + maxPasses;
+    counts.assign(stride*stride, 0);
+    rowMax.assign(stride, 0);
+    stale.assign(stride, 1);
+    blk.rawSize = size;
+    blk.symbols.assign(data, data + size);
+    blk.pairs.clear();
+    {
+        PerfScope perf("count pairs", size);
+        for(size_t j = 0; j + 1 < size; ++j)
+            ++counts[data[j]*stride + data[j + 1]];
+    }
+    
+    std::vector<size_t> keyLength(stride, 1);
+    size_t tableSize = 0;
+    size_t savedSize = (size_t)-1;
+    int savedSubs = 0;
+    for(int sub = 0; sub < maxPasses; ++sub)
+    {
+        if(WideWidth(sub + 1) > WideWidth(sub) && WideSize(blk.symbols.size(), sub) < savedSize) {
+            saved = blk.symbols;
+            savedSize = WideSize(saved.size(), sub);
+            savedSubs = sub;
+        }
+        
+        int first, second;
+        uint32_t count;
+        {
+            PerfScope perf("find best pair", 0);
+            count = Best(256 + sub, first, second);
+        }
+        size_t length = keyLength[first] + keyLength[second];
+        if(count*WideWidth(sub + 1) <= 32 || tableSize + length > BP_WIDE_MAX_TABLE)
+            break;
+        Substitute(blk.symbols, first, second, 256 + sub);
+        blk.pairs.push_back(first);
+        blk.pairs.push_back(second);
+        keyLength[256 + sub] = length;
+        tableSize += length;
+    }
+    
+    if(savedSize < WideSize(blk.symbols.size(), blk.pairs.size()/2)) {
+        blk.symbols.swap(saved);
+        blk.pairs.resize(2*savedSubs);
+    }
+}
+
+// (0xFFFF) (0x04) (NUM_SUBS:2) (WIDTH:1) (RAW_SIZE:4) (NUM_SYMBOLS:4)
+// (PAIRS:NUM_SUBS*4) (DATA:(NUM_SYMBOLS*WIDTH + 7)/8), see bpenc.cpp
+static inline void SerializeWide(const WideBlock & blk, std::vector<uint8_t> & out, bool checksum)
+{
+    BP_TRACE_SCOPE("serialize");
+    PerfScope perf("serialize", blk.symbols.size());
+    size_t crcPos = out.size();
+    if(checksum) {
+        out.push_back((BP_EXT_RECORD >> 8) & 0xFF);
+        out.push_back(BP_EXT_RECORD & 0xFF);
+        out.push_back(BP_EXT_CHECKSUM);
+        out.resize(out.size() + 8);
+    }
+    
+    size_t blockPos = out.size();
+    int numSubs = blk.pairs.size()/2;
+    int width = WideWidth(numSubs);
+    out.resize(blockPos + 14);
+    out[blockPos] = (BP_EXT_RECORD >> 8) & 0xFF;
+    out[blockPos + 1] = BP_EXT_RECORD & 0xFF;
+    out[blockPos + 2] = BP_EXT_WIDE_BLOCK;
+    out[blockPos + 3] = numSubs >> 8;
+    out[blockPos + 4] = numSubs & 0xFF;
+    out[blockPos + 5] = width;
+    PutU32(&out[blockPos + 6], blk.rawSize);
+    PutU32(&out[blockPos + 10], blk.symbols.size());
+    for(auto s : blk.pairs) {
+        out.push_back(s >> 8);
+        out.push_back(s & 0xFF);
+    }
+    
+    // Symbols are packed least significant bit first
+    out.reserve(out.size() + (blk.symbols.size()*width + 7)/8);
+    uint64_t acc = 0;
+    int bits = 0;
+    for(auto s : blk.symbols)
+    {
+        acc |= (uint64_t)s << bits;
+        bits += width;
+        while(bits >= 8) {
+            out.push_back(acc & 0xFF);
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if(bits)
+        out.push_back(acc & 0xFF);
+    
+    if(checksum) {
+        PutU32(&out[crcPos + 3], BP_CRC32C(&out[blockPos], out.size() - blockPos));
+        PutU32(&out[crcPos + 7], blk.dataCRC);
+    }
+}
+
+// *****************************************************************************
+// Long-range matches. With --matches the input is taken a segment at a time,
+// and repeats of BP_MATCH_MIN bytes or more, from within the segment or the
+// BP_MATCH_WINDOW bytes before it, are replaced by references in a match
+// record. Only the literals left over go on to be cut into blocks, so pairs
+// are searched for in less data, and repeats far longer than any key cost a
+// few bytes each.
+
+struct Match {
+    size_t literals;// literal bytes before the match
+    size_t distance, length;
+};
+
+// Finds matches with a rolling hash of the last BP_MATCH_MIN bytes. Every
+// position is entered in the hash table, and the latest one with the same
+// hash is checked at each literal position.
+struct MatchFinder {
+    std::vector<uint8_t> history;// window before the segment, then the segment
+    size_t base;// stream offset of history[0]
+    std::vector<uint32_t> table;// low bits of the stream offset of the last position with each hash
+    
+    MatchFinder(): base(0), table((size_t)1 << BP_MATCH_HASH_BITS, 0) {}
+    
+    // Find matches in the n bytes of seg, appending its literals to lits.
+    // The last byte is always a literal, so every segment has at least one.
+    void Find(const uint8_t * seg, size_t n, std::vector<uint8_t> & lits, std::vector<Match> & matches);
+};
+
+static inline uint32_t MatchHash(uint32_t h) {
+    return (h*2654435761u) >> (32 - BP_MATCH_HASH_BITS);
+}
+
+inline void MatchFinder::Find(const uint8_t * seg, size_t n, std::vector<uint8_t> & lits, std::vector<Match> & matches)
+{
+    BP_TRACE_SCOPE("find matches");
+    PerfScope perf("find matches", n);
+    const uint32_t mult = 0x01000193;
+    uint32_t multPow = 1;// mult^BP_MATCH_MIN, to take a byte back out
+    for(int j = 0; j < BP_MATCH_MIN; ++j)
+        multPow *= mult;
+    
+    if(history.size() > 2*BP_MATCH_WINDOW) {
+        size_t drop = history.size() - BP_MATCH_WINDOW;
+        history.erase(history.begin(), history.begin() + drop);
+        base += drop;
+    }
+    size_t start = history.size();
+    history.insert(history.end(), seg, seg + n);
+    const uint8_t * h = &history[0];
+    size_t end = history.size();
+    
+    // Positions at the end of the last segment whose hashes needed this one
+    size_t pos = (start >= BP_MATCH_MIN)? start - BP_MATCH_MIN : 0;
+    size_t litStart = start;
+    uint32_t hash = 0;
+    bool hashed = false;
+    while(pos + BP_MATCH_MIN < end)
+    {
+        if(!hashed) {
+            hash = 0;
+            for(int j = 0; j < BP_MATCH_MIN; ++j)
+                hash = hash*mult + h[pos + j];
+            hashed = true;
+        }
+        // Offsets wrap, but a stale entry only costs a failed compare
+        uint32_t & slot = table[MatchHash(hash)];
+        size_t dist = (uint32_t)(base + pos - slot);
+        slot = base + pos;
+        
+        uint32_t head = 0, candHead = 1;
+        if(dist <= pos) {
+            memcpy(&head, h + pos, 4);
+            memcpy(&candHead, h + pos - dist, 4);
+        }
+        if(pos >= start && dist && dist <= BP_MATCH_WINDOW && head == candHead &&
+           memcmp(h + pos - dist, h + pos, BP_MATCH_MIN) == 0)
+        {
+            size_t from = pos - dist, len = BP_MATCH_MIN;
+            while(pos + len < end - 1 && h[from + len] == h[pos + len])
+                ++len;
+            while(pos > litStart && from > 0 && h[from - 1] == h[pos - 1]) {
+                --pos;
+                --from;
+                ++len;
+            }
+            Match match = {pos - litStart, pos - from, len};
+            matches.push_back(match);
+            lits.insert(lits.end(), h + litStart, h + pos);
+            pos += len;
+            litStart = pos;
+            hashed = false;
+            continue;
+        }
+        hash = (hash*mult + h[pos + BP_MATCH_MIN]) - multPow*h[pos];
+        ++pos;
+    }
+    lits.insert(lits.end(), h + litStart, h + end);
+}
+
+// Match record for a segment whose literals are litSize bytes
+static inline void SerializeMatches(const std::vector<Match> & matches, size_t litSize, std::vector<uint8_t> & out)
+{
+    size_t recPos = out.size();
+    out.push_back((BP_EXT_RECORD >> 8) & 0xFF);
+    out.push_back(BP_EXT_RECORD & 0xFF);
+    out.push_back(BP_EXT_MATCHES);
+    out.resize(out.size() + 4);
+    uint8_t bfr[10];
+    out.insert(out.end(), bfr, bfr + BP_EncodeFlexInt(litSize, bfr));
+    out.insert(out.end(), bfr, bfr + BP_EncodeFlexInt(matches.size(), bfr));
+    for(auto & match : matches) {
+        out.insert(out.end(), bfr, bfr + BP_EncodeFlexInt(match.literals, bfr));
+        out.insert(out.end(), bfr, bfr + BP_EncodeFlexInt(match.distance, bfr));
+        out.insert(out.end(), bfr, bfr + BP_EncodeFlexInt(match.length - BP_MATCH_MIN, bfr));
+    }
+    PutU32(&out[recPos + 3], out.size() - recPos - 7);
+}
+
+// *****************************************************************************
+// Aligned container layout. Multi-byte fields are little-endian, unlike the
+// record stream, so the header arrays can be used in place.
+
+static inline size_t AlignUp(size_t x) {
+    return (x + BP_CONTAINER_ALIGN - 1) & ~(size_t)(BP_CONTAINER_ALIGN - 1);
+}
+
+static inline void PutLE(uint8_t * bfr, uint64_t val, int size) {
+    for(int j = 0; j < size; ++j)
+        bfr[j] = (val >> (8*j)) & 0xFF;
+}
+
+static inline uint16_t GetLE16(const uint8_t * bfr) {
+    return bfr[0] | (bfr[1] << 8);
+}
+
+static inline uint32_t GetLE32(const uint8_t * bfr) {
+    return GetLE16(bfr) | ((uint32_t)GetLE16(bfr + 2) << 16);
+}
+
+static inline uint64_t GetLE64(const uint8_t * bfr) {
+    return GetLE32(bfr) | ((uint64_t)GetLE32(bfr + 4) << 32);
+}
+
+// Offsets of the header arrays from the start of the container. Each array
+// starts on a BP_CONTAINER_ALIGN boundary, and payloads start at dataStart.
+struct ContainerLayout {
+    size_t pairs, compSize, rawSize, tableId, dataOffset, mask, keys, dataCRC, payloadCRC;
+    size_t maskSize;// bytes per block in mask, 0 if unmasked
+    size_t dataStart;
+};
+
+static inline void GetContainerLayout(ContainerLayout & layout, size_t numTables, size_t numBlocks, int numSubs, int flags)
+{
+    layout.maskSize = (flags & BP_CONTAINER_MASKED)? (numSubs + 7)/8 : 0;
+    size_t pos = AlignUp(BP_CONTAINER_HEADER);
+    layout.pairs = pos;
+    pos = AlignUp(pos + numTables*2*numSubs);
+    layout.compSize = pos;
+    pos = AlignUp(pos + numBlocks*2);
+    layout.rawSize = pos;
+    pos = AlignUp(pos + numBlocks*2);
+    layout.tableId = pos;
+    pos = AlignUp(pos + numBlocks*4);
+    layout.dataOffset = pos;
+    pos = AlignUp(pos + numBlocks*8);
+    layout.mask = pos;
+    pos = AlignUp(pos + numBlocks*layout.maskSize);
+    layout.keys = pos;
+    pos = AlignUp(pos + numBlocks*numSubs);
+    layout.dataCRC = pos;
+    layout.payloadCRC = pos;
+    if(flags & BP_CONTAINER_CHECKSUM) {
+        pos = AlignUp(pos + numBlocks*4);
+        layout.payloadCRC = pos;
+        pos = AlignUp(pos + numBlocks*4);
+    }
+    layout.dataStart = pos;
+}
+
+// *****************************************************************************
+// Decoding
+
+// A data block located in the input, with the pair table it uses
+struct BlockRef {
+    const uint8_t * pairs;
+    int numSubs;
+    const uint8_t * mask;// NULL if every pass was applied
+    const uint8_t * keys;
+    int numKeys;
+    const uint8_t * data;
+    size_t size;
+    const uint8_t * record;// complete block record, for the checksum
+    size_t recordSize;
+    bool hasCRC;
+    uint32_t recordCRC, dataCRC;
+    
+    // A wide block has 16-bit pairs, no keys, and size symbols of width bits
+    // each in data. width is 0 for a byte block.
+    int width;
+    size_t rawSize;
+    size_t maxSize;// no key or pass of a byte block can expand beyond this
+    
+    // An entropy-coded block has codedSize bytes in coded that decode to the
+    // size bytes of its data; data is NULL until they are.
+    const uint8_t * coded;
+    size_t codedSize;
+    
+    // Match record of the segment this block starts, NULL if none
+    const uint8_t * matches;
+    size_t matchesSize;
+};
+
+static inline bool CheckRecord(const BlockRef & ref) {
+    if(!ref.hasCRC)
+        return true;
+    // A match record the block starts its segment with is covered too
+    size_t matchesSize = ref.matches? ref.matchesSize : 0;
+    PerfScope perf("checksum", matchesSize + ref.recordSize);
+    uint32_t crc = BP_CRC32C(ref.matches, matchesSize);
+    return BP_CRC32C_Append(crc, ref.record, ref.recordSize) == ref.recordCRC;
+}
+
+static inline bool CheckData(const BlockRef & ref, const uint8_t * data, size_t size) {
+    if(!ref.hasCRC)
+        return true;
+    PerfScope perf("checksum", size);
+    return BP_CRC32C(data, size) == ref.dataCRC;
+}
+
+// Entropy-decode the data of a coded block into dst, which has room for
+// ref.size bytes. Returns false if the coded data is malformed.
+static inline bool DecodeEntropy(const BlockRef & ref, uint8_t * dst)
+{
+    BP_TRACE_SCOPE("entropy decode");
+    PerfScope perf("entropy decode", ref.size);
+    static thread_local FSEDecodeTable tbl;
+    return BP_DecodeFSE(ref.coded, ref.codedSize, dst, ref.size, tbl);
+}
+
+static inline bool BuildExpandTable(const BlockRef & ref, ExpandTable & tbl)
+{
+    BP_TRACE_SCOPE("build expand table");
+    tbl.bytes.resize(256);
+    for(int j = 0; j < 256; ++j) {
+        tbl.bytes[j] = j;
+        tbl.len[j] = 1;
+        tbl.offset[j] = j;
+    }
+    
+    int key = 0;
+    for(int sub = 0; sub < ref.numSubs; ++sub)
+    {
+        if(ref.mask && !(ref.mask[sub >> 3] & (1 << (sub & 7))))
+            continue;
+        uint8_t k = ref.keys[key++];
+        uint8_t pair0 = ref.pairs[sub*2], pair1 = ref.pairs[sub*2 + 1];
+        size_t len0 = tbl.len[pair0], len1 = tbl.len[pair1];
+        size_t offset = tbl.bytes.size();
+        if(len0 + len1 > ref.maxSize || offset - 256 + len0 + len1 > BP_MAX_TABLE)
+            return false;
+        
+        tbl.bytes.resize(offset + len0 + len1);
+        uint8_t * bytes = &tbl.bytes[0];
+        memcpy(bytes + offset, bytes + tbl.offset[pair0], len0);
+        memcpy(bytes + offset + len0, bytes + tbl.offset[pair1], len1);
+        tbl.len[k] = len0 + len1;
+        tbl.offset[k] = offset;
+    }
+    tbl.bytes.resize(tbl.bytes.size() + BP_EXPAND_SLACK);
+    return true;
+}
+
+static inline size_t ExpandedSize(const ExpandTable & tbl, const uint8_t * src, size_t n)
+{
+    BP_TRACE_SCOPE("measure");
+    PerfScope perf("measure", n);
+    size_t size = 0;
+    for(size_t j = 0; j < n; ++j)
+        size += tbl.len[src[j]];
+    return size;
+}
+
+// dst receives exactly dstSize bytes, the ExpandedSize() of src
+static inline void ExpandBytes(uint8_t * dst, size_t dstSize, const ExpandTable & tbl, const uint8_t * src, size_t n)
+{
+    BP_TRACE_SCOPE("expand");
+    PerfScope perf("expand", n);
+    bp_kernels.expand(dst, dstSize, tbl, src, n);
+}
+
+// Expansion of every symbol of a wide block. Fails if a pass refers to a key
+// that isn't defined yet, or the keys expand past what a decoder accepts.
+static inline bool BuildWideTable(const BlockRef & ref, WideExpandTable & tbl)
+{
+    BP_TRACE_SCOPE("build expand table");
+    int numSymbols = 256 + ref.numSubs;
+    tbl.len.resize(numSymbols);
+    tbl.offset.resize(numSymbols);
+    tbl.bytes.resize(256);
+    for(int j = 0; j < 256; ++j) {
+        tbl.bytes[j] = j;
+        tbl.len[j] = 1;
+        tbl.offset[j] = j;
+    }
+    
+    for(int sub = 0; sub < ref.numSubs; ++sub)
+    {
+        const uint8_t * pair = ref.pairs + 4*sub;
+        int pair0 = (pair[0] << 8) | pair[1], pair1 = (pair[2] << 8) | pair[3];
+        if(pair0 >= 256 + sub || pair1 >= 256 + sub)
+            return false;
+        size_t len0 = tbl.len[pair0], len1 = tbl.len[pair1];
+        size_t offset = tbl.bytes.size();
+        if(len0 + len1 > ref.rawSize || offset - 256 + len0 + len1 > BP_WIDE_MAX_TABLE)
+            return false;
+        
+        tbl.bytes.resize(offset + len0 + len1);
+        uint8_t * bytes = &tbl.bytes[0];
+        memcpy(bytes + offset, bytes + tbl.offset[pair0], len0);
+        memcpy(bytes + offset + len0, bytes + tbl.offset[pair1], len1);
+        tbl.len[256 + sub] = len0 + len1;
+        tbl.offset[256 + sub] = offset;
+    }
+    tbl.bytes.resize(tbl.bytes.size() + BP_EXPAND_SLACK);
+    return true;
+}
+
+// Decode a wide block into exactly ref.rawSize bytes at dst, BP_WIDE_CHUNK
+// symbols at a time: unpack them, check and measure them, then expand them.
+// Returns false if the pairs are malformed, a symbol is not in the alphabet,
+// or the symbols don't expand to rawSize bytes.
+static inline bool DecodeWide(const BlockRef & ref, WideExpandTable & tbl, uint8_t * dst)
+{
+    if(!BuildWideTable(ref, tbl))
+        return false;
+    
+    BP_TRACE_SCOPE("expand");
+    PerfScope perf("expand", ref.size);
+    size_t packedSize = (ref.size*ref.width + 7)/8;
+    tbl.symbols.resize(BP_WIDE_CHUNK);
+    uint16_t * symbols = &tbl.symbols[0];
+    size_t outPos = 0;
+    for(size_t j = 0; j < ref.size; j += BP_WIDE_CHUNK)
+    {
+        size_t n = std::min((size_t)BP_WIDE_CHUNK, ref.size - j);
+        size_t offset = j*ref.width/8;
+        bp_kernels.unpackSymbols(symbols, ref.data + offset, packedSize - offset, n, ref.width);
+        
+        uint16_t highest = 0;
+        for(size_t k = 0; k < n; ++k)
+            highest = std::max(highest, symbols[k]);
+        if(highest >= 256 + ref.numSubs)
+            return false;
+        size_t size = 0;
+        for(size_t k = 0; k < n; ++k)
+            size += tbl.len[symbols[k]];
+        if(size > ref.rawSize - outPos)
+            return false;
+        
+        bp_kernels.expandWide(dst + outPos, size, tbl, symbols, n);
+        outPos += size;
+    }
+    return outPos == ref.rawSize;
+}
+
+// Pair table currently in effect, and the checksum for the next data block.
+// Data blocks use the most recent table.
+struct StreamState {
+    const uint8_t * pairs;
+    int numSubs;
+    bool masked;
+    bool hasCRC;
+    uint32_t recordCRC, dataCRC;
+    const uint8_t * matches;// match record for the next block
+    size_t matchesSize;
+};
+
+static inline uint32_t GetU32(const uint8_t * bfr) {
+    return ((uint32_t)bfr[0] << 24) | ((uint32_t)bfr[1] << 16) | ((uint32_t)bfr[2] << 8) | bfr[3];
+}
+
+// Read a varint block size of at most BP_LONG_SIZE_BYTES bytes. Returns its
+// length, 0 if it runs past avail, or BP_BAD_RECORD if it is too long.
+static inline size_t GetFlexSize(const uint8_t * data, size_t avail, size_t & val)
+{
+    for(size_t j = 0; j < BP_LONG_SIZE_BYTES; ++j)
+    {
+        if(j == avail)
+            return 0;
+        if(!(data[j] & 0x80))
+            return BP_DecodeFlexInt(&val, const_cast<uint8_t *>(data));
+    }
+    return BP_BAD_RECORD;
+}
+
+// Parse the record at the front of data. Table and checksum records update
+// state, data blocks are described in ref. Returns the length of the record,
+// 0 if it runs past avail bytes, or BP_BAD_RECORD if it is malformed.
+static inline size_t ParseRecord(const uint8_t * data, size_t avail, StreamState & table, BlockRef & ref, bool & isBlock)
+{
+    if(avail < 2)
+        return 0;
+    int blockSize = (((int)(*data)) << 8) | *(data + 1);
+    isBlock = false;
+    
+    if(blockSize == BP_EXT_RECORD && avail >= 3 && data[2] == BP_EXT_CHECKSUM)
+    {
+        if(avail < 11)
+            return 0;
+        table.hasCRC = true;
+        table.recordCRC = GetU32(data + 3);
+        table.dataCRC = GetU32(data + 7);
+        return 11;
+    }
+    
+    // Match records go with the first block of their segment
+    if(blockSize == BP_EXT_RECORD && avail >= 3 && data[2] == BP_EXT_MATCHES)
+    {
+        if(avail < 7)
+            return 0;
+        size_t len = 7 + (size_t)GetU32(data + 3);
+        if(avail < len)
+            return 0;
+        if(table.matches)
+            return BP_BAD_RECORD;
+        table.matches = data;
+        table.matchesSize = len;
+        return len;
+    }
+    
+    // Archive table of contents, nothing to decode
+    if(blockSize == BP_EXT_RECORD && avail >= 3 && data[2] == BP_EXT_ARCHIVE_TOC)
+    {
+        if(avail < 7)
+            return 0;
+        size_t len = 7 + (size_t)GetU32(data + 3);
+        return (avail < len)? 0 : len;
+    }
+    
+    // Wide blocks carry their own pairs
+    if(blockSize == BP_EXT_RECORD && avail >= 3 && data[2] == BP_EXT_WIDE_BLOCK)
+    {
+        if(avail < 14)
+            return 0;
+        int numSubs = (data[3] << 8) | data[4];
+        int width = data[5];
+        size_t rawSize = GetU32(data + 6), numSymbols = GetU32(data + 10);
+        if(width > 16 || 256 + numSubs > (1 << width) || rawSize > BP_WIDE_MAX_BLOCK || numSymbols > rawSize)
+            return BP_BAD_RECORD;
+        size_t len = 14 + 4*(size_t)numSubs + (numSymbols*width + 7)/8;
+        if(avail < len)
+            return 0;
+        
+        ref.pairs = data + 14;
+        ref.numSubs = numSubs;
+        ref.mask = NULL;
+        ref.keys = NULL;
+        ref.numKeys = 0;
+        ref.data = data + 14 + 4*numSubs;
+        ref.size = numSymbols;
+        ref.width = width;
+        ref.rawSize = rawSize;
+        ref.maxSize = rawSize;
+        ref.coded = NULL;
+        ref.codedSize = 0;
+        ref.matches = table.matches;
+        ref.matchesSize = table.matchesSize;
+        table.matches = NULL;
+        ref.record = data;
+        ref.recordSize = len;
+        ref.hasCRC = table.hasCRC;
+        ref.recordCRC = table.recordCRC;
+        ref.dataCRC = table.dataCRC;
+        table.hasCRC = false;
+        isBlock = true;
+        return len;
+    }
+    
+    // A long block is a data block with its size in a varint after the tag.
+    // A coded block has the size of its coded data in a second varint.
+    size_t len = 2, dataSize = blockSize, codedSize = 0;
+    bool coded = false;
+    if(blockSize == BP_EXT_RECORD && avail >= 3 &&
+       (data[2] == BP_EXT_LONG_BLOCK || data[2] == BP_EXT_CODED_BLOCK))
+    {
+        coded = (data[2] == BP_EXT_CODED_BLOCK);
+        size_t sizeLen = GetFlexSize(data + 3, avail - 3, dataSize);
+        if(sizeLen == 0 || sizeLen == BP_BAD_RECORD)
+            return sizeLen;
+        if(dataSize == 0 || dataSize > BP_LONG_MAX_BLOCK)
+            return BP_BAD_RECORD;
+        len = 3 + sizeLen;
+        if(coded)
+        {
+            sizeLen = GetFlexSize(data + len, avail - len, codedSize);
+            if(sizeLen == 0 || sizeLen == BP_BAD_RECORD)
+                return sizeLen;
+            if(codedSize == 0 || codedSize >= dataSize)
+                return BP_BAD_RECORD;
+            len += sizeLen;
+        }
+    }
+    else if(blockSize == BP_EXT_RECORD || blockSize == 0)
+    {
+        size_t hdrSize = (blockSize == 0)? 3 : 4;
+        if(avail < hdrSize)
+            return 0;
+        if(blockSize == BP_EXT_RECORD && data[2] != BP_EXT_MASKED_TABLE)
+            return BP_BAD_RECORD;
+        int numSubs = data[hdrSize - 1];
+        if(avail < hdrSize + 2*numSubs)
+            return 0;
+        table.numSubs = numSubs;
+        table.pairs = data + hdrSize;
+        table.masked = (blockSize == BP_EXT_RECORD);
+        return hdrSize + 2*numSubs;
+    }
+    
+    // Data blocks need a table to refer to
+    if(!table.pairs)
+        return BP_BAD_RECORD;
+    
+    // printf("Block size: %d, num subs: %d\n", blockSize, numSubs);
+    // Passes that were not applied to this block have no key and are
+    // skipped entirely.
+    ref.pairs = table.pairs;
+    ref.numSubs = table.numSubs;
+    ref.mask = NULL;
+    ref.numKeys = table.numSubs;
+    ref.width = 0;
+    ref.rawSize = 0;
+    ref.maxSize = (len > 2)? BP_LONG_MAX_BLOCK : BP_MAX_EXPANSION;
+    if(table.masked)
+    {
+        size_t maskSize = (table.numSubs + 7)/8;
+        if(avail < len + maskSize)
+            return 0;
+        ref.mask = data + len;
+        len += maskSize;
+        ref.numKeys = 0;
+        for(int sub = 0; sub < table.numSubs; ++sub)
+            if(ref.mask[sub >> 3] & (1 << (sub & 7)))
+                ++ref.numKeys;
+    }
+    ref.keys = data + len;
+    len += ref.numKeys;
+    
+    ref.data = coded? NULL : data + len;
+    ref.size = dataSize;
+    ref.coded = coded? data + len : NULL;
+    ref.codedSize = codedSize;
+    len += coded? codedSize : dataSize;
+    if(avail < len)
+        return 0;
+    
+    ref.matches = table.matches;
+    ref.matchesSize = table.matchesSize;
+    table.matches = NULL;
+    ref.record = data;
+    ref.recordSize = len;
+    ref.hasCRC = table.hasCRC;
+    ref.recordCRC = table.recordCRC;
+    ref.dataCRC = table.dataCRC;
+    table.hasCRC = false;
+    isBlock = true;
+    return len;
+}
+
+// Rebuilds segments from their match records and the decoded literals of
+// the blocks that follow each one. The output of the last BP_MATCH_WINDOW
+// bytes or more is kept for matches to copy from.
+struct MatchDecoder {
+    bool active;// set by the first match record
+    std::vector<uint8_t> history;
+    std::vector<Match> matches;
+    size_t next;// next match to copy
+    size_t litRun;// literals still to come before it
+    size_t litLeft;// literals still to come in the segment
+    
+    MatchDecoder(): active(false), next(0), litRun(0), litLeft(0) {}
+    
+    // True once the segment is complete, as it must be before the next
+    // starts and at the end of the stream
+    bool Finished() const {return litLeft == 0 && next == matches.size();}
+    
+    bool Begin(const uint8_t * rec, size_t size, std::vector<uint8_t> & out);
+    bool Put(const uint8_t * lit, size_t n, std::vector<uint8_t> & out);
+    
+  private:
+    bool CopyMatches();
+};
+
+// Start a segment from its match record. Returns false if the last one was
+// not finished or the record is malformed. Matches ahead of the first
+// literal go to out.
+inline bool MatchDecoder::Begin(const uint8_t * rec, size_t size, std::vector<uint8_t> & out)
+{
+    if(!Finished())
+        return false;
+    size_t pos = 7, numMatches = 0, len;
+    if((len = GetFlexSize(rec + pos, size - pos, litLeft)) == 0 || len == BP_BAD_RECORD)
+        return false;
+    pos += len;
+    if((len = GetFlexSize(rec + pos, size - pos, numMatches)) == 0 || len == BP_BAD_RECORD)
+        return false;
+    pos += len;
+    if(litLeft == 0 || numMatches > (size - pos)/3)
+        return false;
+    
+    matches.resize(numMatches);
+    size_t totalLits = 0;
+    for(auto & match : matches)
+    {
+        size_t * fields[3] = {&match.literals, &match.distance, &match.length};
+        for(int f = 0; f < 3; ++f) {
+            if((len = GetFlexSize(rec + pos, size - pos, *fields[f])) == 0 || len == BP_BAD_RECORD)
+                return false;
+            pos += len;
+        }
+        match.length += BP_MATCH_MIN;
+        totalLits += match.literals;
+        if(match.distance == 0 || match.distance > BP_MATCH_WINDOW || match.length > BP_MATCH_SEGMENT ||
+           totalLits >= litLeft)
+            return false;
+    }
+    if(pos != size)
+        return false;
+    active = true;
+    next = 0;
+    litRun = numMatches? matches[0].literals : litLeft;
+    
+    size_t start = history.size();
+    if(!CopyMatches())
+        return false;
+    out.assign(history.begin() + start, history.end());
+    return true;
+}
+
+// Copy matches while no literals are due before them
+inline bool MatchDecoder::CopyMatches()
+{
+    while(litRun == 0 && next < matches.size())
+    {
+        const Match & match = matches[next];
+        if(match.distance > history.size())
+            return false;
+        size_t at = history.size(), from = at - match.distance;
+        history.resize(at + match.length);
+        if(match.distance >= match.length)
+            memcpy(&history[at], &history[from], match.length);
+        else
+            for(size_t j = 0; j < match.length; ++j)
+                history[at + j] = history[from + j];
+        if(++next < matches.size())
+            litRun = matches[next].literals;
+        else
+            litRun = litLeft;
+    }
+    return true;
+}
+
+// Take the n decoded literals of a block, and put what they and the matches
+// between them rebuild in out. Returns false if the segment has fewer
+// literals or a match reaches back past the start of the stream.
+inline bool MatchDecoder::Put(const uint8_t * lit, size_t n, std::vector<uint8_t> & out)
+{
+    BP_TRACE_SCOPE("copy matches");
+    PerfScope perf("copy matches", n);
+    if(n > litLeft)
+        return false;
+    if(history.size() > 2*BP_MATCH_WINDOW)
+        history.erase(history.begin(), history.end() - BP_MATCH_WINDOW);
+    
+    size_t start = history.size();
+    while(n)
+    {
+        size_t take = std::min(n, litRun);
+        history.insert(history.end(), lit, lit + take);
+        lit += take;
+        n -= take;
+        litRun -= take;
+        litLeft -= take;
+        if(!CopyMatches())
+            return false;
+    }
+    out.assign(history.begin() + start, history.end());
+    return true;
+}
+
+#endif // BPCODEC_H
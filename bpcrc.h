@@ -0,0 +1,197 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPCRC_H
+#define BPCRC_H
+
+// CRC-32C (Castagnoli), the polynomial implemented by the SSE4.2 crc32
+// instruction. BP_CRC32C() picks the SSE4.2 kernel when the CPU has it, and a
+// slicing-by-8 table kernel otherwise.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define BP_HAVE_SSE42_CRC  (1)
+#endif
+
+#define BP_CRC32C_POLY  (0x82F63B78)// reflected
+
+typedef uint32_t (*BP_CRCFunc)(uint32_t crc, const uint8_t * data, size_t size);
+
+static uint32_t bp_crcTable[8][256];
+
+static inline void BP_CRC32C_InitTable()
+{
+    for(uint32_t n = 0; n < 256; ++n)
+    {
+        uint32_t crc = n;
+        for(int k = 0; k < 8; ++k)
+            crc = (crc & 1)? (crc >> 1) ^ BP_CRC32C_POLY : crc >> 1;
+        bp_crcTable[0][n] = crc;
+    }
+    for(uint32_t n = 0; n < 256; ++n)
+        for(int k = 1; k < 8; ++k)
+            bp_crcTable[k][n] = (bp_crcTable[k - 1][n] >> 8) ^ bp_crcTable[0][bp_crcTable[k - 1][n] & 0xFF];
+}
+
+// Raw CRC register update, no pre/post inversion
+static uint32_t BP_CRC32C_Soft(uint32_t crc, const uint8_t * data, size_t size)
+{
+    while(size && ((uintptr_t)data & 7)) {
+        crc = (crc >> 8) ^ bp_crcTable[0][(crc ^ *data++) & 0xFF];
+        --size;
+    }
+    while(size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = bp_crcTable[7][word & 0xFF] ^ bp_crcTable[6][(word >> 8) & 0xFF] ^
+              bp_crcTable[5][(word >> 16) & 0xFF] ^ bp_crcTable[4][(word >> 24) & 0xFF] ^
+              bp_crcTable[3][(word >> 32) & 0xFF] ^ bp_crcTable[2][(word >> 40) & 0xFF] ^
+              bp_crcTable[1][(word >> 48) & 0xFF] ^ bp_crcTable[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while(size--)
+        crc = (crc >> 8) ^ bp_crcTable[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+// Multiply a and b modulo the CRC polynomial, in the reflected bit order
+static inline uint32_t BP_CRC32C_MultModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    while(m)
+    {
+        if(a & m)
+            p ^= b;
+        m >>= 1;
+        b = (b & 1)? (b >> 1) ^ BP_CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// Advance a raw CRC register over size zero bytes. The register is linear, so
+// the CRC of A followed by B is Shift(crc(A), |B|) ^ crc(B) with crc(B)
+// started from 0.
+static inline uint32_t BP_CRC32C_Shift(uint32_t crc, size_t size)
+{
+    // x^(8*size) mod P by square-and-multiply, starting from x^8
+    uint32_t xn = (uint32_t)1 << 31;// x^0
+    uint32_t sq = (uint32_t)1 << 23;// x^8
+    while(size)
+    {
+        if(size & 1)
+            xn = BP_CRC32C_MultModP(xn, sq);
+        sq = BP_CRC32C_MultModP(sq, sq);
+        size >>= 1;
+    }
+    return BP_CRC32C_MultModP(xn, crc);
+}
+
+#ifdef BP_HAVE_SSE42_CRC
+// The crc32 instruction has a latency of 3 cycles but issues every cycle, so
+// large buffers are split into 3 streams that run in parallel and are merged
+// at the end.
+__attribute__((target("sse4.2")))
+static uint32_t BP_CRC32C_SSE42(uint32_t crc, const uint8_t * data, size_t size)
+{
+    while(size && ((uintptr_t)data & 7)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        --size;
+    }
+    
+    if(size >= 3*256)
+    {
+        size_t stride = (size/24)*8;
+        const uint8_t * a = data, * b = data + stride, * c = data + 2*stride;
+        uint64_t crcA = crc, crcB = 0, crcC = 0;
+        for(size_t j = 0; j < stride; j += 8)
+        {
+            uint64_t wa, wb, wc;
+            memcpy(&wa, a + j, 8);
+            memcpy(&wb, b + j, 8);
+            memcpy(&wc, c + j, 8);
+            crcA = _mm_crc32_u64(crcA, wa);
+            crcB = _mm_crc32_u64(crcB, wb);
+            crcC = _mm_crc32_u64(crcC, wc);
+        }
+        crc = BP_CRC32C_Shift(crcA, stride) ^ (uint32_t)crcB;
+        crc = BP_CRC32C_Shift(crc, stride) ^ (uint32_t)crcC;
+        data += 3*stride;
+        size -= 3*stride;
+    }
+    
+    uint64_t crc64 = crc;
+    while(size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = crc64;
+    while(size--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif // BP_HAVE_SSE42_CRC
+
+static inline BP_CRCFunc BP_SelectCRC32C()
+{
+#ifdef BP_HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2"))
+        return BP_CRC32C_SSE42;
+#endif // BP_HAVE_SSE42_CRC
+    BP_CRC32C_InitTable();
+    return BP_CRC32C_Soft;
+}
+
+// Kernel used by BP_CRC32C(), chosen at startup. May be replaced before any
+// threads start; a table kernel needs BP_CRC32C_InitTable() first.
+static BP_CRCFunc bp_crcFunc = BP_SelectCRC32C();
+
+// Standard CRC-32C of a buffer: CRC32C("123456789") == 0xE3069283
+static inline uint32_t BP_CRC32C(const uint8_t * data, size_t size)
+{
+    return ~bp_crcFunc(~(uint32_t)0, data, size);
+}
+
+// CRC-32C of the bytes crc was found for, followed by size bytes of data
+static inline uint32_t BP_CRC32C_Append(uint32_t crc, const uint8_t * data, size_t size)
+{
+    return ~bp_crcFunc(~crc, data, size);
+}
+
+#endif // BPCRC_H
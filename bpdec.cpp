@@ -28,20 +28,30 @@
 
 // Decode a file encoded using byte-pair encoding.
 //
-// clang++ --std=c++11 -O3 bpdec.cpp -o bpdec
+// clang++ --std=c++11 -O3 -pthread bpdec.cpp -o bpdec
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
 
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 #include <sys/time.h>
 
+#include "bpqueue.h"
+#include "bpio.h"
+#include "bpcodec.h"
+#include "bptrace.h"
+#include "bpperf.h"
+
 static inline int imin(int x, int y) {return (x < y)? x : y;}
 static inline int imax(int x, int y) {return (x > y)? x : y;}
 
@@ -51,117 +61,1027 @@ static inline double GetRealSeconds() {
     return newTime.tv_sec + newTime.tv_usec/1e6;
 }
 
-void BP_Decode(FILE * fout, const uint8_t * data, size_t size);
+#define BP_MAX_LANES  (8)
+
+// Blocks are split across threads only if each thread gets at least this many
+// compressed bytes.
+#define BP_MIN_CHUNK  (4096)
+
+// Pipelined decoding: input chunk size, reads and writes kept in flight, and
+// blocks queued per decode worker.
+#define BP_PIPE_CHUNK    (1 << 20)
+#define BP_PIPE_DEPTH    (8)
+#define BP_PIPE_BACKLOG  (16)
+
+void BP_Decode(FILE * fout, const uint8_t * data, size_t size, int numLanes, int numThreads);
+bool BP_DecodePipelined(int fdIn, int fdOut, int numWorkers, bool useRing, size_t & outputSize);
+bool BP_Verify(const uint8_t * data, size_t size, int numThreads);
+void BP_DecodeContainer(FILE * fout, const uint8_t * data, size_t size, int numThreads);
+bool BP_IsContainer(const uint8_t * data, size_t size);
+
+struct ArchiveEntry {
+    std::string name;
+    uint64_t offset, compSize, rawSize;
+};
+bool BP_ReadArchiveIndex(FILE * fin, std::vector<ArchiveEntry> & entries, size_t & tableSize);
 
 int main(int argc, char * argv[])
 {
-    if(argc < 2) {
-        printf("Usage: bpdec INFILE [OUTFILE]\n");
+    BP_TRACE_THREAD("main");
+    int numLanes = 4;
+    int numThreads = 1;
+    int numWorkers = 0;
+    int numVerifiers = 0;
+    bool useRing = true;
+    bool listArchive = false;
+    bool perf = false;
+    const char * isa = NULL;
+    const char * extractName = NULL;
+    std::vector<const char *> fileArgs;
+    for(int j = 1; j < argc; ++j)
+    {
+        std::string arg = argv[j];
+        if(arg.compare(0, 8, "--lanes=") == 0)
+        {
+            numLanes = imax(1, imin(BP_MAX_LANES, atoi(arg.c_str() + 8)));
+            numThreads = 0;
+        }
+        else if(arg.compare(0, 10, "--threads=") == 0)
+            numThreads = imax(1, atoi(arg.c_str() + 10));
+        else if(arg == "--pipeline")
+            numWorkers = imax(1, std::thread::hardware_concurrency());
+        else if(arg.compare(0, 11, "--pipeline=") == 0)
+            numWorkers = imax(1, atoi(arg.c_str() + 11));
+        else if(arg == "--no-uring")
+            useRing = false;
+        else if(arg == "--verify")
+            numVerifiers = imax(1, std::thread::hardware_concurrency());
+        else if(arg.compare(0, 9, "--verify=") == 0)
+            numVerifiers = imax(1, atoi(arg.c_str() + 9));
+        else if(arg == "--list")
+            listArchive = true;
+        else if(arg.compare(0, 10, "--extract=") == 0)
+            extractName = argv[j] + 10;
+        else if(arg == "--perf")
+            perf = true;
+        else if(arg.compare(0, 12, "--force-isa=") == 0)
+            isa = argv[j] + 12;
+        else
+            fileArgs.push_back(argv[j]);
+    }
+    
+    if(fileArgs.size() < 1 || fileArgs.size() > 2) {
+        fprintf(stderr, "Usage: bpdec [--lanes=N | --threads=N | --pipeline[=N] [--no-uring]] [--perf] [--force-isa=ISA] INFILE [OUTFILE]\n");
+        fprintf(stderr, "       bpdec --verify[=N] [--perf] [--force-isa=ISA] INFILE\n");
+        fprintf(stderr, "       bpdec --list ARCHIVE\n");
+        fprintf(stderr, "       bpdec [--lanes=N | --threads=N] [--perf] [--force-isa=ISA] --extract=NAME ARCHIVE [OUTFILE]\n");
+        fprintf(stderr, "ISA is one of generic, sse4.2, avx2, avx512\n");
         exit(EXIT_FAILURE);
     }
     
-    const char * finname = argv[1];
+    if(isa && !BP_SelectKernels(isa)) {
+        fprintf(stderr, "Unknown or unsupported ISA: %s\n", isa);
+        exit(EXIT_FAILURE);
+    }
+    if(perf) {
+        BP_PerfEnable();
+        fprintf(stderr, "Kernels: %s\n", bp_kernels.isa);
+    }
+    
+    if(listArchive || extractName)
+    {
+        const char * finname = fileArgs[0];
+        FILE * fin = fopen(finname, "rb");
+        std::vector<ArchiveEntry> entries;
+        size_t tableSize;
+        if(!fin || !BP_ReadArchiveIndex(fin, entries, tableSize)) {
+            fprintf(stderr, "Could not read archive %s\n", finname);
+            exit(EXIT_FAILURE);
+        }
+        
+        if(listArchive)
+        {
+            for(auto & entry : entries)
+                printf("%12lu %12lu %12lu %s\n", (size_t)entry.rawSize, (size_t)entry.compSize,
+                    (size_t)entry.offset, entry.name.c_str());
+            fclose(fin);
+            return EXIT_SUCCESS;
+        }
+        
+        const ArchiveEntry * entry = NULL;
+        for(auto & e : entries)
+            if(e.name == extractName)
+                entry = &e;
+        if(!entry) {
+            fprintf(stderr, "%s is not in %s\n", extractName, finname);
+            exit(EXIT_FAILURE);
+        }
+        
+        // The member's records, behind the shared table if there is one
+        std::vector<uint8_t> member(tableSize + entry->compSize);
+        fseek(fin, 0L, SEEK_SET);
+        bool readOK = fread(member.data(), 1, tableSize, fin) == tableSize;
+        fseeko(fin, entry->offset, SEEK_SET);
+        readOK = readOK && fread(member.data() + tableSize, 1, entry->compSize, fin) == entry->compSize;
+        fclose(fin);
+        if(!readOK) {
+            fprintf(stderr, "Could not read %s from %s\n", extractName, finname);
+            exit(EXIT_FAILURE);
+        }
+        
+        FILE * fout = stdout;
+        if(fileArgs.size() == 2) {
+            fout = fopen(fileArgs[1], "wb");
+            if(!fout) {
+                fprintf(stderr, "Could not open %s\n", fileArgs[1]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        BP_Decode(fout, member.data(), member.size(), numLanes, numThreads);
+        bool writeOK = fflush(fout) == 0 && !ferror(fout);
+        if(fout != stdout && fclose(fout) != 0)
+            writeOK = false;
+        if(!writeOK)
+            fprintf(stderr, "Error writing %s\n", (fileArgs.size() == 2)? fileArgs[1] : "<stdout>");
+        BP_PerfReport(stderr);
+        BP_TRACE_WRITE("bpdec.trace.json");
+        return writeOK? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    const char * finname = fileArgs[0];
     const char * foutname = "<stdout>";
     
     FILE * fin = stdin, * fout = stdout;
     
+    // Aligned containers are decoded from memory, by block index
+    uint8_t magic[4];
+    fin = fopen(finname, "rb");
+    if(!fin) {
+        fprintf(stderr, "Could not open %s\n", finname);
+        exit(EXIT_FAILURE);
+    }
+    bool container = fread(magic, 1, 4, fin) == 4 && BP_IsContainer(magic, 4);
+    fclose(fin);
+    
+    if(numWorkers && !container)
+    {
+        // Reads, decoding and writes all overlap, nothing is read up front
+        fin = fopen(finname, "rb");
+        if(!fin) {
+            fprintf(stderr, "Could not open %s\n", finname);
+            exit(EXIT_FAILURE);
+        }
+        if(fileArgs.size() == 2) {
+            foutname = fileArgs[1];
+            fout = fopen(foutname, "wb");
+            if(!fout) {
+                fprintf(stderr, "Could not open %s\n", foutname);
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        double startT = GetRealSeconds();
+        size_t outputSize = 0;
+        bool ok = BP_DecodePipelined(fileno(fin), fileno(fout), numWorkers, useRing, outputSize);
+        fprintf(stderr, "Output size: %lu\n", outputSize);
+        fprintf(stderr, "Decompression Time: %f s\n", GetRealSeconds() - startT);
+        
+        fclose(fin);
+        if(fout != stdout)
+            fclose(fout);
+        BP_PerfReport(stderr);
+        BP_TRACE_WRITE("bpdec.trace.json");
+        return ok? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
     // Just read in whole file at once. This isn't going to be used for anything big.
     fin = fopen(finname, "rb");
-    fseek(fin, 0L, SEEK_END);
-    size_t inputFileSize = ftell(fin);
-    fseek(fin, 0L, SEEK_SET);
+    if(!fin) {
+        fprintf(stderr, "Could not open %s\n", finname);
+        exit(EXIT_FAILURE);
+    }
+    // A directory seeks and tells without complaint, only reading it fails
+    long fileEnd = (IsRegularFile(fileno(fin)) && fseek(fin, 0L, SEEK_END) == 0)? ftell(fin) : -1;
+    if(fileEnd < 0 || fseek(fin, 0L, SEEK_SET) != 0) {
+        fprintf(stderr, "Could not read %s\n", finname);
+        exit(EXIT_FAILURE);
+    }
+    size_t inputFileSize = fileEnd;
     
     uint8_t * fileData = new uint8_t[inputFileSize];
-    fread(fileData, 1, inputFileSize, fin);
+    {
+        BP_TRACE_SCOPE("read");
+        if(fread(fileData, 1, inputFileSize, fin) != inputFileSize) {
+            fprintf(stderr, "Could not read %s\n", finname);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if(numVerifiers)
+    {
+        // Check every block, write nothing
+        double startT = GetRealSeconds();
+        bool ok = BP_Verify(fileData, inputFileSize, numVerifiers);
+        fprintf(stderr, "Verification Time: %f s\n", GetRealSeconds() - startT);
+        delete[] fileData;
+        fclose(fin);
+        BP_PerfReport(stderr);
+        BP_TRACE_WRITE("bpdec.trace.json");
+        return ok? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     
-    if(argc == 3) {
-        foutname = argv[2];
+    if(fileArgs.size() == 2) {
+        foutname = fileArgs[1];
         fout = fopen(foutname, "wb");
+        if(!fout) {
+            fprintf(stderr, "Could not open %s\n", foutname);
+            exit(EXIT_FAILURE);
+        }
     }
     
     
     double startT = GetRealSeconds(), endT;
     
-    BP_Decode(fout, fileData, inputFileSize);
+    if(container)
+        BP_DecodeContainer(fout, fileData, inputFileSize, imax(1, imax(numThreads, numWorkers)));
+    else
+        BP_Decode(fout, fileData, inputFileSize, numLanes, numThreads);
     
     endT = GetRealSeconds();
     
     size_t outputFileSize = ftell(fout);
-    printf("Input size: %lu s\n", inputFileSize);
-    printf("Output size: %lu s\n", outputFileSize);
-    printf("Decompression Time: %f s\n", endT - startT);
-    delete fileData;
+    fprintf(stderr, "Input size: %lu s\n", inputFileSize);
+    fprintf(stderr, "Output size: %lu s\n", outputFileSize);
+    fprintf(stderr, "Decompression Time: %f s\n", endT - startT);
+    delete[] fileData;
     
     if(fin != stdout)
         fclose(fin);
-    if(fout != stdout)
-        fclose(fout);
+    bool writeOK = fflush(fout) == 0 && !ferror(fout);
+    if(fout != stdout && fclose(fout) != 0)
+        writeOK = false;
+    if(!writeOK)
+        fprintf(stderr, "Error writing %s\n", foutname);
     
-    return EXIT_SUCCESS;
+    BP_PerfReport(stderr);
+    BP_TRACE_WRITE("bpdec.trace.json");
+    return writeOK? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 
-void BP_Decode(FILE * fout, const uint8_t * data, size_t size)
+// Decode state for one block in a group decoded in lockstep
+struct Lane {
+    std::vector<uint8_t> bufa, bufb;
+    std::vector<uint8_t> * dstbuf;
+    const uint8_t * src;
+    size_t size;
+    int sub, key;
+};
+
+// Expand one key in L independent blocks at once. The blocks don't depend on
+// each other, so their compare/store chains can overlap in the CPU. Both bytes
+// of the pair are always stored and the output advances by 1 or 2, so there
+// is no data-dependent branch. Each dst must have room for 2*n + 1 bytes.
+template<int L>
+static void ExpandLanes(uint8_t ** dst, const uint8_t * const * src, size_t n,
+                        const uint8_t * key, const uint8_t * pair0, const uint8_t * pair1)
 {
-    const uint8_t * dataEnd = data + size;
+    uint8_t * d[L];
+    for(int l = 0; l < L; ++l)
+        d[l] = dst[l];
     
-    if(*data != 0x00 || *(data + 1) != 0x00)
+    for(size_t j = 0; j < n; ++j)
     {
-        printf("Bad input, expected init block\n");
-        exit(EXIT_FAILURE);
+        for(int l = 0; l < L; ++l)
+        {
+            uint8_t b = src[l][j];
+            int hit = (b == key[l]);
+            d[l][0] = hit? pair0[l] : b;
+            d[l][1] = pair1[l];
+            d[l] += 1 + hit;
+        }
     }
     
-    int numSubs;
-    const uint8_t * pairs;
+    for(int l = 0; l < L; ++l)
+        dst[l] = d[l];
+}
+
+static void ExpandLanes(int numLanes, uint8_t ** dst, const uint8_t * const * src, size_t n,
+                        const uint8_t * key, const uint8_t * pair0, const uint8_t * pair1)
+{
+    switch(numLanes)
+    {
+        case 1: ExpandLanes<1>(dst, src, n, key, pair0, pair1); break;
+        case 2: ExpandLanes<2>(dst, src, n, key, pair0, pair1); break;
+        case 3: ExpandLanes<3>(dst, src, n, key, pair0, pair1); break;
+        case 4: ExpandLanes<4>(dst, src, n, key, pair0, pair1); break;
+        case 5: ExpandLanes<5>(dst, src, n, key, pair0, pair1); break;
+        case 6: ExpandLanes<6>(dst, src, n, key, pair0, pair1); break;
+        case 7: ExpandLanes<7>(dst, src, n, key, pair0, pair1); break;
+        case 8: ExpandLanes<8>(dst, src, n, key, pair0, pair1); break;
+    }
+}
+
+// Decode a group of up to BP_MAX_LANES blocks. Each round undoes the next
+// remaining pass of every block that still has one, interleaving the blocks
+// over their common length and finishing the longer ones individually.
+// Wide blocks have no passes to undo, and are decoded directly up front, as
+// is the data of entropy-coded blocks. On return, lanes[l].src and
+// lanes[l].size hold the decoded data. Returns false if a block grows past
+// the maximum block size or is malformed.
+static bool DecodeBlocks(const BlockRef * refs, Lane * lanes, int numBlocks, WideExpandTable & wideTbl)
+{
+    PerfScope perf("expand lanes", 0);
+    for(int l = 0; l < numBlocks; ++l)
+    {
+        lanes[l].src = refs[l].data;
+        lanes[l].size = refs[l].size;
+        lanes[l].dstbuf = &lanes[l].bufa;
+        lanes[l].sub = refs[l].numSubs - 1;
+        lanes[l].key = refs[l].numKeys;
+        if(refs[l].width)
+        {
+            lanes[l].bufb.resize(refs[l].rawSize);
+            if(!DecodeWide(refs[l], wideTbl, lanes[l].bufb.data()))
+                return false;
+            lanes[l].src = lanes[l].bufb.data();
+            lanes[l].size = refs[l].rawSize;
+            lanes[l].sub = -1;
+        }
+        else if(refs[l].coded)
+        {
+            lanes[l].bufb.resize(refs[l].size);
+            if(!DecodeEntropy(refs[l], lanes[l].bufb.data()))
+                return false;
+            lanes[l].src = lanes[l].bufb.data();
+        }
+    }
+    
+    while(true)
+    {
+        int active[BP_MAX_LANES];
+        int numActive = 0;
+        for(int l = 0; l < numBlocks; ++l)
+        {
+            Lane & lane = lanes[l];
+            const uint8_t * mask = refs[l].mask;
+            while(lane.sub >= 0 && mask && !(mask[lane.sub >> 3] & (1 << (lane.sub & 7))))
+                --lane.sub;
+            if(lane.sub >= 0)
+                active[numActive++] = l;
+        }
+        if(numActive == 0)
+            break;
+        
+        uint8_t * dst[BP_MAX_LANES];
+        const uint8_t * src[BP_MAX_LANES];
+        uint8_t key[BP_MAX_LANES], pair0[BP_MAX_LANES], pair1[BP_MAX_LANES];
+        size_t common = (size_t)-1;
+        for(int a = 0; a < numActive; ++a)
+        {
+            const BlockRef & ref = refs[active[a]];
+            Lane & lane = lanes[active[a]];
+            --lane.key;
+            if(lane.dstbuf->size() < 2*lane.size + 1)
+                lane.dstbuf->resize(2*lane.size + 1);
+            dst[a] = &(*lane.dstbuf)[0];
+            src[a] = lane.src;
+            key[a] = ref.keys[lane.key];
+            pair0[a] = ref.pairs[lane.sub*2];
+            pair1[a] = ref.pairs[lane.sub*2 + 1];
+            common = std::min(common, lane.size);
+        }
+        
+        ExpandLanes(numActive, dst, src, common, key, pair0, pair1);
+        
+        for(int a = 0; a < numActive; ++a)
+        {
+            Lane & lane = lanes[active[a]];
+            perf.bytes += lane.size;
+            if(lane.size > common) {
+                const uint8_t * tail = lane.src + common;
+                ExpandLanes(1, &dst[a], &tail, lane.size - common, &key[a], &pair0[a], &pair1[a]);
+            }
+            // printf("%d -> %d %d\n", key[a], pair0[a], pair1[a]);
+            lane.src = &(*lane.dstbuf)[0];
+            lane.size = dst[a] - lane.src;
+            lane.dstbuf = (lane.dstbuf == &lane.bufa)? &lane.bufb : &lane.bufa;
+            --lane.sub;
+            if(lane.size > refs[active[a]].maxSize)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+// Decode a single block by direct expansion, split across threads. Output
+// offsets of the chunks are a prefix sum over the expanded lengths of their
+// bytes, so every thread can write straight into its final position.
+// Returns false if a key expands past the maximum block size. Wide blocks, and
+// the entropy coding of coded blocks, are decoded by the calling thread alone.
+static bool DecodeBlockParallel(const BlockRef & ref, ExpandTable & tbl, WideExpandTable & wideTbl,
+                                std::vector<uint8_t> & out, int numThreads)
+{
+    if(ref.width) {
+        out.resize(ref.rawSize);
+        return DecodeWide(ref, wideTbl, out.data());
+    }
+    if(ref.coded)
+    {
+        static thread_local std::vector<uint8_t> plain;
+        plain.resize(ref.size);
+        if(!DecodeEntropy(ref, plain.data()))
+            return false;
+        BlockRef plainRef = ref;
+        plainRef.data = plain.data();
+        plainRef.coded = NULL;
+        return DecodeBlockParallel(plainRef, tbl, wideTbl, out, numThreads);
+    }
+    if(!BuildExpandTable(ref, tbl))
+        return false;
+    
+    int numChunks = imax(1, imin(numThreads, (int)(ref.size/BP_MIN_CHUNK)));
+    std::vector<size_t> chunkStart(numChunks + 1), chunkOffset(numChunks + 1, 0);
+    for(int c = 0; c <= numChunks; ++c)
+        chunkStart[c] = ref.size*c/numChunks;
+    
+    // Expanded size of each chunk, then exclusive scan to get output offsets
+    std::vector<std::thread> threads;
+    for(int c = 1; c < numChunks; ++c)
+        threads.push_back(std::thread([&, c]() {
+            chunkOffset[c + 1] = ExpandedSize(tbl, ref.data + chunkStart[c], chunkStart[c + 1] - chunkStart[c]);
+        }));
+    chunkOffset[1] = ExpandedSize(tbl, ref.data, chunkStart[1]);
+    for(auto & t : threads)
+        t.join();
+    threads.clear();
+    for(int c = 1; c <= numChunks; ++c)
+        chunkOffset[c] += chunkOffset[c - 1];
+    
+    out.resize(chunkOffset[numChunks]);
+    if(out.empty())
+        return true;
+    for(int c = 1; c < numChunks; ++c)
+        threads.push_back(std::thread([&, c]() {
+            ExpandBytes(&out[chunkOffset[c]], chunkOffset[c + 1] - chunkOffset[c], tbl,
+                        ref.data + chunkStart[c], chunkStart[c + 1] - chunkStart[c]);
+        }));
+    ExpandBytes(&out[0], chunkOffset[1], tbl, ref.data, chunkStart[1]);
+    for(auto & t : threads)
+        t.join();
+    return true;
+}
+
+
+// Write out the decoded data of a block, rebuilding its segment first if the
+// stream has long-range matches. Returns false if the matches are malformed.
+static bool WriteBlock(FILE * fout, MatchDecoder & matches, std::vector<uint8_t> & rebuilt, const BlockRef & ref,
+                       const uint8_t * data, size_t size, size_t & outputSize)
+{
+    if(ref.matches)
+    {
+        if(!matches.Begin(ref.matches, ref.matchesSize, rebuilt))
+            return false;
+        if(!rebuilt.empty())
+            fwrite(&rebuilt[0], sizeof(uint8_t), rebuilt.size(), fout);
+        outputSize += rebuilt.size();
+    }
+    if(matches.active)
+    {
+        if(!matches.Put(data, size, rebuilt))
+            return false;
+        data = rebuilt.empty()? NULL : &rebuilt[0];
+        size = rebuilt.size();
+    }
+    BP_TRACE_SCOPE("write");
+    if(size)
+        fwrite(data, sizeof(uint8_t), size, fout);
+    outputSize += size;
+    return true;
+}
+
+void BP_Decode(FILE * fout, const uint8_t * data, size_t size, int numLanes, int numThreads)
+{
+    const uint8_t * dataEnd = data + size;
+    
+    StreamState table = {NULL, 0, false, false, 0, 0, NULL, 0};
     size_t numBlocks = 0;
     size_t outputSize = 0;
-    while(data < dataEnd)
+    
+    BlockRef refs[BP_MAX_LANES];
+    Lane lanes[BP_MAX_LANES];
+    int numPending = 0;
+    
+    // Direct expansion takes one block at a time, possibly with several
+    // threads. Otherwise blocks are decoded pass by pass in groups.
+    ExpandTable expandTable;
+    WideExpandTable wideTable;
+    std::vector<uint8_t> blockOut;
+    MatchDecoder matches;
+    std::vector<uint8_t> rebuilt;
+    if(numThreads)
+        numLanes = 1;
+    
+    while(data < dataEnd || numPending)
     {
-        int blockSize = (((int)(*data)) << 8) | *(data + 1);
-        data += 2;
+        if(numPending && numThreads)
+        {
+            if(!CheckRecord(refs[0]) || !DecodeBlockParallel(refs[0], expandTable, wideTable, blockOut, numThreads) ||
+               !CheckData(refs[0], blockOut.empty()? NULL : &blockOut[0], blockOut.size()) ||
+               !WriteBlock(fout, matches, rebuilt, refs[0], blockOut.empty()? NULL : &blockOut[0], blockOut.size(), outputSize))
+            {
+                fprintf(stderr, "Bad input, block %lu is corrupt\n", numBlocks);
+                exit(EXIT_FAILURE);
+            }
+            numPending = 0;
+            continue;
+        }
         
-        if(blockSize == 0)
+        // Decode and write out a full group, or whatever is left at the end
+        if(numPending == numLanes || (data >= dataEnd && numPending))
         {
-            numSubs = *data;
-            data += 1;
-            
-            pairs = data;
-            data += 2*numSubs;
+            for(int l = 0; l < numPending; ++l)
+            {
+                if(!CheckRecord(refs[l])) {
+                    fprintf(stderr, "Bad input, block %lu is corrupt\n", numBlocks - numPending + l + 1);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            bool decoded;
+            {
+                BP_TRACE_SCOPE("decode lanes");
+                decoded = DecodeBlocks(refs, lanes, numPending, wideTable);
+            }
+            if(!decoded) {
+                fprintf(stderr, "Bad input, block expands past maximum block size\n");
+                exit(EXIT_FAILURE);
+            }
+            for(int l = 0; l < numPending; ++l)
+            {
+                // printf("Decompressed size: %lu\n", lanes[l].size);
+                if(!CheckData(refs[l], lanes[l].src, lanes[l].size) ||
+                   !WriteBlock(fout, matches, rebuilt, refs[l], lanes[l].src, lanes[l].size, outputSize))
+                {
+                    fprintf(stderr, "Bad input, block %lu is corrupt\n", numBlocks - numPending + l + 1);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            numPending = 0;
+            continue;
         }
-        else
+        
+        bool isBlock;
+        size_t len = ParseRecord(data, dataEnd - data, table, refs[numPending], isBlock);
+        if(len == 0 || len == BP_BAD_RECORD)
         {
-            // printf("Block size: %d, num subs: %d\n", blockSize, numSubs);
-            const uint8_t * subs = data;
-            data += numSubs;
-            
-            std::vector<uint8_t> bufa, bufb;
-            std::vector<uint8_t> * srcbuf = &bufa, * dstbuf = &bufb;
-            srcbuf->assign(data, data + blockSize);
-            data += blockSize;
+            fprintf(stderr, "Bad input, %s record\n", len? "malformed" : "truncated");
+            exit(EXIT_FAILURE);
+        }
+        data += len;
+        if(isBlock) {
+            ++numPending;
             ++numBlocks;
-            
-            for(int sub = numSubs - 1; sub >= 0; --sub)
+        }
+    }
+    if(table.matches || !matches.Finished()) {
+        fprintf(stderr, "Bad input, truncated segment\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Num blocks: %lu\n", numBlocks);
+}
+
+
+// A block in flight through the decode pipeline. It owns a copy of its record
+// and shares its pair table with the other blocks that use it.
+struct DecodeJob {
+    std::vector<uint8_t> record;
+    std::shared_ptr<std::vector<uint8_t> > pairs;
+    std::shared_ptr<std::vector<uint8_t> > matches;
+    BlockRef ref;
+    std::vector<uint8_t> out;
+    bool corrupt;
+};
+
+// Reader, decode workers and writer joined by SPSC queues. The reader hands
+// blocks to the workers round-robin, so the writer restores the original
+// order by taking results from the workers in the same rotation. The calling
+// thread is the writer. outputSize receives the decoded size. Returns false
+// if the input can't be read or ends partway through a record, or the output
+// can't be written.
+bool BP_DecodePipelined(int fdIn, int fdOut, int numWorkers, bool useRing, size_t & outputSize)
+{
+    bool readOK = true, truncated = false, writeOK = true;
+    std::vector<SpscQueue<DecodeJob *> *> toWorker, fromWorker;
+    for(int w = 0; w < numWorkers; ++w) {
+        toWorker.push_back(new SpscQueue<DecodeJob *>(BP_PIPE_BACKLOG));
+        fromWorker.push_back(new SpscQueue<DecodeJob *>(BP_PIPE_BACKLOG));
+    }
+    
+    std::thread reader([&]() {
+        BP_TRACE_THREAD("read");
+        ChunkReader input(fdIn, BP_PIPE_CHUNK, BP_PIPE_DEPTH, useRing);
+        std::vector<uint8_t> pending, chunk;
+        std::shared_ptr<std::vector<uint8_t> > pairs, matches;
+        StreamState table = {NULL, 0, false, false, 0, 0, NULL, 0};
+        size_t pos = 0, seq = 0;
+        while(true)
+        {
+            BlockRef ref;
+            bool isBlock;
+            size_t len = 0;
+            if(pos < pending.size())
+                len = ParseRecord(&pending[pos], pending.size() - pos, table, ref, isBlock);
+            if(len == BP_BAD_RECORD)
+            {
+                fprintf(stderr, "Bad input, malformed record\n");
+                exit(EXIT_FAILURE);
+            }
+            if(len == 0)
             {
-                dstbuf->clear();
-                for(auto b : *srcbuf)
+                // Records can straddle chunks, keep the leftover and append
                 {
-                    if(b == subs[sub]) {
-                        dstbuf->push_back(pairs[sub*2]);
-                        dstbuf->push_back(pairs[sub*2 + 1]);
-                    }
-                    else {
-                        dstbuf->push_back(b);
-                    }
+                    BP_TRACE_SCOPE("read");
+                    if(!input.Next(chunk))
+                        break;
                 }
-                // printf("%d -> %d %d\n", subs[sub], pairs[sub*2], pairs[sub*2 + 1]);
-                std::swap(srcbuf, dstbuf);
+                pending.erase(pending.begin(), pending.begin() + pos);
+                pending.insert(pending.end(), chunk.begin(), chunk.end());
+                pos = 0;
+                continue;
             }
-            // printf("Decompressed size: %lu\n", srcbuf->size());
             
-            fwrite(&((*srcbuf)[0]), sizeof(uint8_t), srcbuf->size(), fout);
-            outputSize += srcbuf->size();
+            if(isBlock)
+            {
+                DecodeJob * job = new DecodeJob;
+                job->record.assign(&pending[pos], &pending[pos] + len);
+                job->pairs = pairs;
+                if(ref.matches)
+                    job->matches = matches;
+                job->ref = ref;
+                const uint8_t * base = &job->record[0] - pos;
+                job->ref.pairs = ref.width? base + (ref.pairs - &pending[0]) : &(*pairs)[0];
+                job->ref.mask = ref.mask? base + (ref.mask - &pending[0]) : NULL;
+                job->ref.keys = ref.keys? base + (ref.keys - &pending[0]) : NULL;
+                job->ref.data = ref.data? base + (ref.data - &pending[0]) : NULL;
+                job->ref.coded = ref.coded? base + (ref.coded - &pending[0]) : NULL;
+                job->ref.record = &job->record[0];
+                toWorker[seq % numWorkers]->Push(job);
+                ++seq;
+            }
+            else if(table.pairs && (!pairs || table.pairs != &(*pairs)[0]))
+            {
+                // Tables must outlive the chunk they arrived in
+                pairs = std::make_shared<std::vector<uint8_t> >(table.pairs, table.pairs + 2*table.numSubs + 1);
+                table.pairs = &(*pairs)[0];
+            }
+            else if(table.matches && (!matches || table.matches != &(*matches)[0]))
+            {
+                // As must match records, until their block is passed on
+                matches = std::make_shared<std::vector<uint8_t> >(table.matches, table.matches + table.matchesSize);
+                table.matches = &(*matches)[0];
+            }
+            pos += len;
+        }
+        if(input.Failed()) {
+            fprintf(stderr, "Error reading input\n");
+            readOK = false;
         }
+        else if(pos != pending.size()) {
+            fprintf(stderr, "Bad input, truncated record\n");
+            truncated = true;
+        }
+        for(int w = 0; w < numWorkers; ++w)
+            toWorker[w]->Push(NULL);
+    });
+    
+    std::vector<std::thread> workers;
+    for(int w = 0; w < numWorkers; ++w)
+        workers.push_back(std::thread([&, w]() {
+            BP_TRACE_THREAD("decode");
+            ExpandTable expandTable;
+            WideExpandTable wideTable;
+            while(DecodeJob * job = toWorker[w]->Pop()) {
+                BP_TRACE_SCOPE("decode block");
+                job->corrupt = !CheckRecord(job->ref) || !DecodeBlockParallel(job->ref, expandTable, wideTable, job->out, 1) ||
+                               !CheckData(job->ref, job->out.empty()? NULL : &job->out[0], job->out.size());
+                fromWorker[w]->Push(job);
+            }
+            fromWorker[w]->Push(NULL);
+        }));
+    
+    outputSize = 0;
+    {
+        ChunkWriter output(fdOut, BP_PIPE_DEPTH, useRing);
+        MatchDecoder matches;
+        std::vector<uint8_t> rebuilt;
+        for(size_t seq = 0; ; ++seq)
+        {
+            DecodeJob * job = fromWorker[seq % numWorkers]->Pop();
+            if(!job)
+                break;
+            const BlockRef & ref = job->ref;
+            if(ref.matches && !job->corrupt)
+            {
+                job->corrupt = !matches.Begin(ref.matches, ref.matchesSize, rebuilt);
+                outputSize += rebuilt.size();
+                if(!rebuilt.empty())
+                    output.Write(rebuilt);
+            }
+            if(matches.active && !job->corrupt) {
+                job->corrupt = !matches.Put(job->out.empty()? NULL : &job->out[0], job->out.size(), rebuilt);
+                job->out.swap(rebuilt);
+            }
+            if(job->corrupt) {
+                fprintf(stderr, "Bad input, block %lu is corrupt\n", seq + 1);
+                exit(EXIT_FAILURE);
+            }
+            outputSize += job->out.size();
+            BP_TRACE_SCOPE("write");
+            output.Write(job->out);
+            delete job;
+        }
+        if(!matches.Finished()) {
+            fprintf(stderr, "Bad input, truncated segment\n");
+            exit(EXIT_FAILURE);
+        }
+        output.Flush();
+        if(output.Failed()) {
+            fprintf(stderr, "Error writing output\n");
+            writeOK = false;
+        }
+    }
+    
+    reader.join();
+    for(auto & t : workers)
+        t.join();
+    for(int w = 0; w < numWorkers; ++w) {
+        delete toWorker[w];
+        delete fromWorker[w];
+    }
+    return readOK && !truncated && writeOK;
+}
+
+
+// *****************************************************************************
+// Aligned containers
+
+// Container header, checked against the size of the file
+struct Container {
+    const uint8_t * base;
+    int flags, numSubs;
+    size_t numTables, numBlocks;
+    uint64_t rawSize;
+    ContainerLayout layout;
+};
+
+bool BP_IsContainer(const uint8_t * data, size_t size) {
+    return size >= 4 && memcmp(data, BP_CONTAINER_MAGIC, 4) == 0;
+}
+
+// Returns false if the header is malformed, fails its checksum, or places
+// blocks outside the file.
+static bool OpenContainer(Container & c, const uint8_t * data, size_t size)
+{
+    if(size < BP_CONTAINER_HEADER || !BP_IsContainer(data, size) || data[4] != BP_CONTAINER_VERSION)
+        return false;
+    c.base = data;
+    c.flags = data[5];
+    c.numSubs = data[6];
+    c.numTables = GetLE32(data + 8);
+    c.numBlocks = GetLE32(data + 12);
+    c.rawSize = GetLE64(data + 16);
+    GetContainerLayout(c.layout, c.numTables, c.numBlocks, c.numSubs, c.flags);
+    const ContainerLayout & layout = c.layout;
+    if(layout.dataStart > size)
+        return false;
+    if((c.flags & BP_CONTAINER_CHECKSUM) &&
+       BP_CRC32C(data + BP_CONTAINER_HEADER, layout.dataStart - BP_CONTAINER_HEADER) != GetLE32(data + 24))
+        return false;
+    
+    uint64_t rawSize = 0;
+    for(size_t b = 0; b < c.numBlocks; ++b)
+    {
+        uint64_t offset = GetLE64(data + layout.dataOffset + 8*b);
+        size_t compSize = GetLE16(data + layout.compSize + 2*b);
+        if(GetLE32(data + layout.tableId + 4*b) >= c.numTables || offset < layout.dataStart ||
+           offset > size || compSize > size - offset)
+            return false;
+        rawSize += GetLE16(data + layout.rawSize + 2*b);
+    }
+    return rawSize == c.rawSize;
+}
+
+static void ContainerBlock(const Container & c, size_t b, BlockRef & ref)
+{
+    const ContainerLayout & layout = c.layout;
+    ref.pairs = c.base + layout.pairs + GetLE32(c.base + layout.tableId + 4*b)*2*c.numSubs;
+    ref.numSubs = c.numSubs;
+    ref.mask = layout.maskSize? c.base + layout.mask + b*layout.maskSize : NULL;
+    ref.keys = c.base + layout.keys + b*c.numSubs;
+    ref.numKeys = c.numSubs;
+    if(ref.mask) {
+        ref.numKeys = 0;
+        for(int sub = 0; sub < c.numSubs; ++sub)
+            if(ref.mask[sub >> 3] & (1 << (sub & 7)))
+                ++ref.numKeys;
+    }
+    ref.data = c.base + GetLE64(c.base + layout.dataOffset + 8*b);
+    ref.size = GetLE16(c.base + layout.compSize + 2*b);
+    ref.record = ref.data;
+    ref.recordSize = ref.size;
+    ref.hasCRC = (c.flags & BP_CONTAINER_CHECKSUM) != 0;
+    ref.recordCRC = ref.hasCRC? GetLE32(c.base + layout.payloadCRC + 4*b) : 0;
+    ref.dataCRC = ref.hasCRC? GetLE32(c.base + layout.dataCRC + 4*b) : 0;
+    ref.width = 0;
+    ref.rawSize = 0;
+    ref.maxSize = BP_MAX_EXPANSION;
+    ref.coded = NULL;
+    ref.codedSize = 0;
+    ref.matches = NULL;
+    ref.matchesSize = 0;
+}
+
+// Decode every block into place in out. Output offsets are a prefix sum over
+// RAW_SIZE, so threads take blocks in any order with no scanning. Returns the
+// number of corrupt blocks, and the lowest numbered one in firstBad.
+static size_t DecodeContainerBlocks(const Container & c, uint8_t * out, int numThreads, size_t & firstBad)
+{
+    std::vector<uint64_t> outOffset(c.numBlocks + 1, 0);
+    for(size_t b = 0; b < c.numBlocks; ++b)
+        outOffset[b + 1] = outOffset[b] + GetLE16(c.base + c.layout.rawSize + 2*b);
+    
+    std::atomic<size_t> next(0), numFailed(0), lowestBad(c.numBlocks);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < numThreads; ++t)
+        threads.push_back(std::thread([&]() {
+            BP_TRACE_THREAD("decode");
+            ExpandTable expandTable;
+            for(size_t b = next++; b < c.numBlocks; b = next++)
+            {
+                BP_TRACE_SCOPE("decode block");
+                BlockRef ref;
+                ContainerBlock(c, b, ref);
+                uint8_t * dst = out + outOffset[b];
+                size_t rawSize = outOffset[b + 1] - outOffset[b];
+                bool ok = CheckRecord(ref) && BuildExpandTable(ref, expandTable) &&
+                          ExpandedSize(expandTable, ref.data, ref.size) == rawSize;
+                if(ok) {
+                    ExpandBytes(dst, rawSize, expandTable, ref.data, ref.size);
+                    ok = CheckData(ref, dst, rawSize);
+                }
+                if(!ok)
+                {
+                    ++numFailed;
+                    size_t lowest = lowestBad;
+                    while(b < lowest && !lowestBad.compare_exchange_weak(lowest, b)) {}
+                }
+            }
+        }));
+    for(auto & t : threads)
+        t.join();
+    firstBad = lowestBad;
+    return numFailed;
+}
+
+void BP_DecodeContainer(FILE * fout, const uint8_t * data, size_t size, int numThreads)
+{
+    Container c;
+    if(!OpenContainer(c, data, size)) {
+        fprintf(stderr, "Bad input, malformed container header\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    std::vector<uint8_t> out(c.rawSize);
+    size_t firstBad;
+    if(DecodeContainerBlocks(c, out.data(), numThreads, firstBad)) {
+        fprintf(stderr, "Bad input, block %lu is corrupt\n", firstBad + 1);
+        exit(EXIT_FAILURE);
+    }
+    if(!out.empty()) {
+        BP_TRACE_SCOPE("write");
+        fwrite(&out[0], sizeof(uint8_t), out.size(), fout);
+    }
+    fprintf(stderr, "Num blocks: %lu\n", c.numBlocks);
+}
+
+static bool VerifyContainer(const uint8_t * data, size_t size, int numThreads)
+{
+    Container c;
+    if(!OpenContainer(c, data, size)) {
+        fprintf(stderr, "Bad input, malformed container header\n");
+        return false;
+    }
+    
+    std::vector<uint8_t> out(c.rawSize);
+    size_t firstBad;
+    size_t numFailed = DecodeContainerBlocks(c, out.data(), numThreads, firstBad);
+    if(numFailed)
+        fprintf(stderr, "Block %lu is corrupt\n", firstBad + 1);
+    fprintf(stderr, "Verified %lu blocks: %lu corrupt, %lu without checksums\n", c.numBlocks, numFailed,
+        (c.flags & BP_CONTAINER_CHECKSUM)? (size_t)0 : c.numBlocks);
+    return numFailed == 0;
+}
+
+
+// Check every block against its checksums, spread over numThreads threads.
+// Nothing is written. Returns false if any block is corrupt.
+bool BP_Verify(const uint8_t * data, size_t size, int numThreads)
+{
+    if(BP_IsContainer(data, size))
+        return VerifyContainer(data, size, numThreads);
+    
+    std::vector<BlockRef> refs;
+    StreamState table = {NULL, 0, false, false, 0, 0, NULL, 0};
+    size_t pos = 0;
+    while(pos < size)
+    {
+        BlockRef ref;
+        bool isBlock;
+        size_t len = ParseRecord(data + pos, size - pos, table, ref, isBlock);
+        if(len == 0 || len == BP_BAD_RECORD)
+        {
+            fprintf(stderr, "Bad input, %s record\n", len? "malformed" : "truncated");
+            return false;
+        }
+        if(isBlock)
+            refs.push_back(ref);
+        pos += len;
+    }
+    
+    std::atomic<size_t> next(0), numFailed(0), numUnchecked(0);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < numThreads; ++t)
+        threads.push_back(std::thread([&]() {
+            BP_TRACE_THREAD("verify");
+            ExpandTable expandTable;
+            WideExpandTable wideTable;
+            std::vector<uint8_t> out;
+            for(size_t j = next++; j < refs.size(); j = next++)
+            {
+                BP_TRACE_SCOPE("verify block");
+                const BlockRef & ref = refs[j];
+                if(!ref.hasCRC)
+                    ++numUnchecked;
+                if(!CheckRecord(ref) || !DecodeBlockParallel(ref, expandTable, wideTable, out, 1) ||
+                   !CheckData(ref, out.empty()? NULL : &out[0], out.size()))
+                {
+                    fprintf(stderr, "Block %lu is corrupt\n", j + 1);
+                    ++numFailed;
+                }
+            }
+        }));
+    for(auto & t : threads)
+        t.join();
+    
+    fprintf(stderr, "Verified %lu blocks: %lu corrupt, %lu without checksums\n",
+        refs.size(), (size_t)numFailed, (size_t)numUnchecked);
+    return numFailed == 0;
+}
+
+// Read the table of contents of an archive, found through the trailer at the
+// end of the file. tableSize is the length of the shared pair table record at
+// the start of the archive, 0 if members carry their own tables. Returns false
+// if the file is not an archive.
+bool BP_ReadArchiveIndex(FILE * fin, std::vector<ArchiveEntry> & entries, size_t & tableSize)
+{
+    uint8_t trailer[8];
+    if(fseeko(fin, 0, SEEK_END) != 0)
+        return false;
+    off_t fileSize = ftello(fin);
+    if(fileSize < 23 || fseeko(fin, fileSize - 8, SEEK_SET) != 0 || fread(trailer, 1, 8, fin) != 8)
+        return false;
+    uint64_t tocOffset = ((uint64_t)GetU32(trailer) << 32) | GetU32(trailer + 4);
+    if(tocOffset > (uint64_t)fileSize - 23)
+        return false;
+    
+    std::vector<uint8_t> toc(fileSize - tocOffset);
+    if(fseeko(fin, tocOffset, SEEK_SET) != 0 || fread(&toc[0], 1, toc.size(), fin) != toc.size())
+        return false;
+    if(((toc[0] << 8) | toc[1]) != BP_EXT_RECORD || toc[2] != BP_EXT_ARCHIVE_TOC ||
+       7 + (size_t)GetU32(&toc[3]) != toc.size())
+        return false;
+    
+    size_t numMembers = GetU32(&toc[7]);
+    tableSize = GetU32(&toc[11]);
+    size_t pos = 15, end = toc.size() - 8;
+    entries.clear();
+    for(size_t j = 0; j < numMembers; ++j)
+    {
+        if(end - pos < 26)
+            return false;
+        ArchiveEntry entry;
+        entry.offset = ((uint64_t)GetU32(&toc[pos]) << 32) | GetU32(&toc[pos + 4]);
+        entry.compSize = ((uint64_t)GetU32(&toc[pos + 8]) << 32) | GetU32(&toc[pos + 12]);
+        entry.rawSize = ((uint64_t)GetU32(&toc[pos + 16]) << 32) | GetU32(&toc[pos + 20]);
+        size_t nameLen = (toc[pos + 24] << 8) | toc[pos + 25];
+        pos += 26;
+        if(end - pos < nameLen || entry.offset > tocOffset || entry.compSize > tocOffset - entry.offset)
+            return false;
+        entry.name.assign((const char *)&toc[pos], nameLen);
+        pos += nameLen;
+        entries.push_back(entry);
     }
-    printf("Num blocks: %lu\n", numBlocks);
+    return tableSize <= tocOffset;
 }
 // *****************************************************************************
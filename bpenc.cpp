@@ -28,7 +28,7 @@
 
 // Encode a file using byte-pair encoding.
 //
-// clang++ --std=c++11 -O3 bpenc.cpp -o bpenc
+// clang++ --std=c++11 -O3 -pthread bpenc.cpp -o bpenc
 // 
 // Rough overview of algorithm:
 // Input is divided into blocks of the largest valid size that leaves NUMPASSES
@@ -51,11 +51,20 @@
 // for the full input and reusing it for each block.
 // Tradeoff is somewhat poorer compression. Compression will be worse if pair
 // frequencies vary widely between different parts of the input.
-// Optimization: if a pair doesn't exist in a given block, use an "ignored" key
-// to avoid wasting a key?
+// If a pair doesn't exist in a given block, no key is allocated for it, and a
+// per-block pass mask tells the decoder which passes to skip entirely.
+// With --stream, the table is found in a first pass over a reservoir sample of
+// the blocks, and a second pass applies it to each block as it is read, so
+// inputs larger than memory can be encoded.
 // 
 // Both types are supported by the same file format, with 2 bytes of overhead
 // per block for type 1 (for the 0x0000 block size).
+// 
+// A block uses the most recent pair table, so type 1 omits the table entirely
+// when a block reuses the previous block's pairs. The encoder tries the
+// previous pairs first, and keeps them if they do no worse than a full search
+// once the table they save is counted. Below -9, the search is skipped when
+// they do about as well on the new block as on the block they were found for.
 // -----------------------------------------------------------------------------
 // Block size of 0 indicates a pair frequency table:
 // Prefix is table of NUMPASSES most common pairs, sorted in order of decreasing
@@ -72,6 +81,105 @@
 // KEYS: the substitution keys. 1 byte each.
 // 
 // DATA: the compressed data
+// -----------------------------------------------------------------------------
+// Block size of 0xFFFF indicates an extended record. Blocks never reach this
+// size, since raw blocks are limited to 65534 bytes.
+// (BLOCK_SIZE:2 == 0xFFFF) (RECORD_TYPE:1) ...
+// 
+// RECORD_TYPE 0x01: masked pair table. Same as the 0x0000 pair table, but
+// blocks following it carry a pass mask, and only have keys for the passes
+// that were applied to them:
+// (0xFFFF) (0x01) (NUM_SUBS:1) (PAIRS:NUM_SUBS*2)
+// (BLOCK_SIZE:2) (MASK:(NUM_SUBS + 7)/8) (KEYS:popcount(MASK)) (DATA:n)
+// 
+// MASK: bit (sub & 7) of byte (sub >> 3) is set if pass sub was applied.
+// 
+// RECORD_TYPE 0x02: block checksum, for the data block that follows it:
+// (0xFFFF) (0x02) (RECORD_CRC:4) (DATA_CRC:4)
+// 
+// RECORD_CRC: CRC-32C of the complete block record (size, mask, keys, data),
+// preceded by the match record of the segment the block starts, if any
+// DATA_CRC: CRC-32C of the decoded block
+// 
+// RECORD_TYPE 0x03: archive table of contents, last record of an archive:
+// (0xFFFF) (0x03) (TOC_SIZE:4) (NUM_MEMBERS:4) (TABLE_SIZE:4) (MEMBERS)
+// (TOC_OFFSET:8)
+// MEMBER: (OFFSET:8) (COMP_SIZE:8) (RAW_SIZE:8) (NAME_LEN:2) (NAME:NAME_LEN)
+// 
+// TOC_SIZE: length of the record following the TOC_SIZE field
+// TABLE_SIZE: length of the shared pair table record at the start of the
+// archive, or 0 if every member starts with its own table
+// OFFSET, COMP_SIZE: location of the member's records in the archive
+// TOC_OFFSET: location of this record, so it can be found from the end
+// 
+// Members are complete record streams laid end to end, so a whole archive
+// decodes to the concatenation of its members. A single member is decoded
+// from the shared table record, if any, followed by its own records.
+// 
+// RECORD_TYPE 0x04: wide block, written with --wide. Stands alone, without a
+// pair table record:
+// (0xFFFF) (0x04) (NUM_SUBS:2) (WIDTH:1) (RAW_SIZE:4) (NUM_SYMBOLS:4)
+// (PAIRS:NUM_SUBS*4) (DATA:(NUM_SYMBOLS*WIDTH + 7)/8)
+// 
+// Symbols 0-255 are bytes, and 256 + i is the key of pass i, so no byte values
+// need to be unused and blocks can be far larger than 65534 bytes.
+// WIDTH: bits per symbol, enough for 256 + NUM_SUBS symbols
+// PAIRS: two 16-bit symbols per pass, each a byte or an earlier pass's key
+// DATA: the symbols, packed least significant bit first
+// A checksum record can precede a wide block as for any other.
+// 
+// RECORD_TYPE 0x05: long block, written with --long-blocks for blocks of
+// more than 65534 raw bytes. The same as a data block, with the size as a
+// varint (misc/flexints.h: 7 bits per byte, most significant first, high bit
+// set on all but the last byte) of at most 4 bytes:
+// (0xFFFF) (0x05) (BLOCK_SIZE:1-4) [MASK] (KEYS) (DATA:BLOCK_SIZE)
+// 
+// RECORD_TYPE 0x06: entropy-coded block, written with --entropy for blocks
+// whose data shrinks when coded. The same as a long block, with the data
+// coded by the table-driven tANS coder in bpfse.h:
+// (0xFFFF) (0x06) (BLOCK_SIZE:1-4) (CODED_SIZE:1-4) [MASK] (KEYS)
+// (CODED:CODED_SIZE)
+// 
+// BLOCK_SIZE: bytes of data once CODED is decoded, CODED_SIZE less than that
+// 
+// RECORD_TYPE 0x07: long-range matches, written with --matches ahead of the
+// first block of each segment of input:
+// (0xFFFF) (0x07) (RECORD_SIZE:4) (LITERAL_SIZE:1-4) (NUM_MATCHES:1-4)
+// (MATCHES: (LITERALS:1-4) (DISTANCE:1-4) (LENGTH:1-4) each)
+// 
+// RECORD_SIZE: length of the record following the RECORD_SIZE field
+// LITERAL_SIZE: decoded size of the blocks that make up the segment
+// The segment is each match's LITERALS bytes from the blocks followed by a
+// copy of LENGTH + 32 bytes from DISTANCE bytes back in the output, then
+// the rest of the blocks' bytes, of which there is at least one. A copy may
+// overlap its own output, and reaches back at most 8 MiB.
+// -----------------------------------------------------------------------------
+// Aligned container, written with --aligned. The same blocks, but all block
+// headers are stored together up front as arrays, so any block can be found
+// without walking the ones before it, and every payload is 64-byte aligned.
+// Multi-byte fields are little-endian.
+// (MAGIC:4 = "BPAC") (VERSION:1 = 1) (FLAGS:1) (NUM_SUBS:1) (0:1)
+// (NUM_TABLES:4) (NUM_BLOCKS:4) (RAW_SIZE:8) (HEADER_CRC:4) (0:4)
+// followed by these arrays, each starting on a 64-byte boundary:
+// PAIRS[NUM_TABLES][2*NUM_SUBS]
+// COMP_SIZE[NUM_BLOCKS]:2
+// RAW_SIZE[NUM_BLOCKS]:2
+// TABLE_ID[NUM_BLOCKS]:4
+// DATA_OFFSET[NUM_BLOCKS]:8
+// MASK[NUM_BLOCKS][(NUM_SUBS + 7)/8], if FLAGS & 0x01
+// KEYS[NUM_BLOCKS][NUM_SUBS]
+// DATA_CRC[NUM_BLOCKS]:4, PAYLOAD_CRC[NUM_BLOCKS]:4, if FLAGS & 0x02
+// and then the payloads, each zero-padded to a multiple of 64 bytes.
+// 
+// FLAGS: 0x01 blocks are masked as with the 0xFFFF 0x01 table record,
+// 0x02 checksums are present
+// KEYS: keys of the passes applied to the block, in order, zero-padded
+// DATA_OFFSET: location of the block's payload from the start of the file
+// HEADER_CRC: CRC-32C of everything from the end of the fixed header to the
+// first payload, if checksums are present
+// 
+// Legacy streams start with a 0x0000 or 0xFFFF table record, so the magic
+// tells the two apart.
 // *****************************************************************************
 
 #include <stdio.h>
@@ -83,14 +191,33 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <functional>
+#include <random>
 
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
-// #define NUMPASSES  (128)
-// #define NUMPASSES  (64)
-#define NUMPASSES  (32)
-// #define NUMPASSES  (16)
-// #define NUMPASSES  (8)
+#include "bpqueue.h"
+#include "bpio.h"
+#include "bpcodec.h"
+#include "bptrace.h"
+#include "bpperf.h"
+
+// Pipeline: input chunk size, reads and writes kept in flight, items queued
+// between stages, and the most output gathered into a single write.
+#define BP_PIPE_CHUNK     (1 << 20)
+#define BP_PIPE_DEPTH     (4)
+#define BP_PIPE_BACKLOG   (16)
+#define BP_WRITE_GATHER   (1 << 20)
+#define BP_WRITE_MAXIOV   (64)
+
+// Most input sampled to find the shared table of an archive
+#define BP_ARCHIVE_SAMPLE  (8 << 20)
+
+// Default sample, in MiB, kept by --stream to find the shared table
+#define BP_STREAM_SAMPLE  (64)
 
 static inline int imin(int x, int y) {return (x < y)? x : y;}
 static inline int imax(int x, int y) {return (x > y)? x : y;}
@@ -105,363 +232,1082 @@ struct Stats {
     size_t inputSize;
     size_t outputSize;
     size_t numBlocks;
+    size_t tablesReused;
     double avgSubs;
+    
+    // Pass records for --stats: totals over all blocks, and the passes of
+    // the shared table
+    bool logPasses;
+    Effort effort;// pair search settings
+    LoopPool * pool;// threads for --beam, NULL if there are none
+    bool entropy;// entropy code block data where it helps
+    DecodeLimits limits;
+    DecodeCost worstCost;// highest of each block's decode costs
+    double searchTime, subsTime, discardedTime;
+    std::vector<PassRecord> tablePasses;
 };
 
 
-struct PairCount {
-    size_t count;
-    uint8_t first;
-    uint8_t second;
-};
+typedef SpscQueue<std::vector<uint8_t> *> ChunkQueue;
+typedef SpscQueue<Block *> BlockQueue;
+typedef SpscQueue<EncodedBlock *> EncodedQueue;
 
+// The encoders take blocks from in, in input order, and pass them to out,
+// followed by NULL once in is finished.
+void BP_Encode1(BlockQueue & in, EncodedQueue & out, Stats & stats);
+void BP_Encode2(BlockQueue & in, EncodedQueue & out, Stats & stats);
+void BP_Encode2Fixed(BlockQueue & in, EncodedQueue & out, Stats & stats, const std::vector<PairCount> & pairs);
 
-struct Block {
-    std::vector<uint8_t> data;// 
-    std::vector<uint8_t> unused;
-    std::vector<uint8_t> subs;
-    Block(const uint8_t *& _data, const uint8_t * dataEnd);
+void BP_Encode1(BlockQueue & in, EncodedQueue & out, Stats & stats)
+{
+    BP_TRACE_THREAD("encode");
+    stats.numBlocks = 0;
+    stats.avgSubs = 0;
+    stats.tablesReused = 0;
     
+    TableSearch search;
+    search.logPasses = stats.logPasses;
+    search.effort = stats.effort;
+    search.limits = stats.limits;
+    search.pool = stats.pool;
+    while(Block * blk = in.Pop())
+    {
+        EncodedBlock * enc = new EncodedBlock;
+        if(search.Encode(blk, *enc))
+            ++stats.tablesReused;
+        ++stats.numBlocks;
+        stats.avgSubs += blk->subs.size();
+        out.Push(enc);
+    }
+    out.Push(NULL);
     
-    void CollectUnused();
-    void DoSubs(int sub, uint8_t first, uint8_t second);
-};
+    if(stats.numBlocks)
+        stats.avgSubs /= stats.numBlocks;
+}
 
-Block::Block(const uint8_t *& _data, const uint8_t * dataEnd)
+void BP_Encode2(BlockQueue & in, EncodedQueue & out, Stats & stats)
 {
-    // Variable-size blocks
-    // Grow block until we run out of data, reach the maximum allowable block size, or
-    // number of unused byte values drops to NUMPASSES.
-    bool usedTbl[256];
-    for(int j = 0; j < 256; ++j)
-        usedTbl[j] = false;
-    
-    int usedCount = 0;
-    int rawSize = 0;
-    const uint8_t * b = _data;
-    while((b != dataEnd) && (rawSize < 65535) && (256 - usedCount != NUMPASSES))
+    BP_TRACE_THREAD("encode");
+    stats.avgSubs = 0;
+    stats.tablesReused = 0;
+    
+    // The shared table is computed over the whole input
+    std::vector<Block *> blocks;
+    while(Block * blk = in.Pop())
+        blocks.push_back(blk);
+    stats.numBlocks = blocks.size();
+    
+    std::vector<PairCount> pairs;
+    BuildSharedTable(blocks, pairs, stats.logPasses? &stats.tablePasses : NULL, stats.effort.sample,
+                     stats.limits.Any()? &stats.limits : NULL);
+    
+    for(auto & blk : blocks)
     {
-        if(!usedTbl[*b]) {
-            usedTbl[*b] = true;
-            ++usedCount;
-        }
-        ++b;
-        ++rawSize;
-    }
-    printf("block size: %d\n", rawSize);
-    if(rawSize == 0)
-        exit(-1);
-    data.assign(_data, _data + rawSize);
-    _data += rawSize;
-    
-    for(int j = 0; j < 256; ++j)
-        if(!usedTbl[j])
-            unused.push_back(j);
-    // printf("unused words: %lu\n", blocks.back()->unused.size());
+        FinishMasked(blk);
+        
+        // Masked pair table goes ahead of the first block
+        EncodedBlock * enc = new EncodedBlock;
+        enc->blk = blk;
+        enc->masked = true;
+        if(blk == blocks.front())
+            enc->pairs = pairs;
+        stats.avgSubs += blk->subs.size();
+        out.Push(enc);
+    }
+    out.Push(NULL);
+    
+    if(stats.numBlocks)
+        stats.avgSubs /= stats.numBlocks;
 }
 
-void Block::CollectUnused()
+// Second pass of --stream: apply a shared table found in advance to each block
+// as it arrives. Pass totals go to the table's records in stats.tablePasses.
+void BP_Encode2Fixed(BlockQueue & in, EncodedQueue & out, Stats & stats, const std::vector<PairCount> & pairs)
 {
-    bool usedTbl[256];
-    for(int j = 0; j < 256; ++j)
-        usedTbl[j] = false;
+    BP_TRACE_THREAD("encode");
+    stats.numBlocks = 0;
+    stats.avgSubs = 0;
+    stats.tablesReused = 0;
     
-    for(auto b : data)
-        usedTbl[b] = true;
+    while(Block * blk = in.Pop())
+    {
+        for(int sub = 0; sub < NUMPASSES; ++sub)
+            RunSharedPass(blk, sub, pairs[sub], stats.logPasses, stats.limits.Any()? &stats.limits : NULL);
+        FinishMasked(blk);
+        for(auto & rec : blk->passLog) {
+            PassRecord & total = stats.tablePasses[rec.sub];
+            total.count += rec.count;
+            total.subsTime += rec.subsTime;
+            ++total.numBlocks;
+        }
+        
+        EncodedBlock * enc = new EncodedBlock;
+        enc->blk = blk;
+        enc->masked = true;
+        if(stats.numBlocks == 0)
+            enc->pairs = pairs;
+        ++stats.numBlocks;
+        stats.avgSubs += blk->subs.size();
+        out.Push(enc);
+    }
+    out.Push(NULL);
     
-    unused.clear();
-    for(int j = 0; j < 256; ++j)
-        if(!usedTbl[j])
-            unused.push_back(j);
+    if(stats.numBlocks)
+        stats.avgSubs /= stats.numBlocks;
 }
 
-void Block::DoSubs(int sub, uint8_t first, uint8_t second)
+// *****************************************************************************
+// Pipeline stages. Each runs on its own thread, joined by SPSC queues:
+// read -> partition -> encode -> serialize -> write
+// Every stage passes NULL along once its input is finished.
+
+// readOK is cleared if the input can't be read. What was read before the
+// error is still passed along.
+static void ReadStage(int fd, ChunkQueue & out, Stats & stats, bool useRing, bool & readOK)
 {
-    if(!unused.empty())
+    BP_TRACE_THREAD("read");
+    ChunkReader input(fd, BP_PIPE_CHUNK, BP_PIPE_DEPTH, useRing);
+    stats.inputSize = 0;
+    std::vector<uint8_t> * chunk = new std::vector<uint8_t>;
+    while(true)
     {
-        subs.push_back(unused.back());
-        unused.pop_back();
-        
-        uint8_t * dataInEnd = &data[0] + data.size();
-        uint8_t * dataIn = &data[0];
-        uint8_t * dataOut = &data[0];
-        
-        while(dataIn != dataInEnd)
         {
-            if(dataIn + 1 != dataInEnd && *dataIn == first && *(dataIn + 1) == second)
-            {
-                *dataOut++ = subs[sub];
-                dataIn += 2;
-            }
-            else {
-                *dataOut++ = *dataIn++;
+            BP_TRACE_SCOPE("read");
+            if(!input.Next(*chunk))
+                break;
+        }
+        stats.inputSize += chunk->size();
+        out.Push(chunk);
+        chunk = new std::vector<uint8_t>;
+    }
+    delete chunk;
+    readOK = !input.Failed();
+    out.Push(NULL);
+}
+
+// A block is only cut once a full maximum-size block of input is buffered, so
+// block boundaries don't depend on how the input was chunked.
+static void PartitionStage(ChunkQueue & in, BlockQueue & out, bool checksum, size_t maxBlock)
+{
+    BP_TRACE_THREAD("partition");
+    std::vector<uint8_t> pending;
+    size_t pos = 0;
+    bool eof = false;
+    while(true)
+    {
+        while(!eof && pending.size() - pos < maxBlock)
+        {
+            std::vector<uint8_t> * chunk = in.Pop();
+            if(!chunk) {
+                eof = true;
+                break;
             }
+            pending.erase(pending.begin(), pending.begin() + pos);
+            pending.insert(pending.end(), chunk->begin(), chunk->end());
+            pos = 0;
+            delete chunk;
         }
-        // printf("%d %d -> %d\n", first, second, subs[sub]);
-        // printf("compressed block from: %lu to %lu\n", data.size(), dataOut - &data[0]);
-        data.resize(dataOut - &data[0]);
+        if(pos == pending.size())
+            break;
         
-        // Substitutions may have freed up some more substitution values, do another search when we run out
-        // Not necessary with current setup, blocks are guaranteed to have available byte values.
-        // if(unused.empty())
-        //     CollectUnused();
+        const uint8_t * data = &pending[pos];
+        Block * blk = new Block(data, &pending[0] + pending.size(), maxBlock);
+        if(checksum)
+            blk->dataCRC = BP_CRC32C(&blk->data[0], blk->data.size());
+        out.Push(blk);
+        pos = data - &pending[0];
     }
+    out.Push(NULL);
 }
 
+// --matches takes the place of partition: each BP_MATCH_SEGMENT bytes of input
+// have their long repeats taken out, and the literals left are cut into
+// blocks, the first of which carries the segment's match record.
+static void MatchStage(ChunkQueue & in, BlockQueue & out, bool checksum, size_t maxBlock)
+{
+    BP_TRACE_THREAD("partition");
+    MatchFinder finder;
+    std::vector<uint8_t> pending, lits;
+    std::vector<Match> matches;
+    bool eof = false;
+    while(true)
+    {
+        while(!eof && pending.size() < BP_MATCH_SEGMENT)
+        {
+            std::vector<uint8_t> * chunk = in.Pop();
+            if(!chunk) {
+                eof = true;
+                break;
+            }
+            pending.insert(pending.end(), chunk->begin(), chunk->end());
+            delete chunk;
+        }
+        if(pending.empty())
+            break;
+        
+        size_t segSize = std::min(pending.size(), (size_t)BP_MATCH_SEGMENT);
+        lits.clear();
+        matches.clear();
+        finder.Find(&pending[0], segSize, lits, matches);
+        pending.erase(pending.begin(), pending.begin() + segSize);
+        
+        const uint8_t * data = &lits[0], * litEnd = &lits[0] + lits.size();
+        while(data < litEnd)
+        {
+            bool first = (data == &lits[0]);
+            Block * blk = new Block(data, litEnd, maxBlock);
+            if(first)
+                SerializeMatches(matches, lits.size(), blk->matches);
+            if(checksum)
+                blk->dataCRC = BP_CRC32C(&blk->data[0], blk->data.size());
+            out.Push(blk);
+        }
+    }
+    out.Push(NULL);
+}
 
-void GetBestPair(std::vector<Block *> & blocks, PairCount & bestPair)
+// --wide takes the place of partition, encode and serialize: the input is cut
+// into BP_WIDE_BLOCK_SIZE blocks, each encoded into a wide block record.
+static void WideStage(ChunkQueue & in, ChunkQueue & out, Stats & stats, bool checksum, int maxPasses)
 {
-    std::vector<size_t> pairCounts(65536, 0);
-    // table index is concatenation of bytes, first byte being the high byte
+    BP_TRACE_THREAD("encode");
+    stats.outputSize = 0;
+    stats.numBlocks = 0;
+    stats.avgSubs = 0;
+    stats.tablesReused = 0;
     
-    for(auto & blk : blocks)
+    WideEncoder encoder(maxPasses);
+    WideBlock blk;
+    std::vector<uint8_t> pending;
+    bool eof = false;
+    while(true)
     {
-        if(!blk->unused.empty()) {
-            uint8_t * data = &(blk->data[0]);
-            for(int j = 0; j < blk->data.size() - 1; ++j) {
-                int first = *data, second = *(data + 1);
-                ++(pairCounts[(first << 8) | second]);
-                ++data;
+        while(!eof && pending.size() < BP_WIDE_BLOCK_SIZE)
+        {
+            std::vector<uint8_t> * chunk = in.Pop();
+            if(!chunk) {
+                eof = true;
+                break;
             }
+            pending.insert(pending.end(), chunk->begin(), chunk->end());
+            delete chunk;
         }
+        if(pending.empty())
+            break;
+        
+        size_t size = std::min(pending.size(), (size_t)BP_WIDE_BLOCK_SIZE);
+        encoder.Encode(&pending[0], size, blk);
+        if(checksum)
+            blk.dataCRC = BP_CRC32C(&pending[0], size);
+        std::vector<uint8_t> * bfr = new std::vector<uint8_t>;
+        SerializeWide(blk, *bfr, checksum);
+        stats.outputSize += bfr->size();
+        ++stats.numBlocks;
+        stats.avgSubs += blk.pairs.size()/2;
+        pending.erase(pending.begin(), pending.begin() + size);
+        out.Push(bfr);
     }
+    out.Push(NULL);
     
-    int bestPairIdx = 0;
-    size_t bestPairCount = pairCounts[0];
-    for(int j = 1; j < 65536; ++j)
+    if(stats.numBlocks)
+        stats.avgSubs /= stats.numBlocks;
+}
+
+// First pass of --stream: keep a uniform sample of up to maxBlocks blocks
+// (reservoir sampling), freeing the rest. The generator has a fixed seed so
+// the output doesn't change from run to run.
+static void SampleStage(BlockQueue & in, std::vector<Block *> & sample, size_t maxBlocks)
+{
+    BP_TRACE_SCOPE("sample");
+    std::mt19937_64 rng(maxBlocks);
+    size_t numSeen = 0;
+    while(Block * blk = in.Pop())
     {
-        if(pairCounts[j] > bestPairCount) {
-            bestPairIdx = j;
-            bestPairCount = pairCounts[j];
+        if(sample.size() < maxBlocks) {
+            sample.push_back(blk);
+        }
+        else {
+            size_t j = rng() % (numSeen + 1);
+            if(j < maxBlocks)
+                std::swap(sample[j], blk);
+            delete blk;
         }
+        ++numSeen;
     }
-    
-    // for(int j = 0; j < 65536; ++j)
-    //         if(pairCounts[j])
-    //             printf("count: %d, %d: %lu\n", (int)j >> 8, (int)j & 0xFF, pairCounts[j]);
-    
-    
-    bestPair.first = bestPairIdx >> 8;
-    bestPair.second = bestPairIdx & 0xFF;
-    
-    // printf("best count: %d, %d: %lu\n", (int)bestPairIdx >> 8, (int)bestPairIdx & 0xFF, pairCounts[bestPairIdx]);
 }
 
-void GetBestPair(const Block * block, PairCount & bestPair)
+// Write str as a JSON string literal
+static void WriteJSONString(FILE * f, const char * str)
 {
-    std::vector<size_t> pairCounts(65536, 0);
-    // table index is concatenation of bytes, first byte being the high byte
-    
-    const uint8_t * data = &(block->data[0]);
-    for(int j = 0; j < block->data.size() - 1; ++j) {
-        int first = *data, second = *(data + 1);
-        ++(pairCounts[(first << 8) | second]);
-        ++data;
+    fputc('"', f);
+    for(const unsigned char * c = (const unsigned char *)str; *c; ++c)
+    {
+        if(*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if(*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+static void WritePassStats(FILE * f, const PassRecord & rec, long bytesSaved, bool first)
+{
+    fprintf(f, "%s\n      {\"pass\": %d, \"pair\": [%d, %d], \"count\": %lu, \"blocks\": %lu, \"bytesSaved\": %ld, "
+        "\"searchTime\": %.9f, \"subsTime\": %.9f}", first? "" : ",", rec.sub, rec.first, rec.second,
+        rec.count, rec.numBlocks, bytesSaved, rec.searchTime, rec.subsTime);
+}
+
+// Per-block --stats record. recordSize is everything written for the block,
+// including any pair table ahead of it. Each pass costs the block a key, and
+// its pair too if the block brings its own table.
+static void WriteBlockStats(FILE * f, const EncodedBlock & enc, size_t blockIdx, size_t recordSize, Stats & stats)
+{
+    const Block * blk = enc.blk;
+    int pairCost = (!enc.pairs.empty() && !enc.masked)? 2 : 0;
+    fprintf(f, "%s    {\"block\": %lu, \"rawSize\": %lu, \"compSize\": %lu, \"recordSize\": %lu, "
+        "\"newTable\": %s, \"discardedTime\": %.9f, \"passes\": [", blockIdx? ",\n" : "", blockIdx,
+        blk->rawSize, blk->data.size(), recordSize, enc.pairs.empty()? "false" : "true", blk->discardedTime);
+    for(size_t j = 0; j < blk->passLog.size(); ++j)
+    {
+        const PassRecord & rec = blk->passLog[j];
+        WritePassStats(f, rec, (long)rec.count - 1 - pairCost, j == 0);
+        stats.searchTime += rec.searchTime;
+        stats.subsTime += rec.subsTime;
     }
+    fprintf(f, "\n    ], \"decode\": {\"passes\": %d, \"depth\": %d, \"length\": %lu, \"passBytes\": %lu}}",
+        blk->cost.passes, blk->cost.depth, blk->cost.length, blk->cost.passBytes);
+    stats.discardedTime += blk->discardedTime;
+}
+
+static void SerializeStage(EncodedQueue & in, ChunkQueue & out, Stats & stats, bool checksum, FILE * statsFile)
+{
+    BP_TRACE_THREAD("serialize");
+    stats.outputSize = 0;
+    for(size_t blockIdx = 0; EncodedBlock * enc = in.Pop(); ++blockIdx)
+    {
+        std::vector<uint8_t> * bfr = new std::vector<uint8_t>;
+        SerializeBlock(*enc, *bfr, checksum, stats.entropy);
+        stats.outputSize += bfr->size();
+        stats.worstCost.Max(enc->blk->cost);
+        if(statsFile)
+            WriteBlockStats(statsFile, *enc, blockIdx, bfr->size(), stats);
+        delete enc->blk;
+        delete enc;
+        out.Push(bfr);
+    }
+    out.Push(NULL);
+}
+
+// Collects every block for an aligned container, then passes on the header
+// and arrays followed by the padded payloads.
+static void ContainerStage(EncodedQueue & in, ChunkQueue & out, Stats & stats, bool checksum, FILE * statsFile)
+{
+    BP_TRACE_THREAD("serialize");
+    std::vector<uint8_t> pairs, masks, keys;
+    std::vector<uint16_t> compSizes, rawSizes;
+    std::vector<uint32_t> tableIds, dataCRCs, payloadCRCs;
+    std::vector<std::vector<uint8_t> *> payloads;
+    size_t numTables = 0;
+    bool masked = false;
     
-    int bestPairIdx = 0;
-    size_t bestPairCount = pairCounts[0];
-    for(int j = 1; j < 65536; ++j)
+    // Tables are all the same size, which is less than NUMPASSES only if the
+    // passes were limited
+    int numSubs = NUMPASSES;
+    while(EncodedBlock * enc = in.Pop())
     {
-        if(pairCounts[j] > bestPairCount) {
-            bestPairIdx = j;
-            bestPairCount = pairCounts[j];
+        const Block * blk = enc->blk;
+        stats.worstCost.Max(blk->cost);
+        if(!enc->pairs.empty())
+        {
+            numSubs = enc->pairs.size();
+            for(auto & pair : enc->pairs) {
+                pairs.push_back(pair.first);
+                pairs.push_back(pair.second);
+            }
+            ++numTables;
+        }
+        masked = enc->masked;
+        
+        // Applied passes' keys first, padded out to numSubs
+        compSizes.push_back(blk->data.size());
+        rawSizes.push_back(blk->rawSize);
+        tableIds.push_back(numTables - 1);
+        if(masked)
+            masks.insert(masks.end(), blk->passMask.begin(), blk->passMask.end());
+        keys.insert(keys.end(), blk->subs.begin(), blk->subs.end());
+        keys.resize(keys.size() + numSubs - blk->subs.size(), 0);
+        
+        std::vector<uint8_t> * payload = new std::vector<uint8_t>(blk->data);
+        if(checksum) {
+            dataCRCs.push_back(blk->dataCRC);
+            payloadCRCs.push_back(BP_CRC32C(&blk->data[0], blk->data.size()));
         }
+        payload->resize(AlignUp(payload->size()), 0);
+        payloads.push_back(payload);
+        if(statsFile)
+        {
+            // Payload, its entries in the header arrays, and its table
+            size_t recordSize = payload->size() + 16 + blk->passMask.size() + numSubs + (checksum? 8 : 0) +
+                                2*enc->pairs.size();
+            WriteBlockStats(statsFile, *enc, payloads.size() - 1, recordSize, stats);
+        }
+        delete enc->blk;
+        delete enc;
     }
     
-    bestPair.first = bestPairIdx >> 8;
-    bestPair.second = bestPairIdx & 0xFF;
+    size_t numBlocks = payloads.size();
+    int flags = (masked? BP_CONTAINER_MASKED : 0) | (checksum? BP_CONTAINER_CHECKSUM : 0);
+    ContainerLayout layout;
+    GetContainerLayout(layout, numTables, numBlocks, numSubs, flags);
+    
+    BP_TRACE_SCOPE("container header");
+    std::vector<uint8_t> * header = new std::vector<uint8_t>(layout.dataStart, 0);
+    uint8_t * hdr = &(*header)[0];
+    memcpy(hdr, BP_CONTAINER_MAGIC, 4);
+    hdr[4] = BP_CONTAINER_VERSION;
+    hdr[5] = flags;
+    hdr[6] = numSubs;
+    PutLE(hdr + 8, numTables, 4);
+    PutLE(hdr + 12, numBlocks, 4);
+    PutLE(hdr + 16, stats.inputSize, 8);
     
-    // printf("best count: %d, %d: %lu\n", (int)bestPairIdx >> 8, (int)bestPairIdx & 0xFF, pairCounts[bestPairIdx]);
+    if(!pairs.empty())
+        memcpy(hdr + layout.pairs, &pairs[0], pairs.size());
+    if(!masks.empty())
+        memcpy(hdr + layout.mask, &masks[0], masks.size());
+    if(!keys.empty())
+        memcpy(hdr + layout.keys, &keys[0], keys.size());
+    size_t offset = layout.dataStart;
+    for(size_t b = 0; b < numBlocks; ++b)
+    {
+        PutLE(hdr + layout.compSize + 2*b, compSizes[b], 2);
+        PutLE(hdr + layout.rawSize + 2*b, rawSizes[b], 2);
+        PutLE(hdr + layout.tableId + 4*b, tableIds[b], 4);
+        PutLE(hdr + layout.dataOffset + 8*b, offset, 8);
+        if(checksum) {
+            PutLE(hdr + layout.dataCRC + 4*b, dataCRCs[b], 4);
+            PutLE(hdr + layout.payloadCRC + 4*b, payloadCRCs[b], 4);
+        }
+        offset += payloads[b]->size();
+    }
+    if(checksum)
+        PutLE(hdr + 24, BP_CRC32C(hdr + BP_CONTAINER_HEADER, layout.dataStart - BP_CONTAINER_HEADER), 4);
+    
+    stats.outputSize = offset;
+    out.Push(header);
+    for(auto & payload : payloads)
+        out.Push(payload);
+    out.Push(NULL);
+}
+
+// Gathers whatever serialized blocks are ready, up to BP_WRITE_GATHER bytes,
+// into each write.
+static bool WriteStage(int fd, ChunkQueue & in, bool useRing)
+{
+    BP_TRACE_THREAD("write");
+    ChunkWriter output(fd, BP_PIPE_DEPTH, useRing);
+    std::vector<std::vector<uint8_t> > gather;
+    bool done = false;
+    while(!done)
+    {
+        std::vector<uint8_t> * bfr = in.Pop();
+        size_t gathered = 0;
+        while(bfr)
+        {
+            gathered += bfr->size();
+            gather.push_back(std::vector<uint8_t>());
+            gather.back().swap(*bfr);
+            delete bfr;
+            if(gathered >= BP_WRITE_GATHER || gather.size() >= BP_WRITE_MAXIOV || !in.TryPop(bfr))
+                break;
+        }
+        done = (bfr == NULL);
+        BP_TRACE_SCOPE("write");
+        output.WriteGather(gather);
+    }
+    BP_TRACE_SCOPE("flush");
+    output.Flush();
+    return !output.Failed();
 }
 
+// *****************************************************************************
+// Archive mode: many input files packed into one stream, encoded on a pool of
+// threads. Members are dealt round-robin to the workers and collected in the
+// same rotation, as in the pipelined decoder, so they are written in argument
+// order and the worker queues bound how far ahead the pool runs.
+
+struct ArchiveMember {
+    const char * name;
+    std::vector<uint8_t> out;
+    size_t rawSize;
+    Stats stats;
+};
 
+typedef SpscQueue<ArchiveMember *> MemberQueue;
 
-void BP_Encode1(FILE * fout, std::vector<Block *> & blocks, Stats & stats);
-void BP_Encode2(FILE * fout, std::vector<Block *> & blocks, Stats & stats);
+static void PutU64(uint8_t * bfr, uint64_t val)
+{
+    PutU32(bfr, val >> 32);
+    PutU32(bfr + 4, val & 0xFFFFFFFF);
+}
+
+static bool ReadWholeFile(const char * fname, std::vector<uint8_t> & data)
+{
+    BP_TRACE_SCOPE("read");
+    FILE * f = fopen(fname, "rb");
+    if(!f)
+        return false;
+    data.clear();
+    uint8_t bfr[1 << 16];
+    size_t n;
+    while((n = fread(bfr, 1, sizeof(bfr), f)) > 0)
+        data.insert(data.end(), bfr, bfr + n);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+// Cut a member into blocks, as the partition stage does for a single stream
+static void PartitionMember(const std::vector<uint8_t> & raw, std::vector<Block *> & blocks, bool checksum)
+{
+    const uint8_t * data = raw.empty()? NULL : &raw[0];
+    const uint8_t * dataEnd = data + raw.size();
+    while(data != dataEnd)
+    {
+        Block * blk = new Block(data, dataEnd);
+        if(checksum)
+            blk->dataCRC = BP_CRC32C(&blk->data[0], blk->data.size());
+        blocks.push_back(blk);
+    }
+}
 
-void BP_Encode1(FILE * fout, std::vector<Block *> & blocks, Stats & stats)
+// Encode one member into a self-contained record stream. Without a shared
+// table it starts with its own pair table, so it can be decoded alone.
+static void EncodeMember(ArchiveMember & member, const std::vector<PairCount> & shared, bool checksum, bool entropy,
+                         const Effort & effort, LoopPool * pool)
 {
+    BP_TRACE_SCOPE("encode member");
+    std::vector<uint8_t> raw;
+    if(!ReadWholeFile(member.name, raw)) {
+        fprintf(stderr, "Could not read %s\n", member.name);
+        exit(EXIT_FAILURE);
+    }
+    member.rawSize = raw.size();
+    
+    std::vector<Block *> blocks;
+    PartitionMember(raw, blocks, checksum);
+    
+    Stats & stats = member.stats;
+    stats.inputSize = raw.size();
+    stats.numBlocks = blocks.size();
+    stats.tablesReused = 0;
     stats.avgSubs = 0;
-    uint8_t writeBuf[4];
     
+    TableSearch search;
+    search.effort = effort;
+    search.pool = pool;
     for(auto & blk : blocks)
     {
-        std::vector<PairCount> pairs;
-        for(int sub = 0; sub < NUMPASSES; ++sub)
-        {
-            PairCount bestPair;
-            GetBestPair(blk, bestPair);
-            pairs.push_back(bestPair);
-            blk->DoSubs(sub, bestPair.first, bestPair.second);
+        EncodedBlock enc;
+        if(shared.empty()) {
+            if(search.Encode(blk, enc))
+                ++stats.tablesReused;
         }
-        
-        // Write pair table
-        writeBuf[0] = 0x00;
-        writeBuf[1] = 0x00;
-        fwrite(writeBuf, sizeof(uint8_t), 2, fout);
-        
-        writeBuf[0] = NUMPASSES;
-        fwrite(writeBuf, sizeof(uint8_t), 1, fout);
-        
-        for(int sub = 0; sub < NUMPASSES; ++sub)
-        {
-            // printf("pair: %d, %d\n", (int)pairs[sub].first, (int)pairs[sub].second);
-            fwrite(&(pairs[sub].first), sizeof(uint8_t), 1, fout);
-            fwrite(&(pairs[sub].second), sizeof(uint8_t), 1, fout);
+        else {
+            for(int sub = 0; sub < (int)shared.size(); ++sub)
+                blk->DoSubs(sub, shared[sub].first, shared[sub].second, true);
+            FinishMasked(blk);
+            enc.blk = blk;
+            enc.masked = true;
         }
-        
-        
-        // Write block
-        int blockSize = blk->data.size();
-        int numSubs = blk->subs.size();
-        if(numSubs != NUMPASSES)
-        {
-            printf("Block had %d substitutions, %d expected\n", numSubs, NUMPASSES);
+        stats.avgSubs += blk->subs.size();
+        SerializeBlock(enc, member.out, checksum, entropy);
+        delete blk;
+    }
+    stats.outputSize = member.out.size();
+}
+
+// Shared table for the whole archive, found over a sample of the members
+// spread evenly through the argument list, of at most BP_ARCHIVE_SAMPLE bytes
+// unless a single member is larger.
+static void TrainSharedTable(const std::vector<const char *> & fnames, std::vector<PairCount> & pairs, int sample)
+{
+    BP_TRACE_SCOPE("train shared table");
+    size_t totalSize = 0;
+    std::vector<size_t> sizes;
+    for(auto & fname : fnames)
+    {
+        struct stat st;
+        if(stat(fname, &st) != 0) {
+            fprintf(stderr, "Could not open %s\n", fname);
             exit(EXIT_FAILURE);
         }
-            
-        // printf("Block size: %d, num subs: %d\n", blockSize, numSubs);
-        
-        writeBuf[0] = (blockSize >> 8) & 0xFF;
-        writeBuf[1] = blockSize & 0xFF;
-        fwrite(writeBuf, sizeof(uint8_t), 2, fout);
-        
-        for(int sub = 0; sub < numSubs; ++sub)
-            fwrite(&(blk->subs[sub]), sizeof(uint8_t), 1, fout);
-        
-        fwrite(&(blk->data[0]), sizeof(uint8_t), blockSize, fout);
-        
-        stats.avgSubs += numSubs;
+        sizes.push_back(st.st_size);
+        totalSize += st.st_size;
     }
     
-    stats.avgSubs /= stats.numBlocks;
+    size_t stride = std::max((size_t)1, (totalSize + BP_ARCHIVE_SAMPLE - 1)/BP_ARCHIVE_SAMPLE);
+    std::vector<Block *> blocks;
+    std::vector<uint8_t> raw;
+    for(size_t j = 0; j < fnames.size(); j += stride)
+    {
+        if(sizes[j] == 0)
+            continue;
+        if(!ReadWholeFile(fnames[j], raw)) {
+            fprintf(stderr, "Could not read %s\n", fnames[j]);
+            exit(EXIT_FAILURE);
+        }
+        PartitionMember(raw, blocks, false);
+    }
+    
+    if(!blocks.empty())
+        BuildSharedTable(blocks, pairs, NULL, sample);
+    for(auto & blk : blocks)
+        delete blk;
 }
 
-void BP_Encode2(FILE * fout, std::vector<Block *> & blocks, Stats & stats)
+// Write fnames to fd as an archive, encoded by numWorkers threads. The table
+// of contents goes at the end, once all member offsets are known. With a beam
+// search, threads left over once each member has one help with the search.
+static bool BP_EncodeArchive(int fd, const std::vector<const char *> & fnames, int numWorkers,
+                             bool sharedTable, bool checksum, bool entropy, const Effort & effort, bool useRing,
+                             Stats & stats)
 {
-    stats.avgSubs = 0;
-    
-    std::vector<PairCount> pairs;
-    for(int sub = 0; sub < NUMPASSES; ++sub)
+    BP_TRACE_THREAD("write");
+    std::vector<PairCount> shared;
+    std::vector<uint8_t> header;
+    if(sharedTable)
     {
-        // find best pair across all blocks
-        PairCount bestPair;
-        GetBestPair(blocks, bestPair);
-        pairs.push_back(bestPair);
-        
-        // Do substitution
-        for(auto & blk : blocks)
-            blk->DoSubs(sub, bestPair.first, bestPair.second);
+        TrainSharedTable(fnames, shared, effort.sample);
+        if(!shared.empty())
+            SerializeTable(shared, true, header);
     }
     
-    uint8_t writeBuf[4];
+    int numThreads = numWorkers;
+    numWorkers = (int)std::max((size_t)1, std::min((size_t)numWorkers, fnames.size()));
+    LoopPool * pool = (effort.beam > 1 && numThreads > numWorkers)? new LoopPool(numThreads - numWorkers) : NULL;
     
-    // write pair table
-    writeBuf[0] = 0x00;
-    writeBuf[1] = 0x00;
-    fwrite(writeBuf, sizeof(uint8_t), 2, fout);
+    std::vector<MemberQueue *> fromWorker;
+    for(int w = 0; w < numWorkers; ++w)
+        fromWorker.push_back(new MemberQueue(BP_PIPE_BACKLOG));
     
-    writeBuf[0] = NUMPASSES;
-    fwrite(writeBuf, sizeof(uint8_t), 1, fout);
+    std::vector<std::thread> workers;
+    for(int w = 0; w < numWorkers; ++w)
+        workers.push_back(std::thread([&, w]() {
+            BP_TRACE_THREAD("encode");
+            for(size_t j = w; j < fnames.size(); j += numWorkers)
+            {
+                ArchiveMember * member = new ArchiveMember;
+                member->name = fnames[j];
+                EncodeMember(*member, shared, checksum, entropy, effort, pool);
+                fromWorker[w]->Push(member);
+            }
+        }));
     
-    for(int sub = 0; sub < NUMPASSES; ++sub)
-    {
-        // printf("pair: %d, %d\n", (int)pairs[sub].first, (int)pairs[sub].second);
-        fwrite(&(pairs[sub].first), sizeof(uint8_t), 1, fout);
-        fwrite(&(pairs[sub].second), sizeof(uint8_t), 1, fout);
-    }
+    // TOC entries: (OFFSET:8) (COMP_SIZE:8) (RAW_SIZE:8) (NAME_LEN:2) (NAME)
+    std::vector<uint8_t> toc;
+    uint8_t bfr[8] = {0};
+    toc.resize(15);
+    PutU32(&toc[7], fnames.size());
+    PutU32(&toc[11], header.size());
     
-    // Write blocks
-    for(auto & blk : blocks)
+    stats.inputSize = 0;
+    stats.outputSize = header.size();
+    stats.numBlocks = 0;
+    stats.tablesReused = 0;
+    stats.avgSubs = 0;
+    
+    ChunkWriter output(fd, BP_PIPE_DEPTH, useRing);
+    std::vector<std::vector<uint8_t> > gather(1);
+    gather[0].swap(header);
+    size_t gathered = gather[0].size();
+    for(size_t j = 0; j < fnames.size(); ++j)
     {
-        int blockSize = blk->data.size();
-        int numSubs = blk->subs.size();
-        if(numSubs != NUMPASSES)
+        MemberQueue & from = *fromWorker[j % numWorkers];
+        ArchiveMember * member;
+        if(!from.TryPop(member))
         {
-            printf("Block had %d substitutions, %d expected\n", numSubs, NUMPASSES);
-            exit(EXIT_FAILURE);
+            // Write out what has been gathered while waiting on this member
+            output.WriteGather(gather);
+            gathered = 0;
+            member = from.Pop();
         }
-            
-        // printf("Block size: %d, num subs: %d\n", blockSize, numSubs);
-        
-        writeBuf[0] = (blockSize >> 8) & 0xFF;
-        writeBuf[1] = blockSize & 0xFF;
-        fwrite(writeBuf, sizeof(uint8_t), 2, fout);
         
-        for(int sub = 0; sub < numSubs; ++sub)
-            fwrite(&(blk->subs[sub]), sizeof(uint8_t), 1, fout);
+        std::string name = member->name;
+        if(name.size() > 0xFFFF)
+            name.resize(0xFFFF);
+        PutU64(bfr, stats.outputSize);
+        toc.insert(toc.end(), bfr, bfr + 8);
+        PutU64(bfr, member->out.size());
+        toc.insert(toc.end(), bfr, bfr + 8);
+        PutU64(bfr, member->rawSize);
+        toc.insert(toc.end(), bfr, bfr + 8);
+        toc.push_back(name.size() >> 8);
+        toc.push_back(name.size() & 0xFF);
+        toc.insert(toc.end(), name.begin(), name.end());
         
-        fwrite(&(blk->data[0]), sizeof(uint8_t), blockSize, fout);
+        stats.inputSize += member->stats.inputSize;
+        stats.outputSize += member->stats.outputSize;
+        stats.numBlocks += member->stats.numBlocks;
+        stats.tablesReused += member->stats.tablesReused;
+        stats.avgSubs += member->stats.avgSubs;
         
-        stats.avgSubs += numSubs;
+        gathered += member->out.size();
+        gather.push_back(std::vector<uint8_t>());
+        gather.back().swap(member->out);
+        delete member;
+        if(gathered >= BP_WRITE_GATHER || gather.size() >= BP_WRITE_MAXIOV) {
+            BP_TRACE_SCOPE("write");
+            output.WriteGather(gather);
+            gathered = 0;
+        }
     }
+    for(auto & t : workers)
+        t.join();
+    for(int w = 0; w < numWorkers; ++w)
+        delete fromWorker[w];
+    delete pool;
+    
+    // TOC record, and the trailer pointing back at it
+    toc[0] = (BP_EXT_RECORD >> 8) & 0xFF;
+    toc[1] = BP_EXT_RECORD & 0xFF;
+    toc[2] = BP_EXT_ARCHIVE_TOC;
+    PutU32(&toc[3], toc.size() - 7 + 8);
+    PutU64(bfr, stats.outputSize);
+    toc.insert(toc.end(), bfr, bfr + 8);
+    stats.outputSize += toc.size();
+    gather.push_back(std::vector<uint8_t>());
+    gather.back().swap(toc);
+    output.WriteGather(gather);
+    output.Flush();
     
-    stats.avgSubs /= stats.numBlocks;
+    if(stats.numBlocks)
+        stats.avgSubs /= stats.numBlocks;
+    return !output.Failed();
 }
-// *****************************************************************************
 
 int main(int argc, char * argv[])
 {
-    if(argc < 2) {
-        printf("Usage: bpenc INFILE [OUTFILE]\n");
+    bool sharedTable = false;
+    size_t streamSample = 0;// MiB, 0 unless streaming
+    int widePasses = 0;// 0 unless --wide
+    bool longMatches = false;
+    size_t maxBlock = BP_MAX_BLOCK_SIZE;
+    bool useRing = true;
+    bool checksum = false;
+    bool entropy = false;
+    bool archive = false;
+    bool aligned = false;
+    bool jsonStats = false;
+    bool perf = false;
+    Effort effort = BP_Effort(BP_MAX_EFFORT);
+    int batch = 0;
+    int beam = 0;
+    double budget = 0;// seconds, 0 for none
+    DecodeLimits limits = DecodeLimits();
+    const char * isa = NULL;
+    std::string statsName;
+    int numWorkers = imax(1, std::thread::hardware_concurrency());
+    std::vector<const char *> fileArgs;
+    for(int j = 1; j < argc; ++j)
+    {
+        std::string arg = argv[j];
+        if(arg == "--shared")
+            sharedTable = true;
+        else if(arg == "--stream")
+            streamSample = BP_STREAM_SAMPLE;
+        else if(arg.compare(0, 9, "--stream=") == 0)
+            streamSample = std::max(1, atoi(arg.c_str() + 9));
+        else if(arg == "--wide")
+            widePasses = BP_WIDE_PASSES;
+        else if(arg.compare(0, 7, "--wide=") == 0)
+            widePasses = imax(1, imin(BP_WIDE_MAX_PASSES, atoi(arg.c_str() + 7)));
+        else if(arg == "--long-blocks")
+            maxBlock = BP_LONG_BLOCK_SIZE;
+        else if(arg.compare(0, 14, "--long-blocks=") == 0)
+            maxBlock = std::max(1, std::min(BP_LONG_MAX_BLOCK >> 20, atoi(arg.c_str() + 14))) << 20;
+        else if(arg == "--matches")
+            longMatches = true;
+        else if(arg == "--no-uring")
+            useRing = false;
+        else if(arg == "--crc")
+            checksum = true;
+        else if(arg == "--entropy")
+            entropy = true;
+        else if(arg == "--archive")
+            archive = true;
+        else if(arg == "--aligned")
+            aligned = true;
+        else if(arg == "--stats=json")
+            jsonStats = true;
+        else if(arg.compare(0, 13, "--stats-file=") == 0)
+            statsName = arg.substr(13);
+        else if(arg.compare(0, 10, "--threads=") == 0)
+            numWorkers = imax(1, atoi(arg.c_str() + 10));
+        else if(arg.size() == 2 && arg[0] == '-' && arg[1] >= '0' + BP_MIN_EFFORT && arg[1] <= '0' + BP_MAX_EFFORT)
+            effort = BP_Effort(arg[1] - '0');
+        else if(arg == "--beam")
+            beam = BP_BEAM_WIDTH;
+        else if(arg.compare(0, 7, "--beam=") == 0)
+            beam = imax(1, imin(BP_MAX_BEAM, atoi(arg.c_str() + 7)));
+        else if(arg.compare(0, 9, "--budget=") == 0)
+            budget = std::max(0.0, atof(arg.c_str() + 9));
+        else if(arg.compare(0, 8, "--batch=") == 0)
+            batch = imax(1, imin(BP_MAX_BATCH, atoi(arg.c_str() + 8)));
+        else if(arg.compare(0, 12, "--max-depth=") == 0)
+            limits.maxDepth = imax(1, atoi(arg.c_str() + 12));
+        else if(arg.compare(0, 13, "--max-length=") == 0)
+            limits.maxLength = imax(2, atoi(arg.c_str() + 13));
+        else if(arg.compare(0, 13, "--max-passes=") == 0)
+            limits.maxPasses = imax(1, imin(NUMPASSES, atoi(arg.c_str() + 13)));
+        else if(arg == "--perf")
+            perf = true;
+        else if(arg.compare(0, 12, "--force-isa=") == 0)
+            isa = argv[j] + 12;
+        else
+            fileArgs.push_back(argv[j]);
+    }
+    
+    bool longBlocks = (maxBlock != BP_MAX_BLOCK_SIZE);
+    if((beam && (sharedTable || widePasses)) || (budget && !beam) ||
+       (archive? (fileArgs.size() < 1 || aligned || jsonStats || streamSample || limits.Any() || widePasses || longBlocks ||
+                 longMatches) :
+                (fileArgs.size() < 1 || fileArgs.size() > 2 || (streamSample && !sharedTable) ||
+                 (widePasses && (sharedTable || aligned || jsonStats || limits.Any() || longBlocks || entropy || longMatches)) ||
+                 (aligned && (longBlocks || entropy || longMatches)))))
+    {
+        fprintf(stderr, "Usage: bpenc [-1..-9] [--shared [--stream[=MIB]]] [--crc] [--aligned | [--long-blocks[=MIB]] [--entropy] [--matches]] [--beam[=WIDTH] [--budget=SECONDS] [--threads=N]] [--no-uring] [--batch=N] [--max-depth=N] [--max-length=N] [--max-passes=N] [--stats=json [--stats-file=FILE]] [--perf] [--force-isa=ISA] INFILE [OUTFILE]\n");
+        fprintf(stderr, "       bpenc --wide[=PASSES] [--crc] [--no-uring] [--perf] [--force-isa=ISA] INFILE [OUTFILE]\n");
+        fprintf(stderr, "       bpenc --archive [-1..-9] [--shared | --beam[=WIDTH] [--budget=SECONDS]] [--crc] [--entropy] [--batch=N] [--threads=N] [--no-uring] [--perf] [--force-isa=ISA] OUTFILE [INFILE...]\n");
+        fprintf(stderr, "-1 is fastest, -9 (the default) searches exhaustively; --batch=N (1 to %d) overrides the level's batch\n", BP_MAX_BATCH);
+        fprintf(stderr, "--beam searches WIDTH (default %d, at most %d) tables at once for each new table, on N threads,\n"
+                        "       until SECONDS have passed, then finishes greedily\n", BP_BEAM_WIDTH, BP_MAX_BEAM);
+        fprintf(stderr, "--stream finds the shared table on a sample of at most MIB MiB (default %d) in a first pass\n", BP_STREAM_SAMPLE);
+        fprintf(stderr, "--max-* limit how deeply keys nest, how long one key's expansion is, and the passes per block\n");
+        fprintf(stderr, "--long-blocks lets blocks grow to MIB MiB (default %d, at most %d) where the data leaves bytes unused\n",
+            BP_LONG_BLOCK_SIZE >> 20, BP_LONG_MAX_BLOCK >> 20);
+        fprintf(stderr, "--matches replaces repeats of %d bytes or more, up to %d MiB back, with references\n",
+            BP_MATCH_MIN, BP_MATCH_WINDOW >> 20);
+        fprintf(stderr, "--entropy codes each block's data with a tANS coder where that makes it smaller\n");
+        fprintf(stderr, "--wide codes %d MiB blocks in symbols of 9 bits or more, with up to PASSES (default %d, at most %d) passes\n",
+            BP_WIDE_BLOCK_SIZE >> 20, BP_WIDE_PASSES, BP_WIDE_MAX_PASSES);
+        fprintf(stderr, "ISA is one of generic, sse4.2, avx2, avx512\n");
         exit(EXIT_FAILURE);
     }
     
-    const char * finname = argv[1];
+    if(batch)
+        effort.batch = batch;
+    effort.beam = beam;
+    if(budget)
+        effort.deadline = GetTimerSeconds() + budget;
+    
+    if(isa && !BP_SelectKernels(isa)) {
+        fprintf(stderr, "Unknown or unsupported ISA: %s\n", isa);
+        exit(EXIT_FAILURE);
+    }
+    if(perf) {
+        BP_PerfEnable();
+        fprintf(stderr, "Kernels: %s\n", bp_kernels.isa);
+    }
+    
+    if(archive)
+    {
+        const char * foutname = fileArgs[0];
+        std::vector<const char *> fnames(fileArgs.begin() + 1, fileArgs.end());
+        FILE * fout = fopen(foutname, "wb");
+        if(!fout) {
+            fprintf(stderr, "Could not open %s\n", foutname);
+            exit(EXIT_FAILURE);
+        }
+        
+        double startT = GetRealSeconds();
+        Stats stats;
+        bool writeOK = BP_EncodeArchive(fileno(fout), fnames, numWorkers, sharedTable, checksum, entropy, effort, useRing, stats);
+        double endT = GetRealSeconds();
+        
+        if(!writeOK)
+            fprintf(stderr, "Error writing %s\n", foutname);
+        fprintf(stderr, "Members: %d, uncompressed size: %d, number of blocks: %d\n",
+            (int)fnames.size(), (int)stats.inputSize, (int)stats.numBlocks);
+        fprintf(stderr, "Compressed size: %d, ratio %0.2f %%\n", (int)stats.outputSize, (float)stats.outputSize*100.0/stats.inputSize);
+        fprintf(stderr, "Average subs/block: %f\n", stats.avgSubs);
+        fprintf(stderr, "Pair tables reused: %d\n", (int)stats.tablesReused);
+        fprintf(stderr, "Compression Time: %f s\n", endT - startT);
+        fclose(fout);
+        BP_PerfReport(stderr);
+        BP_TRACE_WRITE("bpenc.trace.json");
+        return writeOK? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    const char * finname = fileArgs[0];
     const char * foutname = "<stdout>";
     
     FILE * fin = stdin, * fout = stdout;
     
-    // Just read in whole file at once. This isn't going to be used for anything big.
     fin = fopen(finname, "rb");
-    fseek(fin, 0L, SEEK_END);
-    size_t fileSize = ftell(fin);
-    fseek(fin, 0L, SEEK_SET);
-    
-    uint8_t * fileData = new uint8_t[fileSize];
-    fread(fileData, 1, fileSize, fin);
+    if(!fin) {
+        fprintf(stderr, "Could not open %s\n", finname);
+        exit(EXIT_FAILURE);
+    }
     
-    if(argc == 3) {
-        foutname = argv[2];
+    if(fileArgs.size() == 2) {
+        foutname = fileArgs[1];
         fout = fopen(foutname, "wb");
+        if(!fout) {
+            fprintf(stderr, "Could not open %s\n", foutname);
+            exit(EXIT_FAILURE);
+        }
     }
     
     
+    // Stats go to their own file, OUTFILE.stats.json unless named
+    FILE * statsFile = NULL;
+    if(jsonStats)
+    {
+        if(statsName.empty())
+            statsName = std::string((fileArgs.size() == 2)? foutname : "bpenc") + ".stats.json";
+        statsFile = fopen(statsName.c_str(), "w");
+        if(!statsFile) {
+            fprintf(stderr, "Could not open %s\n", statsName.c_str());
+            exit(EXIT_FAILURE);
+        }
+        fprintf(statsFile, "{\n  \"blocks\": [\n");
+    }
+    
     double startT = GetRealSeconds(), endT;
     
     Stats stats;
-    std::vector<Block *> blocks;
+    stats.logPasses = jsonStats;
+    stats.effort = effort;
+    stats.pool = (beam > 1 && numWorkers > 1)? new LoopPool(numWorkers - 1) : NULL;
+    stats.entropy = entropy;
+    stats.limits = limits;
+    stats.worstCost = DecodeCost();
+    stats.searchTime = stats.subsTime = stats.discardedTime = 0;
     
+    // First pass of --stream: find the table on a sample, then go back to the
+    // start of the input for the second
+    std::vector<PairCount> streamPairs;
+    bool readOK = true;
+    if(streamSample)
     {
-        const uint8_t * data = fileData;
-        const uint8_t * dataEnd = fileData + fileSize;
-        while(data < dataEnd)
-            blocks.push_back(new Block(data, dataEnd));
+        ChunkQueue sampleChunks(BP_PIPE_BACKLOG);
+        BlockQueue sampleBlocks(BP_PIPE_BACKLOG);
+        std::thread reader(ReadStage, fileno(fin), std::ref(sampleChunks), std::ref(stats), useRing, std::ref(readOK));
+        std::thread partitioner(longMatches? MatchStage : PartitionStage, std::ref(sampleChunks), std::ref(sampleBlocks), false, maxBlock);
+        std::vector<Block *> sample;
+        SampleStage(sampleBlocks, sample, std::max((size_t)1, (streamSample << 20)/maxBlock));
+        reader.join();
+        partitioner.join();
+        
+        BuildSharedTable(sample, streamPairs, stats.logPasses? &stats.tablePasses : NULL, stats.effort.sample,
+                         stats.limits.Any()? &stats.limits : NULL);
+        for(auto & blk : sample)
+            delete blk;
+        for(auto & rec : stats.tablePasses) {
+            rec.count = rec.numBlocks = 0;
+            rec.subsTime = 0;
+        }
+        
+        if(!readOK) {
+            fprintf(stderr, "Error reading %s\n", finname);
+            exit(EXIT_FAILURE);
+        }
+        if(lseek(fileno(fin), 0, SEEK_SET) != 0) {
+            fprintf(stderr, "--stream needs an input that can be read twice, %s can't\n", finname);
+            exit(EXIT_FAILURE);
+        }
     }
     
-    stats.inputSize = fileSize;
-    stats.numBlocks = blocks.size();
+    ChunkQueue inChunks(BP_PIPE_BACKLOG), outChunks(BP_PIPE_BACKLOG);
+    BlockQueue blocks(BP_PIPE_BACKLOG);
+    EncodedQueue encoded(BP_PIPE_BACKLOG);
     
-    BP_Encode1(fout, blocks, stats);
-    // BP_Encode2(fout, blocks, stats);
+    std::thread reader(ReadStage, fileno(fin), std::ref(inChunks), std::ref(stats), useRing, std::ref(readOK));
+    std::thread partitioner, encoder, serializer;
+    if(widePasses)
+    {
+        encoder = std::thread(WideStage, std::ref(inChunks), std::ref(outChunks), std::ref(stats), checksum, widePasses);
+    }
+    else
+    {
+        partitioner = std::thread(longMatches? MatchStage : PartitionStage, std::ref(inChunks), std::ref(blocks), checksum, maxBlock);
+        if(streamSample)
+            encoder = std::thread(BP_Encode2Fixed, std::ref(blocks), std::ref(encoded), std::ref(stats), std::cref(streamPairs));
+        else
+            encoder = std::thread(sharedTable? BP_Encode2 : BP_Encode1, std::ref(blocks), std::ref(encoded), std::ref(stats));
+        serializer = std::thread(aligned? ContainerStage : SerializeStage, std::ref(encoded), std::ref(outChunks), std::ref(stats), checksum, statsFile);
+    }
     
-    stats.outputSize = ftell(fout);
+    bool writeOK = WriteStage(fileno(fout), outChunks, useRing);
+    
+    reader.join();
+    encoder.join();
+    delete stats.pool;
+    if(!widePasses) {
+        partitioner.join();
+        serializer.join();
+    }
     
     endT = GetRealSeconds();
     
-    printf("Uncompressed size: %d, number of blocks: %d\n", (int)stats.inputSize, (int)stats.numBlocks);
-    printf("Compressed size: %d, ratio %0.2f %%\n", (int)stats.outputSize, (float)stats.outputSize*100.0/stats.inputSize);
-    printf("Average subs/block: %f\n", stats.avgSubs);
-    printf("Compression Time: %f s\n", endT - startT);
-    delete fileData;
+    if(!readOK)
+        fprintf(stderr, "Error reading %s\n", finname);
+    if(!writeOK)
+        fprintf(stderr, "Error writing %s\n", foutname);
+    fprintf(stderr, "Uncompressed size: %d, number of blocks: %d\n", (int)stats.inputSize, (int)stats.numBlocks);
+    fprintf(stderr, "Compressed size: %d, ratio %0.2f %%\n", (int)stats.outputSize, (float)stats.outputSize*100.0/stats.inputSize);
+    fprintf(stderr, "Average subs/block: %f\n", stats.avgSubs);
+    fprintf(stderr, "Pair tables reused: %d\n", (int)stats.tablesReused);
+    if(!widePasses)
+        fprintf(stderr, "Decode cost per block: up to %d passes, key depth %d, key expansion %lu bytes\n",
+            stats.worstCost.passes, stats.worstCost.depth, stats.worstCost.length);
+    fprintf(stderr, "Compression Time: %f s\n", endT - startT);
+    
+    if(statsFile)
+    {
+        if(sharedTable)
+        {
+            // Pass times were taken over all blocks at once
+            stats.searchTime = stats.subsTime = 0;
+            for(auto & rec : stats.tablePasses) {
+                stats.searchTime += rec.searchTime;
+                stats.subsTime += rec.subsTime;
+            }
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(statsFile, "\n  ],\n  \"sharedPasses\": [");
+        for(size_t j = 0; j < stats.tablePasses.size(); ++j)
+        {
+            // Each block it was applied to needs a key, and the table needs the pair
+            const PassRecord & rec = stats.tablePasses[j];
+            WritePassStats(statsFile, rec, (long)rec.count - (long)rec.numBlocks - 2, j == 0);
+        }
+        fprintf(statsFile, "\n  ],\n");
+        fprintf(statsFile, "  \"input\": ");
+        WriteJSONString(statsFile, finname);
+        fprintf(statsFile, ",\n  \"mode\": \"%s\",\n  \"aligned\": %s,\n  \"numPasses\": %d,\n",
+            streamSample? "shared stream" : sharedTable? "shared" : "independent", aligned? "true" : "false", NUMPASSES);
+        fprintf(statsFile, "  \"inputSize\": %lu,\n  \"outputSize\": %lu,\n  \"numBlocks\": %lu,\n  \"tablesReused\": %lu,\n",
+            stats.inputSize, stats.outputSize, stats.numBlocks, stats.tablesReused);
+        fprintf(statsFile, "  \"searchTime\": %.9f,\n  \"subsTime\": %.9f,\n  \"discardedTime\": %.9f,\n",
+            stats.searchTime, stats.subsTime, stats.discardedTime);
+        fprintf(statsFile, "  \"worstDecode\": {\"passes\": %d, \"depth\": %d, \"length\": %lu, \"passBytes\": %lu},\n",
+            stats.worstCost.passes, stats.worstCost.depth, stats.worstCost.length, stats.worstCost.passBytes);
+        fprintf(statsFile, "  \"compressionTime\": %.9f,\n  \"peakRSS\": %lu\n}\n", endT - startT, (size_t)usage.ru_maxrss*1024);
+        fclose(statsFile);
+    }
     
     if(fin != stdout)
         fclose(fin);
     if(fout != stdout)
         fclose(fout);
     
-    return EXIT_SUCCESS;
+    BP_PerfReport(stderr);
+    BP_TRACE_WRITE("bpenc.trace.json");
+    return (readOK && writeOK)? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-
@@ -0,0 +1,366 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPFSE_H
+#define BPFSE_H
+
+// Table-driven asymmetric numeral system (tANS) coder for block data, in the
+// style of FSE. Each byte value gets a share of a 2^tableLog state table in
+// proportion to its count; a symbol costs the bits needed to move between
+// states, so frequent bytes take less than a bit more than their entropy.
+//
+// The coded form is:
+// (TABLE_LOG:1)(PRESENT:32)(COUNTS)(STREAM)
+// PRESENT has bit (j & 7) of byte (j >> 3) set for each byte value j in the
+// data. COUNTS holds the normalized count less one of each present value, in
+// order, as flexints. STREAM is the bit stream, written LSB first and read
+// back from its end: the symbol bits, last symbol first, then the final state
+// of each of the BP_FSE_STATES interleaved coders, then a 1 bit marking the
+// end. Symbol j is coded by state j % BP_FSE_STATES; the independent states
+// let the decoder work on several symbols at once.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "misc/flexints.h"
+
+#define BP_FSE_TABLE_LOG  (11)
+#define BP_FSE_MIN_LOG    (5)
+#define BP_FSE_MAX_LOG    (12)
+#define BP_FSE_STATES     (4)
+
+// Header bytes before the counts
+#define BP_FSE_HEADER  (33)
+
+struct FSEDecodeEntry {
+    uint16_t newState;
+    uint8_t symbol;
+    uint8_t nbBits;
+};
+
+struct FSEDecodeTable {
+    int tableLog;
+    FSEDecodeEntry entries[1 << BP_FSE_MAX_LOG];
+};
+
+static inline int BP_FSE_HighBit(uint32_t val) {
+    return 31 - __builtin_clz(val);
+}
+
+// Order in which states are handed out to symbols. The step is odd, so it
+// visits every state, and spreads each symbol's states over the table.
+static inline void BP_FSE_Spread(const uint16_t * norm, int tableLog, uint8_t * spread)
+{
+    uint32_t tableSize = 1 << tableLog, mask = tableSize - 1;
+    uint32_t step = (tableSize >> 1) + (tableSize >> 3) + 3, pos = 0;
+    for(int sym = 0; sym < 256; ++sym)
+        for(int j = 0; j < norm[sym]; ++j) {
+            spread[pos] = sym;
+            pos = (pos + step) & mask;
+        }
+}
+
+// Scale counts of n bytes to sum to 2^tableLog, keeping every present byte
+// value at 1 or more.
+static inline void BP_FSE_Normalize(const uint32_t * counts, size_t n, int tableLog, uint16_t * norm)
+{
+    uint32_t tableSize = 1 << tableLog, total = 0;
+    int largest = 0;
+    for(int sym = 0; sym < 256; ++sym)
+    {
+        norm[sym] = 0;
+        if(!counts[sym])
+            continue;
+        uint64_t scaled = ((uint64_t)counts[sym]*tableSize + n/2)/n;
+        norm[sym] = scaled? scaled : 1;
+        total += norm[sym];
+        if(counts[sym] > counts[largest])
+            largest = sym;
+    }
+    
+    // Rounding error is taken up by the most common values
+    if(total < tableSize) {
+        norm[largest] += tableSize - total;
+        total = tableSize;
+    }
+    while(total > tableSize)
+    {
+        int sym = 0;
+        for(int j = 1; j < 256; ++j)
+            if(norm[j] > norm[sym])
+                sym = j;
+        uint32_t take = std::min<uint32_t>(total - tableSize, norm[sym] - 1);
+        norm[sym] -= take;
+        total -= take;
+    }
+}
+
+// Code n bytes from src, appending the coded form to out. Returns false,
+// leaving out as it was, if the coded form is not smaller than the data.
+static inline bool BP_EncodeFSE(const uint8_t * src, size_t n, std::vector<uint8_t> & out)
+{
+    if(n == 0)
+        return false;
+    const int tableLog = BP_FSE_TABLE_LOG;
+    const uint32_t tableSize = 1 << tableLog;
+    
+    uint32_t counts[256] = {0};
+    for(size_t j = 0; j < n; ++j)
+        ++counts[src[j]];
+    uint16_t norm[256];
+    BP_FSE_Normalize(counts, n, tableLog, norm);
+    
+    size_t start = out.size();
+    out.push_back(tableLog);
+    out.resize(out.size() + 32, 0);
+    for(int sym = 0; sym < 256; ++sym)
+        if(norm[sym]) {
+            uint8_t bfr[10];
+            out[start + 1 + (sym >> 3)] |= 1 << (sym & 7);
+            out.insert(out.end(), bfr, bfr + BP_EncodeFlexInt(norm[sym] - 1, bfr));
+        }
+    
+    // Estimate the coded size before building anything, and give up early
+    // on data that will not shrink
+    double bits = 0;
+    for(int sym = 0; sym < 256; ++sym)
+        if(counts[sym])
+            bits += counts[sym]*(tableLog - log2((double)norm[sym]));
+    if(out.size() - start + bits/8 >= n) {
+        out.resize(start);
+        return false;
+    }
+    
+    // State of the coder after each symbol's bits are written, and what
+    // decides how many bits a symbol takes from the state
+    std::vector<uint8_t> spread(tableSize);
+    std::vector<uint16_t> stateTable(tableSize);
+    BP_FSE_Spread(norm, tableLog, &spread[0]);
+    uint32_t cumul[257];
+    cumul[0] = 0;
+    for(int sym = 0; sym < 256; ++sym)
+        cumul[sym + 1] = cumul[sym] + norm[sym];
+    uint32_t next[256];
+    memcpy(next, cumul, sizeof(next));
+    for(uint32_t u = 0; u < tableSize; ++u)
+        stateTable[next[spread[u]]++] = tableSize + u;
+    
+    int32_t deltaNbBits[256], deltaFindState[256];
+    for(int sym = 0; sym < 256; ++sym)
+    {
+        if(!norm[sym])
+            continue;
+        uint32_t maxBitsOut = (norm[sym] == 1)? tableLog : tableLog - BP_FSE_HighBit(norm[sym] - 1);
+        deltaNbBits[sym] = (maxBitsOut << 16) - (norm[sym] << maxBitsOut);
+        deltaFindState[sym] = (int32_t)cumul[sym] - norm[sym];
+    }
+    
+    size_t streamPos = out.size();
+    out.resize(streamPos + n*tableLog/8 + 64);
+    uint8_t * dst = &out[streamPos];
+    uint64_t acc = 0;
+    int accBits = 0;
+    uint32_t state[BP_FSE_STATES];
+    for(int s = 0; s < BP_FSE_STATES; ++s)
+        state[s] = tableSize;
+    
+    for(size_t j = n; j-- > 0;)
+    {
+        uint32_t & x = state[j % BP_FSE_STATES];
+        int sym = src[j];
+        uint32_t nbBits = (x + deltaNbBits[sym]) >> 16;
+        acc |= (uint64_t)(x & ((1 << nbBits) - 1)) << accBits;
+        accBits += nbBits;
+        x = stateTable[(x >> nbBits) + deltaFindState[sym]];
+        if(accBits >= 32) {
+            memcpy(dst, &acc, 4);// little-endian hosts only
+            dst += 4;
+            acc >>= 32;
+            accBits -= 32;
+        }
+    }
+    for(int s = 0; s < BP_FSE_STATES; ++s) {
+        acc |= (uint64_t)(state[s] - tableSize) << accBits;
+        accBits += tableLog;
+        while(accBits >= 8) {
+            *dst++ = acc & 0xFF;
+            acc >>= 8;
+            accBits -= 8;
+        }
+    }
+    acc |= (uint64_t)1 << accBits;
+    ++accBits;
+    while(accBits > 0) {
+        *dst++ = acc & 0xFF;
+        acc >>= 8;
+        accBits -= 8;
+    }
+    
+    size_t codedSize = dst - &out[start];
+    if(codedSize >= n) {
+        out.resize(start);
+        return false;
+    }
+    out.resize(start + codedSize);
+    return true;
+}
+
+// Read the header of coded data into tbl. Returns the header length, or 0 if
+// it is malformed.
+static inline size_t BP_FSE_ReadHeader(const uint8_t * src, size_t size, FSEDecodeTable & tbl)
+{
+    if(size < BP_FSE_HEADER)
+        return 0;
+    int tableLog = src[0];
+    if(tableLog < BP_FSE_MIN_LOG || tableLog > BP_FSE_MAX_LOG)
+        return 0;
+    uint32_t tableSize = 1 << tableLog, total = 0;
+    
+    uint16_t norm[256];
+    size_t len = BP_FSE_HEADER;
+    for(int sym = 0; sym < 256; ++sym)
+    {
+        norm[sym] = 0;
+        if(!(src[1 + (sym >> 3)] & (1 << (sym & 7))))
+            continue;
+        // Counts are at most 2^BP_FSE_MAX_LOG, two flexint bytes
+        if(len == size || ((src[len] & 0x80) && (len + 1 == size || (src[len + 1] & 0x80))))
+            return 0;
+        size_t count;
+        len += BP_DecodeFlexInt(&count, const_cast<uint8_t *>(src + len));
+        if(count >= tableSize - total)
+            return 0;
+        norm[sym] = count + 1;
+        total += norm[sym];
+    }
+    if(total != tableSize)
+        return 0;
+    
+    uint8_t spread[1 << BP_FSE_MAX_LOG];
+    BP_FSE_Spread(norm, tableLog, spread);
+    tbl.tableLog = tableLog;
+    for(uint32_t u = 0; u < tableSize; ++u)
+    {
+        int sym = spread[u];
+        uint32_t x = norm[sym]++;
+        FSEDecodeEntry & entry = tbl.entries[u];
+        entry.symbol = sym;
+        entry.nbBits = tableLog - BP_FSE_HighBit(x);
+        entry.newState = (x << entry.nbBits) - tableSize;
+    }
+    return len;
+}
+
+// Decode n bytes from coded data of size bytes into dst. Returns false if the
+// data is malformed or does not decode to exactly n bytes.
+static inline bool BP_DecodeFSE(const uint8_t * src, size_t size, uint8_t * dst, size_t n, FSEDecodeTable & tbl)
+{
+    size_t hdrSize = BP_FSE_ReadHeader(src, size, tbl);
+    if(!hdrSize || hdrSize == size || src[size - 1] == 0)
+        return false;
+    src += hdrSize;
+    size -= hdrSize;
+    
+    // Short streams are copied out so every read can take a whole word
+    uint8_t pad[8] = {0};
+    if(size < 8) {
+        memcpy(pad, src, size);
+        src = pad;
+    }
+    size_t wordLimit = ((size < 8)? 8 : size) - 8;
+    size_t pos = 8*(size - 1) + BP_FSE_HighBit(src[size - 1]);
+    
+    // Reads nbBits ending at pos. The word is taken from the byte holding
+    // pos where it can be, else from the last whole word of the stream.
+    auto read = [&](int nbBits) -> uint32_t {
+        pos -= nbBits;
+        size_t at = std::min(pos >> 3, wordLimit);
+        uint64_t word;
+        memcpy(&word, src + at, 8);
+        return (word >> (pos - 8*at)) & ((1u << nbBits) - 1);
+    };
+    
+    const int tableLog = tbl.tableLog;
+    const FSEDecodeEntry * entries = tbl.entries;
+    if(pos < (size_t)BP_FSE_STATES*tableLog)
+        return false;
+    uint32_t state[BP_FSE_STATES];
+    for(int s = BP_FSE_STATES; s-- > 0;)
+        state[s] = read(tableLog);
+    
+    // Every symbol takes at most tableLog bits, so runs of symbols that
+    // cannot reach the start of the stream skip the bounds check
+    size_t j = 0;
+    while(j + BP_FSE_STATES <= n)
+    {
+        if(pos < (size_t)BP_FSE_STATES*tableLog) {
+            for(int s = 0; s < BP_FSE_STATES; ++s) {
+                const FSEDecodeEntry & entry = entries[state[s]];
+                if(entry.nbBits > pos)
+                    return false;
+                dst[j + s] = entry.symbol;
+                state[s] = entry.newState + read(entry.nbBits);
+            }
+        }
+        else {
+            // One word holds the bits of all the states' symbols
+            size_t at = std::min((pos - BP_FSE_STATES*tableLog) >> 3, wordLimit);
+            uint64_t word;
+            memcpy(&word, src + at, 8);
+            for(int s = 0; s < BP_FSE_STATES; ++s) {
+                const FSEDecodeEntry & entry = entries[state[s]];
+                dst[j + s] = entry.symbol;
+                pos -= entry.nbBits;
+                state[s] = entry.newState + ((word >> (pos - 8*at)) & ((1u << entry.nbBits) - 1));
+            }
+        }
+        j += BP_FSE_STATES;
+    }
+    for(int s = 0; j < n; ++s, ++j) {
+        const FSEDecodeEntry & entry = entries[state[s]];
+        if(entry.nbBits > pos)
+            return false;
+        dst[j] = entry.symbol;
+        state[s] = entry.newState + read(entry.nbBits);
+    }
+    
+    // The encoder started every state at zero, and used every bit
+    if(pos != 0)
+        return false;
+    for(int s = 0; s < BP_FSE_STATES; ++s)
+        if(state[s] != 0)
+            return false;
+    return true;
+}
+
+#endif // BPFSE_H
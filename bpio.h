@@ -0,0 +1,484 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPIO_H
+#define BPIO_H
+
+// Sequential file I/O with several requests in flight, on io_uring where the
+// kernel allows it and plain blocking read()/write() otherwise. Only regular
+// files go through the ring: pipes and terminals have no offsets to queue
+// requests against, and gain nothing from it.
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#define BP_HAVE_IO_URING  (1)
+#endif
+
+static inline bool IsRegularFile(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Minimal io_uring wrapper using the raw system calls, so there is no
+// dependency on liburing.
+class IoRing {
+  public:
+    IoRing(): ringFd(-1), toSubmit(0) {}
+    ~IoRing() {Close();}
+    
+    // Returns false if io_uring is unavailable (old kernel, seccomp, ...)
+    bool Init(unsigned entries)
+    {
+#ifdef BP_HAVE_IO_URING
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = syscall(__NR_io_uring_setup, entries, &p);
+        if(ringFd < 0)
+            return false;
+        
+        sqRingSize = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+        cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+        sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+        
+        sqRing = (uint8_t *)mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = (uint8_t *)mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe *)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || (void *)sqes == MAP_FAILED) {
+            Close();
+            return false;
+        }
+        
+        sqHead = (uint32_t *)(sqRing + p.sq_off.head);
+        sqTail = (uint32_t *)(sqRing + p.sq_off.tail);
+        sqMask = *(uint32_t *)(sqRing + p.sq_off.ring_mask);
+        sqArray = (uint32_t *)(sqRing + p.sq_off.array);
+        sqEntries = p.sq_entries;
+        cqHead = (uint32_t *)(cqRing + p.cq_off.head);
+        cqTail = (uint32_t *)(cqRing + p.cq_off.tail);
+        cqMask = *(uint32_t *)(cqRing + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cqRing + p.cq_off.cqes);
+        return true;
+#else
+        (void)entries;
+        return false;
+#endif // BP_HAVE_IO_URING
+    }
+    
+    void Close()
+    {
+#ifdef BP_HAVE_IO_URING
+        if(ringFd < 0)
+            return;
+        if(sqRing && sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if(cqRing && cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+        if(sqes && (void *)sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        close(ringFd);
+        ringFd = -1;
+#endif // BP_HAVE_IO_URING
+    }
+    
+#ifdef BP_HAVE_IO_URING
+    bool QueueRead(int fd, void * bfr, size_t len, uint64_t offset, uint64_t userData) {
+        return Queue(IORING_OP_READ, fd, bfr, len, offset, userData);
+    }
+    bool QueueWrite(int fd, const void * bfr, size_t len, uint64_t offset, uint64_t userData) {
+        return Queue(IORING_OP_WRITE, fd, bfr, len, offset, userData);
+    }
+    bool QueueWritev(int fd, const struct iovec * iov, unsigned numIov, uint64_t offset, uint64_t userData) {
+        return Queue(IORING_OP_WRITEV, fd, iov, numIov, offset, userData);
+    }
+    
+    // Submit everything queued, and wait for and return one completion
+    bool Wait(uint64_t & userData, int & result)
+    {
+        while(true)
+        {
+            uint32_t head = *cqHead;
+            if(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe * cqe = &cqes[head & cqMask];
+                userData = cqe->user_data;
+                result = cqe->res;
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            int r = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if(r < 0 && errno != EINTR)
+                return false;
+            if(r > 0)
+                toSubmit -= imin(r, toSubmit);
+        }
+    }
+    
+  private:
+    static inline unsigned imin(unsigned x, unsigned y) {return (x < y)? x : y;}
+    
+    bool Queue(int op, int fd, const void * addr, size_t len, uint64_t offset, uint64_t userData)
+    {
+        uint32_t tail = *sqTail;
+        if(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            return false;
+        uint32_t idx = tail & sqMask;
+        struct io_uring_sqe * sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)addr;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = userData;
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++toSubmit;
+        return true;
+    }
+    
+    uint8_t * sqRing, * cqRing;
+    struct io_uring_sqe * sqes;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    uint32_t * sqHead, * sqTail, * sqArray, sqMask, sqEntries;
+    uint32_t * cqHead, * cqTail, cqMask;
+    struct io_uring_cqe * cqes;
+#endif // BP_HAVE_IO_URING
+    
+    int ringFd;
+    unsigned toSubmit;
+};
+
+
+// Reads a file front to back in fixed-size chunks, keeping up to depth reads
+// in flight. Chunks are returned in file order.
+class ChunkReader {
+  public:
+    ChunkReader(int _fd, size_t _chunkSize, int _depth, bool useRing):
+        fd(_fd), chunkSize(_chunkSize), depth(_depth), ringOK(false), failed(false),
+        nextRead(0), nextDeliver(0), inFlight(0)
+    {
+        if(useRing && IsRegularFile(fd) && ring.Init(depth))
+        {
+            ringOK = true;
+            slots.resize(depth);
+            for(int j = 0; j < depth; ++j)
+                slots[j].data.resize(chunkSize);
+            for(int j = 0; j < depth; ++j)
+                Submit(j);
+        }
+    }
+    
+    // The kernel may still be filling buffers, don't free them under it
+    ~ChunkReader()
+    {
+#ifdef BP_HAVE_IO_URING
+        uint64_t idx;
+        int res;
+        while(ringOK && inFlight && ring.Wait(idx, res))
+            --inFlight;
+#endif // BP_HAVE_IO_URING
+    }
+    
+    bool UsingRing() const {return ringOK;}
+    bool Failed() const {return failed;}
+    
+    // Fill chunk with the next data, returns false at end of file or on error.
+    // Failed() tells the two apart.
+    bool Next(std::vector<uint8_t> & chunk)
+    {
+        if(failed)
+            return false;
+        if(!ringOK)
+        {
+            chunk.resize(chunkSize);
+            ssize_t n;
+            do {
+                n = read(fd, &chunk[0], chunkSize);
+            } while(n < 0 && errno == EINTR);
+            if(n < 0)
+                failed = true;
+            if(n <= 0)
+                return false;
+            chunk.resize(n);
+            return true;
+        }
+        
+#ifdef BP_HAVE_IO_URING
+        // Chunks complete out of order, wait until the next one in file order
+        // is done.
+        Slot & want = slots[nextDeliver % depth];
+        while(!want.done)
+        {
+            uint64_t idx;
+            int res;
+            if(!ring.Wait(idx, res)) {
+                failed = true;
+                inFlight = 0;
+                return false;
+            }
+            Slot & slot = slots[idx];
+            --inFlight;
+            if(res < 0) {
+                failed = true;
+                return false;
+            }
+            slot.filled += res;
+            if(res > 0 && slot.filled < chunkSize) {
+                // Short read, get the rest of the chunk
+                ring.QueueRead(fd, &slot.data[slot.filled], chunkSize - slot.filled, slot.offset + slot.filled, idx);
+                ++inFlight;
+                continue;
+            }
+            slot.done = true;
+        }
+        if(want.filled == 0)
+            return false;
+        
+        chunk.assign(want.data.begin(), want.data.begin() + want.filled);
+        ++nextDeliver;
+        Submit((nextDeliver - 1) % depth);
+        return true;
+#else
+        return false;
+#endif // BP_HAVE_IO_URING
+    }
+    
+  private:
+    struct Slot {
+        std::vector<uint8_t> data;
+        uint64_t offset;
+        size_t filled;
+        bool done;
+    };
+    
+    void Submit(int idx)
+    {
+#ifdef BP_HAVE_IO_URING
+        Slot & slot = slots[idx];
+        slot.offset = nextRead;
+        slot.filled = 0;
+        slot.done = false;
+        ring.QueueRead(fd, &slot.data[0], chunkSize, nextRead, idx);
+        nextRead += chunkSize;
+        ++inFlight;
+#else
+        (void)idx;
+#endif // BP_HAVE_IO_URING
+    }
+    
+    int fd;
+    size_t chunkSize;
+    int depth;
+    bool ringOK;
+    bool failed;
+    std::vector<Slot> slots;
+    IoRing ring;// after slots, so it is torn down before the buffers it reads into
+    uint64_t nextRead;
+    uint64_t nextDeliver;
+    int inFlight;
+};
+
+
+// Writes buffers to the end of a file in the order given, keeping up to depth
+// writes in flight. Each call is a single gathered write of all the buffers it
+// is given. Write() and WriteGather() take the buffers' contents and leave
+// them empty.
+class ChunkWriter {
+  public:
+    ChunkWriter(int _fd, int _depth, bool useRing):
+        fd(_fd), depth(_depth), ringOK(false), inFlight(0), failed(false), offset(0)
+    {
+        if(useRing && IsRegularFile(fd) && ring.Init(depth))
+        {
+            ringOK = true;
+            offset = lseek(fd, 0, SEEK_CUR);
+            slots.resize(depth);
+            for(int j = 0; j < depth; ++j)
+                freeSlots.push_back(j);
+        }
+    }
+    
+    ~ChunkWriter() {Flush();}
+    
+    bool UsingRing() const {return ringOK;}
+    bool Failed() const {return failed;}
+    
+    void Write(std::vector<uint8_t> & bfr)
+    {
+        std::vector<std::vector<uint8_t> > bfrs(1);
+        bfrs[0].swap(bfr);
+        WriteGather(bfrs);
+    }
+    
+    void WriteGather(std::vector<std::vector<uint8_t> > & bfrs)
+    {
+        Slot tmp, * slot = &tmp;
+        int idx = 0;
+#ifdef BP_HAVE_IO_URING
+        if(ringOK)
+        {
+            while(freeSlots.empty() && !failed)
+                Reap();
+            if(failed)
+                return;
+            idx = freeSlots.back();
+            freeSlots.pop_back();
+            slot = &slots[idx];
+        }
+#endif // BP_HAVE_IO_URING
+        
+        slot->bfrs.clear();
+        slot->size = 0;
+        for(auto & b : bfrs) {
+            if(b.empty())
+                continue;
+            slot->size += b.size();
+            slot->bfrs.push_back(std::vector<uint8_t>());
+            slot->bfrs.back().swap(b);
+        }
+        bfrs.clear();
+        slot->offset = offset;
+        slot->written = 0;
+        offset += slot->size;
+        
+        if(!ringOK) {
+            while(slot->written < slot->size && !failed)
+            {
+                BuildIov(*slot);
+                ssize_t n = writev(fd, &slot->iov[0], imin(slot->iov.size(), IOV_MAX));
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n <= 0)
+                    failed = true;
+                else
+                    slot->written += n;
+            }
+            return;
+        }
+        
+#ifdef BP_HAVE_IO_URING
+        if(slot->size == 0) {
+            freeSlots.push_back(idx);
+            return;
+        }
+        BuildIov(*slot);
+        ring.QueueWritev(fd, &slot->iov[0], imin(slot->iov.size(), IOV_MAX), slot->offset, idx);
+        ++inFlight;
+#endif // BP_HAVE_IO_URING
+    }
+    
+    // Wait for all outstanding writes, even after one has failed, as the
+    // kernel may still be reading the others' buffers
+    void Flush()
+    {
+        while(ringOK && inFlight)
+            Reap();
+    }
+    
+  private:
+    struct Slot {
+        std::vector<std::vector<uint8_t> > bfrs;
+        std::vector<struct iovec> iov;
+        uint64_t offset;
+        size_t size;
+        size_t written;
+    };
+    
+    static inline size_t imin(size_t x, size_t y) {return (x < y)? x : y;}
+    
+    // Point iov at whatever part of the slot's buffers is not yet written
+    static void BuildIov(Slot & slot)
+    {
+        slot.iov.clear();
+        size_t skip = slot.written;
+        for(auto & b : slot.bfrs)
+        {
+            if(skip >= b.size()) {
+                skip -= b.size();
+                continue;
+            }
+            struct iovec v;
+            v.iov_base = &b[skip];
+            v.iov_len = b.size() - skip;
+            slot.iov.push_back(v);
+            skip = 0;
+        }
+    }
+    
+    void Reap()
+    {
+#ifdef BP_HAVE_IO_URING
+        uint64_t idx;
+        int res;
+        if(!ring.Wait(idx, res)) {
+            // Nothing more can be reaped
+            failed = true;
+            inFlight = 0;
+            return;
+        }
+        if(res <= 0) {
+            failed = true;
+            --inFlight;
+            return;
+        }
+        Slot & slot = slots[idx];
+        slot.written += res;
+        if(slot.written < slot.size) {
+            // Short write, queue the remainder
+            BuildIov(slot);
+            ring.QueueWritev(fd, &slot.iov[0], imin(slot.iov.size(), IOV_MAX), slot.offset + slot.written, idx);
+            return;
+        }
+        --inFlight;
+        freeSlots.push_back(idx);
+#endif // BP_HAVE_IO_URING
+    }
+    
+    int fd;
+    int depth;
+    bool ringOK;
+    std::vector<Slot> slots;
+    std::vector<int> freeSlots;
+    IoRing ring;// after slots, so it is torn down before the buffers it writes
+    int inFlight;
+    bool failed;
+    uint64_t offset;
+};
+
+#endif // BPIO_H
@@ -0,0 +1,1040 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPKERNELS_H
+#define BPKERNELS_H
+
+// Inner loops of encoding and decoding, with a version for each instruction
+// set level, and the table that binds them. The binaries are built for
+// baseline x86-64; the wider versions are compiled with target attributes and
+// picked at startup by what the CPU supports, the way BP_CRC32C() picks its
+// kernel. BP_SelectKernels() overrides the choice, so every version can be
+// tested and timed on one machine.
+//
+// Every version of a kernel gives the same result for the same input.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bpcrc.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BP_HAVE_X86_KERNELS  (1)
+#endif
+
+// Bytes kept readable past the last entry of ExpandTable::bytes, so expansion
+// can always load a full vector
+#define BP_EXPAND_SLACK  (64)
+
+// Full expansion of every byte value for one block: keys map to the bytes they
+// finally decode to, everything else maps to itself. Built by applying the
+// passes in encoding order, so each key's pair is expanded with the passes
+// that preceded it.
+struct ExpandTable {
+    uint32_t len[256];
+    uint32_t offset[256];
+    std::vector<uint8_t> bytes;
+};
+
+// Expansion of every symbol of a wide block, the counterpart of ExpandTable
+// for 16-bit symbols: 0-255 are bytes, 256 + i is the key of pass i.
+// symbols holds the current run of unpacked symbols.
+struct WideExpandTable {
+    std::vector<uint32_t> len, offset;
+    std::vector<uint8_t> bytes;
+    std::vector<uint16_t> symbols;
+};
+
+// Pairs are counted in BP_PAIR_LANES interleaved histograms of 65536 counts,
+// indexed by (first << 8) | second, with successive pairs going to successive
+// histograms. Repeated pairs then land in different tables instead of waiting
+// on the store of the previous increment. The histograms start out zeroed and
+// are zeroed again as they are merged, so they can be kept for the next count.
+//
+// The 16-bit versions are for a single block: with blocks capped at
+// BP_MAX_BLOCK_SIZE no count can overflow, and each histogram is 128 KB.
+// The wide versions take any number of blocks.
+#define BP_PAIR_LANES  (4)
+
+// Add the pairs in data to the lane histograms
+typedef void (*BP_CountPairsFunc)(uint16_t * lanes, const uint8_t * data, size_t size);
+typedef void (*BP_CountPairsWideFunc)(uint32_t * lanes, const uint8_t * data, size_t size);
+// Merge and zero the lane histograms. Returns the index of the most frequent
+// pair, the lowest index on a tie, and its count.
+typedef int (*BP_BestPairFunc)(uint16_t * lanes, uint32_t & count);
+typedef int (*BP_BestPairWideFunc)(uint32_t * lanes, uint32_t & count);
+// Copy src to dst, replacing each occurrence of the pair with key, scanning
+// from the front. Returns the new size. dst must not overlap src.
+typedef size_t (*BP_SubstituteFunc)(uint8_t * dst, const uint8_t * src, size_t size,
+                                    uint8_t first, uint8_t second, uint8_t key);
+// Copy src to dst, replacing n pairs with their keys in one scan. The result
+// is the same as substituting them one after another only if no byte value
+// is in two of the pairs, or is both in a pair and a key; the caller checks.
+// counts[i] receives the number of replacements of pair i.
+#define BP_MAX_BATCH  (8)
+typedef size_t (*BP_SubstituteManyFunc)(uint8_t * dst, const uint8_t * src, size_t size,
+                                        const uint8_t * pairs, const uint8_t * keys, int n, size_t * counts);
+// Add the occurrences in data of each of n pairs, counted the way the
+// histograms count them, to counts. Used to confirm the candidates from a
+// sampled count.
+#define BP_MAX_CANDIDATES  (16)
+typedef void (*BP_CountPairsOfFunc)(const uint8_t * data, size_t size, const uint8_t * pairs, int n, uint32_t * counts);
+// Expand n bytes of src through tbl into exactly dstSize bytes at dst
+typedef void (*BP_ExpandFunc)(uint8_t * dst, size_t dstSize, const ExpandTable & tbl,
+                              const uint8_t * src, size_t n);
+// Unpack n symbols of width bits each, packed LSB first from the start of
+// src, into dst. avail is the number of bytes readable at src, which can be
+// more than the symbols take; vector loads stay within it.
+typedef void (*BP_UnpackSymbolsFunc)(uint16_t * dst, const uint8_t * src, size_t avail, size_t n, int width);
+// Expand n symbols of src through tbl into exactly dstSize bytes at dst
+typedef void (*BP_ExpandWideFunc)(uint8_t * dst, size_t dstSize, const WideExpandTable & tbl,
+                                  const uint16_t * src, size_t n);
+
+struct Kernels {
+    const char * isa;
+    BP_CountPairsFunc countPairs;
+    BP_BestPairFunc bestPair;
+    BP_CountPairsWideFunc countPairsWide;
+    BP_BestPairWideFunc bestPairWide;
+    BP_SubstituteFunc substitute;
+    BP_SubstituteManyFunc substituteMany;
+    BP_CountPairsOfFunc countPairsOf;
+    BP_ExpandFunc expand;
+    BP_UnpackSymbolsFunc unpackSymbols;
+    BP_ExpandWideFunc expandWide;
+    BP_CRCFunc crc;
+};
+
+// *****************************************************************************
+// Portable versions
+
+// Without vectors to merge the lanes, folding them costs more than it saves,
+// so the portable versions use only the first. The others stay zeroed.
+template<typename T>
+static inline void BP_CountPairsOneLane(T * lanes, const uint8_t * data, size_t size)
+{
+    for(size_t j = 0; j + 1 < size; ++j)
+        ++lanes[(data[j] << 8) | data[j + 1]];
+}
+
+template<typename T>
+static inline int BP_BestPairOneLane(T * lanes, uint32_t & count)
+{
+    int bestIdx = 0;
+    uint32_t bestCount = 0;
+    for(int j = 0; j < 65536; ++j)
+    {
+        if(lanes[j] > bestCount) {
+            bestIdx = j;
+            bestCount = lanes[j];
+        }
+        lanes[j] = 0;
+    }
+    count = bestCount;
+    return bestIdx;
+}
+
+static void BP_CountPairs_Generic(uint16_t * lanes, const uint8_t * data, size_t size) {
+    BP_CountPairsOneLane(lanes, data, size);
+}
+
+static void BP_CountPairsWide_Generic(uint32_t * lanes, const uint8_t * data, size_t size) {
+    BP_CountPairsOneLane(lanes, data, size);
+}
+
+static int BP_BestPair_Generic(uint16_t * lanes, uint32_t & count) {
+    return BP_BestPairOneLane(lanes, count);
+}
+
+static int BP_BestPairWide_Generic(uint32_t * lanes, uint32_t & count) {
+    return BP_BestPairOneLane(lanes, count);
+}
+
+static size_t BP_Substitute_Generic(uint8_t * dst, const uint8_t * src, size_t size,
+                                    uint8_t first, uint8_t second, uint8_t key)
+{
+    size_t in = 0, out = 0;
+    while(in < size)
+    {
+        if(in + 1 < size && src[in] == first && src[in + 1] == second) {
+            dst[out++] = key;
+            in += 2;
+        }
+        else {
+            dst[out++] = src[in++];
+        }
+    }
+    return out;
+}
+
+static size_t BP_SubstituteMany_Generic(uint8_t * dst, const uint8_t * src, size_t size,
+                                        const uint8_t * pairs, const uint8_t * keys, int n, size_t * counts)
+{
+    // Pair starting with each byte value, or -1
+    int pairOf[256];
+    for(int j = 0; j < 256; ++j)
+        pairOf[j] = -1;
+    for(int i = 0; i < n; ++i) {
+        pairOf[pairs[2*i]] = i;
+        counts[i] = 0;
+    }
+    
+    size_t in = 0, out = 0;
+    while(in < size)
+    {
+        int i = pairOf[src[in]];
+        if(i >= 0 && in + 1 < size && src[in + 1] == pairs[2*i + 1]) {
+            dst[out++] = keys[i];
+            ++counts[i];
+            in += 2;
+        }
+        else {
+            dst[out++] = src[in++];
+        }
+    }
+    return out;
+}
+
+// The k most frequent pairs in the lane histograms, most frequent first and
+// the lowest index first on a tie, and zero the lanes. Lanes are summed a
+// chunk at a time, in loops the compiler vectorizes, and a chunk is only
+// searched if it has a count above the current k-th best.
+template<typename T>
+static inline void BP_TopPairs(T * lanes, int * idx, uint32_t * counts, int k)
+{
+    for(int t = 0; t < k; ++t) {
+        idx[t] = t;
+        counts[t] = 0;
+    }
+    
+    const int chunk = 64;
+    T sum[chunk];
+    for(int base = 0; base < 65536; base += chunk)
+    {
+        T * ln = lanes + base;
+        T most = 0;
+        for(int j = 0; j < chunk; ++j) {
+            T c = 0;
+            for(int l = 0; l < BP_PAIR_LANES; ++l) {
+                c += ln[l*65536 + j];
+                ln[l*65536 + j] = 0;
+            }
+            sum[j] = c;
+            most = (c > most)? c : most;
+        }
+        if(most <= counts[k - 1])
+            continue;
+        
+        for(int j = 0; j < chunk; ++j)
+        {
+            uint32_t c = sum[j];
+            if(c <= counts[k - 1])
+                continue;
+            int t = k - 1;
+            for(; t > 0 && counts[t - 1] < c; --t) {
+                idx[t] = idx[t - 1];
+                counts[t] = counts[t - 1];
+            }
+            idx[t] = base + j;
+            counts[t] = c;
+        }
+    }
+}
+
+static void BP_CountPairsOf_Generic(const uint8_t * data, size_t size, const uint8_t * pairs, int n, uint32_t * counts)
+{
+    // Bit i is set for the first and second bytes of pair i
+    uint32_t firstOf[256] = {0}, secondOf[256] = {0};
+    for(int i = 0; i < n; ++i) {
+        firstOf[pairs[2*i]] |= 1u << i;
+        secondOf[pairs[2*i + 1]] |= 1u << i;
+    }
+    for(size_t j = 1; j < size; ++j)
+    {
+        uint32_t m = firstOf[data[j - 1]] & secondOf[data[j]];
+        while(m) {
+            ++counts[__builtin_ctz(m)];
+            m &= m - 1;
+        }
+    }
+}
+
+static void BP_Expand_Generic(uint8_t * dst, size_t, const ExpandTable & tbl,
+                              const uint8_t * src, size_t n)
+{
+    const uint8_t * bytes = &tbl.bytes[0];
+    for(size_t j = 0; j < n; ++j)
+    {
+        uint8_t b = src[j];
+        uint32_t len = tbl.len[b];
+        if(len == 1) {
+            *dst++ = b;
+        }
+        else {
+            memcpy(dst, bytes + tbl.offset[b], len);
+            dst += len;
+        }
+    }
+}
+
+static void BP_UnpackSymbols_Generic(uint16_t * dst, const uint8_t * src, size_t, size_t n, int width)
+{
+    uint32_t mask = (1u << width) - 1;
+    uint64_t acc = 0;
+    int bits = 0;
+    for(size_t j = 0; j < n; ++j)
+    {
+        while(bits < width) {
+            acc |= (uint64_t)*src++ << bits;
+            bits += 8;
+        }
+        dst[j] = acc & mask;
+        acc >>= width;
+        bits -= width;
+    }
+}
+
+static void BP_ExpandWide_Generic(uint8_t * dst, size_t, const WideExpandTable & tbl,
+                                  const uint16_t * src, size_t n)
+{
+    const uint8_t * bytes = &tbl.bytes[0];
+    const uint32_t * len = &tbl.len[0], * offset = &tbl.offset[0];
+    for(size_t j = 0; j < n; ++j)
+    {
+        uint16_t s = src[j];
+        if(s < 256) {
+            *dst++ = s;
+        }
+        else {
+            memcpy(dst, bytes + offset[s], len[s]);
+            dst += len[s];
+        }
+    }
+}
+
+// *****************************************************************************
+// x86 versions
+//
+// Substitution compares a vector of bytes against the first byte of the pair
+// and the same vector shifted by one against the second, and copies the whole
+// vector through when neither lines up. Output is written out of place, so a
+// vector store can run past the bytes it keeps; it never passes the input
+// position, so it stays within size bytes.
+//
+// The best pair kernels sum the lanes a vector at a time, storing zeros back,
+// and keep the running maximum of each element slot along with the vector
+// index where it was first reached. Counts only replace the maximum when
+// strictly greater, which keeps the lowest index on a tie.
+//
+// Expansion stores a full vector from the expansion table for every byte and
+// advances by the expanded length, rather than branching between a byte store
+// and a variable-length copy. The last few output bytes, where a full store
+// would run off the end, are done by the portable version.
+
+#ifdef BP_HAVE_X86_KERNELS
+
+__attribute__((target("sse4.2")))
+static size_t BP_Substitute_SSE42(uint8_t * dst, const uint8_t * src, size_t size,
+                                  uint8_t first, uint8_t second, uint8_t key)
+{
+    const __m128i f = _mm_set1_epi8(first), s = _mm_set1_epi8(second);
+    size_t in = 0, out = 0;
+    while(in + 17 <= size)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + in));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + in + 1));
+        uint32_t hits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v0, f), _mm_cmpeq_epi8(v1, s)));
+        _mm_storeu_si128((__m128i *)(dst + out), v0);
+        if(!hits) {
+            in += 16;
+            out += 16;
+            continue;
+        }
+        int k = __builtin_ctz(hits);
+        out += k;
+        dst[out++] = key;
+        in += k + 2;
+    }
+    return out + BP_Substitute_Generic(dst + out, src + in, size - in, first, second, key);
+}
+
+__attribute__((target("avx2")))
+static size_t BP_Substitute_AVX2(uint8_t * dst, const uint8_t * src, size_t size,
+                                 uint8_t first, uint8_t second, uint8_t key)
+{
+    const __m256i f = _mm256_set1_epi8(first), s = _mm256_set1_epi8(second);
+    size_t in = 0, out = 0;
+    while(in + 33 <= size)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + in));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + in + 1));
+        uint32_t hits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v0, f), _mm256_cmpeq_epi8(v1, s)));
+        _mm256_storeu_si256((__m256i *)(dst + out), v0);
+        if(!hits) {
+            in += 32;
+            out += 32;
+            continue;
+        }
+        int k = __builtin_ctz(hits);
+        out += k;
+        dst[out++] = key;
+        in += k + 2;
+    }
+    return out + BP_Substitute_Generic(dst + out, src + in, size - in, first, second, key);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t BP_Substitute_AVX512(uint8_t * dst, const uint8_t * src, size_t size,
+                                   uint8_t first, uint8_t second, uint8_t key)
+{
+    const __m512i f = _mm512_set1_epi8(first), s = _mm512_set1_epi8(second);
+    size_t in = 0, out = 0;
+    while(in + 65 <= size)
+    {
+        __m512i v0 = _mm512_loadu_si512((const void *)(src + in));
+        __m512i v1 = _mm512_loadu_si512((const void *)(src + in + 1));
+        __mmask64 hits = _mm512_cmpeq_epi8_mask(v0, f) & _mm512_cmpeq_epi8_mask(v1, s);
+        _mm512_storeu_si512((void *)(dst + out), v0);
+        if(!hits) {
+            in += 64;
+            out += 64;
+            continue;
+        }
+        int k = __builtin_ctzll(hits);
+        out += k;
+        dst[out++] = key;
+        in += k + 2;
+    }
+    return out + BP_Substitute_Generic(dst + out, src + in, size - in, first, second, key);
+}
+
+// Reduce per-slot maxima to the overall one. Each slot holds the first vector
+// index at which it reached its maximum, so the lowest pair index among the
+// slots with the top count is the lowest overall.
+template<typename T, int W>
+static inline int BP_ReduceBestPair(const T * best, const T * vecIdx, uint32_t & count)
+{
+    int bestIdx = 0;
+    uint32_t bestCount = 0;
+    for(int s = 0; s < W; ++s)
+    {
+        int idx = vecIdx[s]*W + s;
+        if(best[s] > bestCount || (best[s] == bestCount && idx < bestIdx)) {
+            bestIdx = idx;
+            bestCount = best[s];
+        }
+    }
+    count = bestCount;
+    return bestIdx;
+}
+
+template<typename T>
+static inline void BP_CountPairsLanes(T * lanes, const uint8_t * data, size_t size)
+{
+    T * l0 = lanes, * l1 = lanes + 65536, * l2 = lanes + 2*65536, * l3 = lanes + 3*65536;
+    size_t j = 0;
+    for(; j + 4 < size; j += 4)
+    {
+        uint32_t a = data[j], b = data[j + 1], c = data[j + 2], d = data[j + 3], e = data[j + 4];
+        ++l0[(a << 8) | b];
+        ++l1[(b << 8) | c];
+        ++l2[(c << 8) | d];
+        ++l3[(d << 8) | e];
+    }
+    for(; j + 1 < size; ++j)
+        ++l0[(data[j] << 8) | data[j + 1]];
+}
+
+static void BP_CountPairs_Lanes(uint16_t * lanes, const uint8_t * data, size_t size) {
+    BP_CountPairsLanes(lanes, data, size);
+}
+
+static void BP_CountPairsWide_Lanes(uint32_t * lanes, const uint8_t * data, size_t size) {
+    BP_CountPairsLanes(lanes, data, size);
+}
+
+__attribute__((target("sse4.2")))
+static int BP_BestPair_SSE42(uint16_t * lanes, uint32_t & count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i best = zero, bestVec = zero, vec = zero;
+    for(int j = 0; j < 65536; j += 8)
+    {
+        __m128i c = zero;
+        for(int l = 0; l < BP_PAIR_LANES; ++l) {
+            c = _mm_add_epi16(c, _mm_loadu_si128((const __m128i *)(lanes + l*65536 + j)));
+            _mm_storeu_si128((__m128i *)(lanes + l*65536 + j), zero);
+        }
+        __m128i top = _mm_max_epu16(c, best);
+        __m128i same = _mm_cmpeq_epi16(top, best);
+        bestVec = _mm_blendv_epi8(vec, bestVec, same);
+        best = top;
+        vec = _mm_add_epi16(vec, _mm_set1_epi16(1));
+    }
+    uint16_t b[8], v[8];
+    _mm_storeu_si128((__m128i *)b, best);
+    _mm_storeu_si128((__m128i *)v, bestVec);
+    return BP_ReduceBestPair<uint16_t, 8>(b, v, count);
+}
+
+__attribute__((target("sse4.2")))
+static int BP_BestPairWide_SSE42(uint32_t * lanes, uint32_t & count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i best = zero, bestVec = zero, vec = zero;
+    for(int j = 0; j < 65536; j += 4)
+    {
+        __m128i c = zero;
+        for(int l = 0; l < BP_PAIR_LANES; ++l) {
+            c = _mm_add_epi32(c, _mm_loadu_si128((const __m128i *)(lanes + l*65536 + j)));
+            _mm_storeu_si128((__m128i *)(lanes + l*65536 + j), zero);
+        }
+        __m128i top = _mm_max_epu32(c, best);
+        __m128i same = _mm_cmpeq_epi32(top, best);
+        bestVec = _mm_blendv_epi8(vec, bestVec, same);
+        best = top;
+        vec = _mm_add_epi32(vec, _mm_set1_epi32(1));
+    }
+    uint32_t b[4], v[4];
+    _mm_storeu_si128((__m128i *)b, best);
+    _mm_storeu_si128((__m128i *)v, bestVec);
+    return BP_ReduceBestPair<uint32_t, 4>(b, v, count);
+}
+
+__attribute__((target("avx2")))
+static int BP_BestPair_AVX2(uint16_t * lanes, uint32_t & count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i best = zero, bestVec = zero, vec = zero;
+    for(int j = 0; j < 65536; j += 16)
+    {
+        __m256i c = zero;
+        for(int l = 0; l < BP_PAIR_LANES; ++l) {
+            c = _mm256_add_epi16(c, _mm256_loadu_si256((const __m256i *)(lanes + l*65536 + j)));
+            _mm256_storeu_si256((__m256i *)(lanes + l*65536 + j), zero);
+        }
+        __m256i top = _mm256_max_epu16(c, best);
+        __m256i same = _mm256_cmpeq_epi16(top, best);
+        bestVec = _mm256_blendv_epi8(vec, bestVec, same);
+        best = top;
+        vec = _mm256_add_epi16(vec, _mm256_set1_epi16(1));
+    }
+    uint16_t b[16], v[16];
+    _mm256_storeu_si256((__m256i *)b, best);
+    _mm256_storeu_si256((__m256i *)v, bestVec);
+    return BP_ReduceBestPair<uint16_t, 16>(b, v, count);
+}
+
+__attribute__((target("avx2")))
+static int BP_BestPairWide_AVX2(uint32_t * lanes, uint32_t & count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i best = zero, bestVec = zero, vec = zero;
+    for(int j = 0; j < 65536; j += 8)
+    {
+        __m256i c = zero;
+        for(int l = 0; l < BP_PAIR_LANES; ++l) {
+            c = _mm256_add_epi32(c, _mm256_loadu_si256((const __m256i *)(lanes + l*65536 + j)));
+            _mm256_storeu_si256((__m256i *)(lanes + l*65536 + j), zero);
+        }
+        __m256i top = _mm256_max_epu32(c, best);
+        __m256i same = _mm256_cmpeq_epi32(top, best);
+        bestVec = _mm256_blendv_epi8(vec, bestVec, same);
+        best = top;
+        vec = _mm256_add_epi32(vec, _mm256_set1_epi32(1));
+    }
+    uint32_t b[8], v[8];
+    _mm256_storeu_si256((__m256i *)b, best);
+    _mm256_storeu_si256((__m256i *)v, bestVec);
+    return BP_ReduceBestPair<uint32_t, 8>(b, v, count);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int BP_BestPair_AVX512(uint16_t * lanes, uint32_t & count)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i best = zero, bestVec = zero, vec = zero;
+    for(int j = 0; j < 65536; j += 32)
+    {
+        __m512i c = zero;
+        for(int l = 0; l < BP_PAIR_LANES; ++l) {
+            c = _mm512_add_epi16(c, _mm512_loadu_si512((const void *)(lanes + l*65536 + j)));
+            _mm512_storeu_si512((void *)(lanes + l*65536 + j), zero);
+        }
+        __mmask32 gt = _mm512_cmpgt_epu16_mask(c, best);
+        best = _mm512_mask_mov_epi16(best, gt, c);
+        bestVec = _mm512_mask_mov_epi16(bestVec, gt, vec);
+        vec = _mm512_add_epi16(vec, _mm512_set1_epi16(1));
+    }
+    uint16_t b[32], v[32];
+    _mm512_storeu_si512((void *)b, best);
+    _mm512_storeu_si512((void *)v, bestVec);
+    return BP_ReduceBestPair<uint16_t, 32>(b, v, count);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int BP_BestPairWide_AVX512(uint32_t * lanes, uint32_t & count)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i best = zero, bestVec = zero, vec = zero;
+    for(int j = 0; j < 65536; j += 16)
+    {
+        __m512i c = zero;
+        for(int l = 0; l < BP_PAIR_LANES; ++l) {
+            c = _mm512_add_epi32(c, _mm512_loadu_si512((const void *)(lanes + l*65536 + j)));
+            _mm512_storeu_si512((void *)(lanes + l*65536 + j), zero);
+        }
+        __mmask16 gt = _mm512_cmpgt_epu32_mask(c, best);
+        best = _mm512_mask_mov_epi32(best, gt, c);
+        bestVec = _mm512_mask_mov_epi32(bestVec, gt, vec);
+        vec = _mm512_add_epi32(vec, _mm512_set1_epi32(1));
+    }
+    uint32_t b[16], v[16];
+    _mm512_storeu_si512((void *)b, best);
+    _mm512_storeu_si512((void *)v, bestVec);
+    return BP_ReduceBestPair<uint32_t, 16>(b, v, count);
+}
+
+__attribute__((target("sse4.2")))
+static size_t BP_SubstituteMany_SSE42(uint8_t * dst, const uint8_t * src, size_t size,
+                                      const uint8_t * pairs, const uint8_t * keys, int n, size_t * counts)
+{
+    __m128i f[BP_MAX_BATCH], s[BP_MAX_BATCH];
+    int pairOf[256];
+    for(int i = 0; i < n; ++i) {
+        f[i] = _mm_set1_epi8(pairs[2*i]);
+        s[i] = _mm_set1_epi8(pairs[2*i + 1]);
+        pairOf[pairs[2*i]] = i;
+        counts[i] = 0;
+    }
+    
+    size_t in = 0, out = 0;
+    while(in + 17 <= size)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + in));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + in + 1));
+        __m128i match = _mm_setzero_si128();
+        for(int i = 0; i < n; ++i)
+            match = _mm_or_si128(match, _mm_and_si128(_mm_cmpeq_epi8(v0, f[i]), _mm_cmpeq_epi8(v1, s[i])));
+        uint32_t hits = _mm_movemask_epi8(match);
+        _mm_storeu_si128((__m128i *)(dst + out), v0);
+        if(!hits) {
+            in += 16;
+            out += 16;
+            continue;
+        }
+        int k = __builtin_ctz(hits);
+        int i = pairOf[src[in + k]];
+        out += k;
+        dst[out++] = keys[i];
+        ++counts[i];
+        in += k + 2;
+    }
+    
+    size_t tail[BP_MAX_BATCH];
+    out += BP_SubstituteMany_Generic(dst + out, src + in, size - in, pairs, keys, n, tail);
+    for(int i = 0; i < n; ++i)
+        counts[i] += tail[i];
+    return out;
+}
+
+__attribute__((target("avx2")))
+static size_t BP_SubstituteMany_AVX2(uint8_t * dst, const uint8_t * src, size_t size,
+                                     const uint8_t * pairs, const uint8_t * keys, int n, size_t * counts)
+{
+    __m256i f[BP_MAX_BATCH], s[BP_MAX_BATCH];
+    int pairOf[256];
+    for(int i = 0; i < n; ++i) {
+        f[i] = _mm256_set1_epi8(pairs[2*i]);
+        s[i] = _mm256_set1_epi8(pairs[2*i + 1]);
+        pairOf[pairs[2*i]] = i;
+        counts[i] = 0;
+    }
+    
+    size_t in = 0, out = 0;
+    while(in + 33 <= size)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + in));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + in + 1));
+        __m256i match = _mm256_setzero_si256();
+        for(int i = 0; i < n; ++i)
+            match = _mm256_or_si256(match, _mm256_and_si256(_mm256_cmpeq_epi8(v0, f[i]), _mm256_cmpeq_epi8(v1, s[i])));
+        uint32_t hits = _mm256_movemask_epi8(match);
+        _mm256_storeu_si256((__m256i *)(dst + out), v0);
+        if(!hits) {
+            in += 32;
+            out += 32;
+            continue;
+        }
+        int k = __builtin_ctz(hits);
+        int i = pairOf[src[in + k]];
+        out += k;
+        dst[out++] = keys[i];
+        ++counts[i];
+        in += k + 2;
+    }
+    
+    size_t tail[BP_MAX_BATCH];
+    out += BP_SubstituteMany_Generic(dst + out, src + in, size - in, pairs, keys, n, tail);
+    for(int i = 0; i < n; ++i)
+        counts[i] += tail[i];
+    return out;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static void BP_CountPairsOf_SSE42(const uint8_t * data, size_t size, const uint8_t * pairs, int n, uint32_t * counts)
+{
+    __m128i f[BP_MAX_CANDIDATES], s[BP_MAX_CANDIDATES];
+    for(int i = 0; i < n; ++i) {
+        f[i] = _mm_set1_epi8(pairs[2*i]);
+        s[i] = _mm_set1_epi8(pairs[2*i + 1]);
+    }
+    
+    size_t j = 0;
+    for(; j + 17 <= size; j += 16)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(data + j));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(data + j + 1));
+        for(int i = 0; i < n; ++i)
+            counts[i] += __builtin_popcount(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v0, f[i]), _mm_cmpeq_epi8(v1, s[i]))));
+    }
+    BP_CountPairsOf_Generic(data + j, size - j, pairs, n, counts);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void BP_CountPairsOf_AVX2(const uint8_t * data, size_t size, const uint8_t * pairs, int n, uint32_t * counts)
+{
+    __m256i f[BP_MAX_CANDIDATES], s[BP_MAX_CANDIDATES];
+    for(int i = 0; i < n; ++i) {
+        f[i] = _mm256_set1_epi8(pairs[2*i]);
+        s[i] = _mm256_set1_epi8(pairs[2*i + 1]);
+    }
+    
+    size_t j = 0;
+    for(; j + 33 <= size; j += 32)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + j));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + j + 1));
+        for(int i = 0; i < n; ++i)
+            counts[i] += __builtin_popcount(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v0, f[i]), _mm256_cmpeq_epi8(v1, s[i]))));
+    }
+    BP_CountPairsOf_Generic(data + j, size - j, pairs, n, counts);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static void BP_CountPairsOf_AVX512(const uint8_t * data, size_t size, const uint8_t * pairs, int n, uint32_t * counts)
+{
+    __m512i f[BP_MAX_CANDIDATES], s[BP_MAX_CANDIDATES];
+    for(int i = 0; i < n; ++i) {
+        f[i] = _mm512_set1_epi8(pairs[2*i]);
+        s[i] = _mm512_set1_epi8(pairs[2*i + 1]);
+    }
+    
+    size_t j = 0;
+    for(; j + 65 <= size; j += 64)
+    {
+        __m512i v0 = _mm512_loadu_si512((const void *)(data + j));
+        __m512i v1 = _mm512_loadu_si512((const void *)(data + j + 1));
+        for(int i = 0; i < n; ++i)
+            counts[i] += __builtin_popcountll(_mm512_cmpeq_epi8_mask(v0, f[i]) & _mm512_cmpeq_epi8_mask(v1, s[i]));
+    }
+    BP_CountPairsOf_Generic(data + j, size - j, pairs, n, counts);
+}
+
+__attribute__((target("sse4.2")))
+static void BP_Expand_SSE42(uint8_t * dst, size_t dstSize, const ExpandTable & tbl,
+                            const uint8_t * src, size_t n)
+{
+    const uint8_t * bytes = &tbl.bytes[0];
+    uint8_t * dstEnd = dst + dstSize;
+    size_t j = 0;
+    for(; j < n && dstEnd - dst >= 16; ++j)
+    {
+        uint8_t b = src[j];
+        uint32_t len = tbl.len[b];
+        if(len <= 16)
+            _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)(bytes + tbl.offset[b])));
+        else
+            memcpy(dst, bytes + tbl.offset[b], len);
+        dst += len;
+    }
+    BP_Expand_Generic(dst, dstEnd - dst, tbl, src + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void BP_Expand_AVX2(uint8_t * dst, size_t dstSize, const ExpandTable & tbl,
+                           const uint8_t * src, size_t n)
+{
+    const uint8_t * bytes = &tbl.bytes[0];
+    uint8_t * dstEnd = dst + dstSize;
+    size_t j = 0;
+    for(; j < n && dstEnd - dst >= 32; ++j)
+    {
+        uint8_t b = src[j];
+        uint32_t len = tbl.len[b];
+        if(len <= 32)
+            _mm256_storeu_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)(bytes + tbl.offset[b])));
+        else
+            memcpy(dst, bytes + tbl.offset[b], len);
+        dst += len;
+    }
+    BP_Expand_Generic(dst, dstEnd - dst, tbl, src + j, n - j);
+}
+
+// Unpacking takes 8 symbols at a time, which always end on a byte boundary,
+// width bytes on. A byte shuffle moves the (up to 3) bytes holding each symbol
+// into a 32-bit lane of its own, where it is shifted down by its bit offset
+// and masked. ctl is the shuffle for symbols 0-3 then 4-7, shift the offsets.
+static inline void BP_UnpackControl(int width, uint8_t * ctl, uint32_t * shift)
+{
+    for(int i = 0; i < 8; ++i)
+    {
+        int first = (i*width) >> 3, last = (i*width + width - 1) >> 3;
+        for(int b = 0; b < 4; ++b)
+            ctl[4*i + b] = (first + b <= last)? first + b : 0x80;
+        shift[i] = (i*width) & 7;
+    }
+}
+
+// Without a variable shift, multiply each lane up so every symbol starts at
+// bit 8, then shift them all by 8. Lanes hold at most 24 bits, so nothing is
+// lost off the top.
+__attribute__((target("sse4.2")))
+static void BP_UnpackSymbols_SSE42(uint16_t * dst, const uint8_t * src, size_t avail, size_t n, int width)
+{
+    uint8_t ctl[32];
+    uint32_t shift[8], mul[8];
+    BP_UnpackControl(width, ctl, shift);
+    for(int i = 0; i < 8; ++i)
+        mul[i] = 1u << (8 - shift[i]);
+    __m128i ctl0 = _mm_loadu_si128((const __m128i *)ctl), ctl1 = _mm_loadu_si128((const __m128i *)(ctl + 16));
+    __m128i mul0 = _mm_loadu_si128((const __m128i *)mul), mul1 = _mm_loadu_si128((const __m128i *)(mul + 4));
+    __m128i mask = _mm_set1_epi32((1 << width) - 1);
+    size_t j = 0;
+    for(; j + 8 <= n && avail >= 16; j += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i lo = _mm_srli_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, ctl0), mul0), 8);
+        __m128i hi = _mm_srli_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, ctl1), mul1), 8);
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask)));
+        src += width;
+        avail -= width;
+    }
+    BP_UnpackSymbols_Generic(dst + j, src, avail, n - j, width);
+}
+
+// 16 symbols at a time: each group of 8 is broadcast to both halves, so one
+// in-lane shuffle separates all 8, and the pack interleaves the two groups by
+// 64-bit quarters, which the permute puts back in order.
+__attribute__((target("avx2")))
+static void BP_UnpackSymbols_AVX2(uint16_t * dst, const uint8_t * src, size_t avail, size_t n, int width)
+{
+    uint8_t ctl[32];
+    uint32_t shift[8];
+    BP_UnpackControl(width, ctl, shift);
+    __m256i vctl = _mm256_loadu_si256((const __m256i *)ctl);
+    __m256i vshift = _mm256_loadu_si256((const __m256i *)shift);
+    __m256i mask = _mm256_set1_epi32((1 << width) - 1);
+    size_t j = 0;
+    for(; j + 16 <= n && avail >= (size_t)width + 16; j += 16)
+    {
+        __m256i a = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)src));
+        __m256i b = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(src + width)));
+        a = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(a, vctl), vshift), mask);
+        b = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(b, vctl), vshift), mask);
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8));
+        src += 2*width;
+        avail -= 2*width;
+    }
+    BP_UnpackSymbols_Generic(dst + j, src, avail, n - j, width);
+}
+
+__attribute__((target("sse4.2")))
+static void BP_ExpandWide_SSE42(uint8_t * dst, size_t dstSize, const WideExpandTable & tbl,
+                                const uint16_t * src, size_t n)
+{
+    const uint8_t * bytes = &tbl.bytes[0];
+    const uint32_t * len = &tbl.len[0], * offset = &tbl.offset[0];
+    uint8_t * dstEnd = dst + dstSize;
+    size_t j = 0;
+    for(; j < n && dstEnd - dst >= 16; ++j)
+    {
+        uint16_t s = src[j];
+        if(len[s] <= 16)
+            _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)(bytes + offset[s])));
+        else
+            memcpy(dst, bytes + offset[s], len[s]);
+        dst += len[s];
+    }
+    BP_ExpandWide_Generic(dst, dstEnd - dst, tbl, src + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void BP_ExpandWide_AVX2(uint8_t * dst, size_t dstSize, const WideExpandTable & tbl,
+                               const uint16_t * src, size_t n)
+{
+    const uint8_t * bytes = &tbl.bytes[0];
+    const uint32_t * len = &tbl.len[0], * offset = &tbl.offset[0];
+    uint8_t * dstEnd = dst + dstSize;
+    size_t j = 0;
+    for(; j < n && dstEnd - dst >= 32; ++j)
+    {
+        uint16_t s = src[j];
+        if(len[s] <= 32)
+            _mm256_storeu_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)(bytes + offset[s])));
+        else
+            memcpy(dst, bytes + offset[s], len[s]);
+        dst += len[s];
+    }
+    BP_ExpandWide_Generic(dst, dstEnd - dst, tbl, src + j, n - j);
+}
+
+#endif // BP_HAVE_X86_KERNELS
+
+// *****************************************************************************
+// Dispatch
+
+// Kernels for an instruction set level, from "generic", "sse4.2", "avx2" and
+// "avx512". Returns false if the name is unknown or the CPU lacks it.
+static inline bool BP_KernelsFor(const char * isa, Kernels & k)
+{
+    k.isa = "generic";
+    k.countPairs = BP_CountPairs_Generic;
+    k.bestPair = BP_BestPair_Generic;
+    k.countPairsWide = BP_CountPairsWide_Generic;
+    k.bestPairWide = BP_BestPairWide_Generic;
+    k.substitute = BP_Substitute_Generic;
+    k.substituteMany = BP_SubstituteMany_Generic;
+    k.countPairsOf = BP_CountPairsOf_Generic;
+    k.expand = BP_Expand_Generic;
+    k.unpackSymbols = BP_UnpackSymbols_Generic;
+    k.expandWide = BP_ExpandWide_Generic;
+    k.crc = BP_CRC32C_Soft;
+    if(strcmp(isa, "generic") == 0)
+        return true;
+#ifdef BP_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    // The CountPairsOf kernels are also built for popcnt, which is a separate
+    // CPUID bit from any of these levels
+    bool popcnt = __builtin_cpu_supports("popcnt");
+    if(strcmp(isa, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2") && popcnt)
+    {
+        k.isa = "sse4.2";
+        k.countPairs = BP_CountPairs_Lanes;
+        k.countPairsWide = BP_CountPairsWide_Lanes;
+        k.bestPair = BP_BestPair_SSE42;
+        k.bestPairWide = BP_BestPairWide_SSE42;
+        k.substitute = BP_Substitute_SSE42;
+        k.substituteMany = BP_SubstituteMany_SSE42;
+        k.countPairsOf = BP_CountPairsOf_SSE42;
+        k.expand = BP_Expand_SSE42;
+        k.unpackSymbols = BP_UnpackSymbols_SSE42;
+        k.expandWide = BP_ExpandWide_SSE42;
+        k.crc = BP_CRC32C_SSE42;
+        return true;
+    }
+    if(strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2") && popcnt)
+    {
+        k.isa = "avx2";
+        k.countPairs = BP_CountPairs_Lanes;
+        k.countPairsWide = BP_CountPairsWide_Lanes;
+        k.bestPair = BP_BestPair_AVX2;
+        k.bestPairWide = BP_BestPairWide_AVX2;
+        k.substitute = BP_Substitute_AVX2;
+        k.substituteMany = BP_SubstituteMany_AVX2;
+        k.countPairsOf = BP_CountPairsOf_AVX2;
+        k.expand = BP_Expand_AVX2;
+        k.unpackSymbols = BP_UnpackSymbols_AVX2;
+        k.expandWide = BP_ExpandWide_AVX2;
+        k.crc = BP_CRC32C_SSE42;
+        return true;
+    }
+    // 64-byte stores don't pay off for expansions, which are mostly short, and
+    // batched substitution is limited by its compares rather than width
+    if(strcmp(isa, "avx512") == 0 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && popcnt)
+    {
+        k.isa = "avx512";
+        k.countPairs = BP_CountPairs_Lanes;
+        k.countPairsWide = BP_CountPairsWide_Lanes;
+        k.bestPair = BP_BestPair_AVX512;
+        k.bestPairWide = BP_BestPairWide_AVX512;
+        k.substitute = BP_Substitute_AVX512;
+        k.substituteMany = BP_SubstituteMany_AVX2;
+        k.countPairsOf = BP_CountPairsOf_AVX512;
+        k.expand = BP_Expand_AVX2;
+        k.unpackSymbols = BP_UnpackSymbols_AVX2;
+        k.expandWide = BP_ExpandWide_AVX2;
+        k.crc = BP_CRC32C_SSE42;
+        return true;
+    }
+#endif // BP_HAVE_X86_KERNELS
+    return false;
+}
+
+// Widest instruction set level the CPU supports
+static inline const char * BP_DetectISA()
+{
+    static const char * const levels[] = {"avx512", "avx2", "sse4.2"};
+    Kernels k;
+    for(auto isa : levels)
+        if(BP_KernelsFor(isa, k))
+            return isa;
+    return "generic";
+}
+
+static inline Kernels BP_DefaultKernels()
+{
+    Kernels k;
+    BP_KernelsFor(BP_DetectISA(), k);
+    if(k.crc == BP_CRC32C_Soft)
+        BP_CRC32C_InitTable();
+    return k;
+}
+
+// Bound once at startup, before any threads exist
+static Kernels bp_kernels = BP_DefaultKernels();
+
+// Rebind every kernel, including BP_CRC32C(), to one instruction set level.
+// Call before starting any threads.
+static inline bool BP_SelectKernels(const char * isa)
+{
+    Kernels k;
+    if(!BP_KernelsFor(isa, k))
+        return false;
+    if(k.crc == BP_CRC32C_Soft)
+        BP_CRC32C_InitTable();
+    bp_kernels = k;
+    bp_crcFunc = k.crc;
+    return true;
+}
+
+#endif // BPKERNELS_H
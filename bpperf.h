@@ -0,0 +1,332 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPPERF_H
+#define BPPERF_H
+
+// Hardware performance counters per kernel, for the --perf option of bpenc
+// and bpdec. Unlike tracing this is always compiled in: a PerfScope costs one
+// untaken branch unless BP_PerfEnable() has been called.
+//
+// Each thread opens its own counter group with perf_event_open, counting user
+// space only, and a PerfScope adds the change in its counters over the scope
+// to the totals for its name. Totals are merged across threads when a thread
+// exits or calls BP_PerfReport(). If the counters can't be opened (no PMU,
+// perf_event_paranoid, a container without the syscall) the report still
+// gives calls, bytes and time, so throughput is always available.
+//
+// Scopes nest, and the counts of an outer scope include those of the inner
+// ones. Bytes are whatever the kernel reads, summed over passes for kernels
+// that make several, so cycles per byte compare between variants of one
+// kernel rather than between kernels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+enum {
+    BP_PERF_CYCLES,
+    BP_PERF_INSTRUCTIONS,
+    BP_PERF_BRANCHES,
+    BP_PERF_BRANCH_MISSES,
+    BP_PERF_L1D_MISSES,
+    BP_PERF_LLC_MISSES,
+    BP_PERF_NUM_COUNTERS
+};
+
+struct PerfTotals {
+    const char * name;
+    uint64_t calls, bytes;
+    double seconds;
+    uint64_t counts[BP_PERF_NUM_COUNTERS];
+    uint64_t enabled, running;// ns the group was enabled and scheduled in
+};
+
+// Counter totals merged from exited threads, and whether counting is on
+struct PerfRegistry {
+    std::mutex lock;
+    std::vector<PerfTotals> totals;
+    bool enabled;
+    bool opened[BP_PERF_NUM_COUNTERS];// counter opened on any thread
+    std::string error;// why the group leader could not be opened
+    PerfRegistry(): enabled(false) {
+        for(int c = 0; c < BP_PERF_NUM_COUNTERS; ++c)
+            opened[c] = false;
+    }
+};
+
+static PerfRegistry bp_perfRegistry;
+
+static inline PerfTotals & BP_PerfTotals(std::vector<PerfTotals> & totals, const char * name)
+{
+    for(auto & t : totals)
+        if(t.name == name || strcmp(t.name, name) == 0)
+            return t;
+    PerfTotals t;
+    memset(&t, 0, sizeof(t));
+    t.name = name;
+    totals.push_back(t);
+    return totals.back();
+}
+
+static inline int BP_PerfOpen(uint32_t type, uint64_t config, int groupFd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (groupFd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+struct PerfThread {
+    int fds[BP_PERF_NUM_COUNTERS];
+    int slots[BP_PERF_NUM_COUNTERS];// counter of each value in a group read
+    int numOpen;
+    bool tried;
+    std::vector<PerfTotals> totals;
+
+    PerfThread(): numOpen(0), tried(false) {
+        for(int c = 0; c < BP_PERF_NUM_COUNTERS; ++c)
+            fds[c] = -1;
+    }
+    ~PerfThread() {
+        Flush();
+        for(int c = 0; c < BP_PERF_NUM_COUNTERS; ++c)
+            if(fds[c] != -1)
+                close(fds[c]);
+    }
+
+    void Open();
+    bool Read(uint64_t * counts, uint64_t & enabled, uint64_t & running);
+    void Flush();
+};
+
+static thread_local PerfThread bp_perfThread;
+
+// Cycles lead the group. Without them nothing else is worth reporting, but
+// any other counter the PMU lacks is just left out.
+inline void PerfThread::Open()
+{
+    tried = true;
+    static const uint32_t types[BP_PERF_NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE
+    };
+    static const uint64_t configs[BP_PERF_NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+
+    fds[0] = BP_PerfOpen(types[0], configs[0], -1);
+    if(fds[0] == -1)
+    {
+        std::lock_guard<std::mutex> guard(bp_perfRegistry.lock);
+        if(bp_perfRegistry.error.empty())
+            bp_perfRegistry.error = strerror(errno);
+        return;
+    }
+    slots[numOpen++] = 0;
+    for(int c = 1; c < BP_PERF_NUM_COUNTERS; ++c)
+    {
+        fds[c] = BP_PerfOpen(types[c], configs[c], fds[0]);
+        if(fds[c] != -1)
+            slots[numOpen++] = c;
+    }
+    {
+        std::lock_guard<std::mutex> guard(bp_perfRegistry.lock);
+        for(int s = 0; s < numOpen; ++s)
+            bp_perfRegistry.opened[slots[s]] = true;
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+inline bool PerfThread::Read(uint64_t * counts, uint64_t & enabled, uint64_t & running)
+{
+    if(!tried)
+        Open();
+    if(numOpen == 0)
+        return false;
+    uint64_t bfr[3 + BP_PERF_NUM_COUNTERS];
+    if(read(fds[0], bfr, sizeof(bfr)) < (ssize_t)(3 + numOpen)*8)
+        return false;
+    enabled = bfr[1];
+    running = bfr[2];
+    for(int s = 0; s < numOpen; ++s)
+        counts[slots[s]] = bfr[3 + s];
+    return true;
+}
+
+inline void PerfThread::Flush()
+{
+    if(totals.empty())
+        return;
+    std::lock_guard<std::mutex> guard(bp_perfRegistry.lock);
+    for(auto & t : totals)
+    {
+        PerfTotals & sum = BP_PerfTotals(bp_perfRegistry.totals, t.name);
+        sum.calls += t.calls;
+        sum.bytes += t.bytes;
+        sum.seconds += t.seconds;
+        for(int c = 0; c < BP_PERF_NUM_COUNTERS; ++c)
+            sum.counts[c] += t.counts[c];
+        sum.enabled += t.enabled;
+        sum.running += t.running;
+    }
+    totals.clear();
+}
+
+struct PerfScope {
+    const char * name;
+    uint64_t bytes;
+    bool active, counting;
+    std::chrono::steady_clock::time_point start;
+    uint64_t counts[BP_PERF_NUM_COUNTERS];
+    uint64_t enabled, running;
+
+    PerfScope(const char * _name, uint64_t _bytes): name(_name), bytes(_bytes), active(bp_perfRegistry.enabled) {
+        if(active) {
+            memset(counts, 0, sizeof(counts));
+            counting = bp_perfThread.Read(counts, enabled, running);
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~PerfScope() {
+        if(active)
+            End();
+    }
+    void End();
+};
+
+inline void PerfScope::End()
+{
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    uint64_t endCounts[BP_PERF_NUM_COUNTERS], endEnabled = 0, endRunning = 0;
+    memset(endCounts, 0, sizeof(endCounts));
+    bool counted = counting && bp_perfThread.Read(endCounts, endEnabled, endRunning);
+
+    PerfTotals & t = BP_PerfTotals(bp_perfThread.totals, name);
+    ++t.calls;
+    t.bytes += bytes;
+    t.seconds += std::chrono::duration<double>(end - start).count();
+    if(counted)
+    {
+        for(int c = 0; c < BP_PERF_NUM_COUNTERS; ++c)
+            t.counts[c] += endCounts[c] - counts[c];
+        t.enabled += endEnabled - enabled;
+        t.running += endRunning - running;
+    }
+}
+
+// Turn counting on. Call before starting any threads. Returns false, after
+// saying why, if this thread can't open the counters; scopes still record
+// calls, bytes and time.
+static inline bool BP_PerfEnable()
+{
+    bp_perfRegistry.enabled = true;
+    uint64_t counts[BP_PERF_NUM_COUNTERS], enabled, running;
+    if(bp_perfThread.Read(counts, enabled, running))
+        return true;
+    fprintf(stderr, "Performance counters unavailable (%s), reporting time only\n",
+        bp_perfRegistry.error.empty()? "read failed" : bp_perfRegistry.error.c_str());
+    return false;
+}
+
+// Print the totals for every kernel, merged over all threads that have
+// exited. Call once the other threads are done. Throughput is per thread:
+// bytes over the summed time of all calls.
+static inline void BP_PerfReport(FILE * f)
+{
+    if(!bp_perfRegistry.enabled)
+        return;
+    bp_perfThread.Flush();
+    std::lock_guard<std::mutex> guard(bp_perfRegistry.lock);
+    const bool * opened = bp_perfRegistry.opened;
+    bool counters = opened[BP_PERF_CYCLES];
+
+    fprintf(f, "%-20s %9s %10s %10s", "kernel", "calls", "MB", "MB/s");
+    if(counters)
+        fprintf(f, " %8s %6s %8s %10s %10s", "cyc/B", "IPC", "br-miss%", "L1D-mis/KB", "LLC-mis/KB");
+    fprintf(f, "\n");
+    for(auto & t : bp_perfRegistry.totals)
+    {
+        double mb = t.bytes/1e6;
+        fprintf(f, "%-20s %9lu %10.3f %10.1f", t.name, t.calls, mb, (t.seconds > 0)? mb/t.seconds : 0.0);
+        if(counters)
+        {
+            // Multiplexed counters only ran part of the time, scale them up
+            double scale = t.running? (double)t.enabled/t.running : 0;
+            double count[BP_PERF_NUM_COUNTERS];
+            for(int c = 0; c < BP_PERF_NUM_COUNTERS; ++c)
+                count[c] = t.counts[c]*scale;
+            double kb = t.bytes/1e3;
+
+            fprintf(f, " %8.2f", t.bytes? count[BP_PERF_CYCLES]/t.bytes : 0.0);
+            if(opened[BP_PERF_INSTRUCTIONS])
+                fprintf(f, " %6.2f", count[BP_PERF_CYCLES]? count[BP_PERF_INSTRUCTIONS]/count[BP_PERF_CYCLES] : 0.0);
+            else
+                fprintf(f, " %6s", "-");
+            if(opened[BP_PERF_BRANCHES] && opened[BP_PERF_BRANCH_MISSES])
+                fprintf(f, " %8.3f", count[BP_PERF_BRANCHES]? 100*count[BP_PERF_BRANCH_MISSES]/count[BP_PERF_BRANCHES] : 0.0);
+            else
+                fprintf(f, " %8s", "-");
+            if(opened[BP_PERF_L1D_MISSES])
+                fprintf(f, " %10.2f", kb? count[BP_PERF_L1D_MISSES]/kb : 0.0);
+            else
+                fprintf(f, " %10s", "-");
+            if(opened[BP_PERF_LLC_MISSES])
+                fprintf(f, " %10.3f", kb? count[BP_PERF_LLC_MISSES]/kb : 0.0);
+            else
+                fprintf(f, " %10s", "-");
+        }
+        fprintf(f, "\n");
+    }
+}
+
+#endif // BPPERF_H
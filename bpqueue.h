@@ -0,0 +1,215 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPQUEUE_H
+#define BPQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+// Bounded single-producer, single-consumer queue. Lock-free: the producer only
+// writes tail, the consumer only writes head, and each side reads the other's
+// index with acquire ordering. The blocking Push()/Pop() spin briefly, then
+// back off with yield and short sleeps, so idle pipeline stages don't hog a
+// core on small containers.
+template<typename T>
+class SpscQueue {
+  public:
+    // Capacity is rounded up to a power of 2
+    explicit SpscQueue(size_t capacity):
+        head(0), tail(0)
+    {
+        size_t size = 1;
+        while(size < capacity)
+            size <<= 1;
+        items.resize(size);
+        mask = size - 1;
+    }
+    
+    bool TryPush(const T & item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) > mask)
+            return false;
+        items[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool TryPop(T & item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    
+    void Push(const T & item)
+    {
+        for(int spins = 0; !TryPush(item); ++spins)
+            Backoff(spins);
+    }
+    
+    T Pop()
+    {
+        T item;
+        for(int spins = 0; !TryPop(item); ++spins)
+            Backoff(spins);
+        return item;
+    }
+    
+  private:
+    static void Backoff(int spins)
+    {
+        if(spins < 64)
+            std::this_thread::yield();
+        else
+            usleep(50);
+    }
+    
+    // Indices are padded onto separate cache lines so the two sides don't
+    // contend for the same line.
+    std::vector<T> items;
+    size_t mask;
+    char pad0[64];
+    std::atomic<size_t> head;
+    char pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
+// Fixed set of threads that share the iterations of a loop with the thread
+// calling Run(), which returns once all of them are done. One loop runs at a
+// time: a caller that finds the pool busy runs its loop by itself.
+class LoopPool {
+  public:
+    explicit LoopPool(int numThreads):
+        job(NULL), jobSize(0), next(0), finished(0), active(0), generation(0), stopping(false)
+    {
+        for(int t = 0; t < numThreads; ++t)
+            threads.push_back(std::thread(&LoopPool::Work, this));
+    }
+    
+    ~LoopPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto & thread : threads)
+            thread.join();
+    }
+    
+    void Run(size_t n, const std::function<void(size_t)> & fn)
+    {
+        std::unique_lock<std::mutex> caller(runMutex, std::try_to_lock);
+        if(!caller.owns_lock() || threads.empty() || n <= 1) {
+            for(size_t i = 0; i < n; ++i)
+                fn(i);
+            return;
+        }
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        // A thread that woke too late for the last loop may still be about
+        // to take an index from it
+        done.wait(lock, [this]{ return active == 0; });
+        job = &fn;
+        jobSize = n;
+        next = 0;
+        finished = 0;
+        ++generation;
+        lock.unlock();
+        wake.notify_all();
+        
+        RunItems(fn, n);
+        lock.lock();
+        done.wait(lock, [this, n]{ return finished == n && active == 0; });
+        job = NULL;
+    }
+    
+  private:
+    void Work()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wake.wait(lock, [this, &seen]{ return stopping || generation != seen; });
+            if(stopping)
+                return;
+            seen = generation;
+            if(!job)
+                continue;
+            const std::function<void(size_t)> & fn = *job;
+            size_t n = jobSize;
+            ++active;
+            lock.unlock();
+            RunItems(fn, n);
+            lock.lock();
+            --active;
+            done.notify_all();
+        }
+    }
+    
+    void RunItems(const std::function<void(size_t)> & fn, size_t n)
+    {
+        size_t count = 0;
+        for(size_t i; (i = next++) < n; ++count)
+            fn(i);
+        if(count) {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished += count;
+        }
+        done.notify_all();
+    }
+    
+    std::vector<std::thread> threads;
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)> * job;
+    size_t jobSize;
+    std::atomic<size_t> next;
+    size_t finished;
+    int active;
+    uint64_t generation;
+    bool stopping;
+};
+
+#endif // BPQUEUE_H
@@ -0,0 +1,364 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+// Long-running encode/decode server on a Unix domain socket, for callers that
+// would otherwise start bpenc/bpdec for every small payload.
+//
+// clang++ --std=c++11 -O3 -pthread bpserver.cpp -o bpserver
+// 
+// Each connection is served by its own thread. Payloads travel through a
+// shared memory arena set up by the client when it connects (see bpclient.h);
+// the socket only carries fixed-size requests and replies. The arena must be
+// sealed against shrinking, or a client could truncate it and fault the
+// server on its next access. The socket is only open to the server's user.
+// A read takes every request the client has queued so far, and their replies
+// go back in one write.
+// 
+// Each connection keeps its state warm across requests: an encode first tries
+// the pair table found for the previous payload, as BP_Encode1 does from block
+// to block, and a decode reuses the previous block's expansion table when the
+// pairs and keys are the same. Every encoded payload still carries its own
+// table, and decodes with bpdec.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bpclient.h"
+#include "bpcodec.h"
+
+// Most requests taken from the socket in one read
+#define BP_SERVER_BATCH  (64)
+
+// Per-connection state, kept between requests
+struct ServerSession {
+    int sock;
+    uint8_t * arena;
+    size_t arenaSize;
+    
+    TableSearch search;// last table found, tried first on the next payload
+    std::vector<uint8_t> input, output;
+    
+    // Expansion table of the last block decoded, and the pairs, mask and keys
+    // it was built from
+    ExpandTable expandTable;
+    std::vector<uint8_t> expandKey, scratchKey;
+    WideExpandTable wideTable;// wide blocks always rebuild theirs
+    std::vector<uint8_t> plain;// entropy-decoded data of a coded block
+};
+
+static bool InArena(const ServerSession & s, uint64_t offset, uint64_t size) {
+    return offset <= s.arenaSize && size <= s.arenaSize - offset;
+}
+
+// Encode a payload into a complete stream. The payload starts with a table
+// even when the warm one is reused, so it decodes on its own.
+static int ServeEncode(ServerSession & s, const ServerRequest & req, uint64_t & outSize)
+{
+    bool checksum = (req.flags & BP_SERVER_CHECKSUM) != 0;
+    bool entropy = (req.flags & BP_SERVER_ENTROPY) != 0;
+    
+    // The client can write to the arena at any time, work from a copy
+    s.input.assign(s.arena + req.inOffset, s.arena + req.inOffset + req.inSize);
+    s.output.clear();
+    
+    const uint8_t * data = s.input.empty()? NULL : &s.input[0];
+    const uint8_t * dataEnd = data + s.input.size();
+    bool first = true;
+    while(data != dataEnd)
+    {
+        Block blk(data, dataEnd);
+        if(checksum)
+            blk.dataCRC = BP_CRC32C(&blk.data[0], blk.data.size());
+        EncodedBlock enc;
+        s.search.Encode(&blk, enc);
+        if(first && enc.pairs.empty())
+            enc.pairs = s.search.prevPairs;
+        first = false;
+        SerializeBlock(enc, s.output, checksum, entropy);
+    }
+    
+    outSize = s.output.size();
+    if(outSize > req.outCapacity)
+        return BP_SERVER_ESPACE;
+    if(outSize)
+        memcpy(s.arena + req.outOffset, &s.output[0], outSize);
+    return BP_SERVER_OK;
+}
+
+// Expansion table for ref, rebuilt only if its pairs, mask or keys differ
+// from the last block's
+static bool WarmExpandTable(ServerSession & s, const BlockRef & ref)
+{
+    std::vector<uint8_t> & key = s.scratchKey;
+    key.assign(ref.pairs, ref.pairs + 2*ref.numSubs);
+    if(ref.mask)
+        key.insert(key.end(), ref.mask, ref.mask + (ref.numSubs + 7)/8);
+    key.insert(key.end(), ref.keys, ref.keys + ref.numKeys);
+    key.push_back(ref.mask? 1 : 0);
+    if(key == s.expandKey)
+        return true;
+    
+    s.expandKey.clear();
+    if(!BuildExpandTable(ref, s.expandTable))
+        return false;
+    s.expandKey.swap(key);
+    return true;
+}
+
+// Decode a complete stream straight into the output region. If it doesn't
+// fit, the rest is only measured, so outSize is the space needed.
+static int ServeDecode(ServerSession & s, const ServerRequest & req, uint64_t & outSize)
+{
+    s.input.assign(s.arena + req.inOffset, s.arena + req.inOffset + req.inSize);
+    uint8_t * out = s.arena + req.outOffset;
+    
+    StreamState table = {NULL, 0, false, false, 0, 0, NULL, 0};
+    size_t pos = 0;
+    outSize = 0;
+    while(pos < s.input.size())
+    {
+        BlockRef ref;
+        bool isBlock;
+        size_t len = ParseRecord(&s.input[pos], s.input.size() - pos, table, ref, isBlock);
+        if(len == 0 || len == BP_BAD_RECORD)
+            return BP_SERVER_ECORRUPT;
+        pos += len;
+        if(!isBlock)
+            continue;
+        
+        // Streams with long-range matches only come from bpenc --matches,
+        // and aren't served
+        if(ref.matches)
+            return BP_SERVER_ECORRUPT;
+        if(ref.width)
+        {
+            if(!CheckRecord(ref))
+                return BP_SERVER_ECORRUPT;
+            if(outSize + ref.rawSize <= req.outCapacity &&
+               (!DecodeWide(ref, s.wideTable, out + outSize) || !CheckData(ref, out + outSize, ref.rawSize)))
+                return BP_SERVER_ECORRUPT;
+            outSize += ref.rawSize;
+            continue;
+        }
+        if(!CheckRecord(ref))
+            return BP_SERVER_ECORRUPT;
+        if(ref.coded)
+        {
+            s.plain.resize(ref.size);
+            if(!DecodeEntropy(ref, s.plain.data()))
+                return BP_SERVER_ECORRUPT;
+            ref.data = s.plain.data();
+        }
+        if(!WarmExpandTable(s, ref))
+            return BP_SERVER_ECORRUPT;
+        size_t size = ExpandedSize(s.expandTable, ref.data, ref.size);
+        if(outSize + size <= req.outCapacity)
+        {
+            ExpandBytes(out + outSize, size, s.expandTable, ref.data, ref.size);
+            if(!CheckData(ref, out + outSize, size))
+                return BP_SERVER_ECORRUPT;
+        }
+        outSize += size;
+    }
+    return (outSize <= req.outCapacity)? BP_SERVER_OK : BP_SERVER_ESPACE;
+}
+
+static ServerReply Serve(ServerSession & s, const ServerRequest & req)
+{
+    ServerReply reply = {req.id, BP_SERVER_EBADREQ, 0};
+    if(!InArena(s, req.inOffset, req.inSize) || !InArena(s, req.outOffset, req.outCapacity))
+        return reply;
+    if(req.op == BP_SERVER_ENCODE)
+        reply.status = ServeEncode(s, req, reply.outSize);
+    else if(req.op == BP_SERVER_DECODE)
+        reply.status = ServeDecode(s, req, reply.outSize);
+    return reply;
+}
+
+// Take the hello and the arena descriptor that comes with it, and map the
+// arena if it can't shrink
+static bool AcceptSession(ServerSession & s)
+{
+    ServerHello hello;
+    struct iovec iov = {&hello, sizeof(hello)};
+    union {
+        char bfr[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.bfr;
+    msg.msg_controllen = sizeof(ctrl.bfr);
+    if(recvmsg(s.sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello))
+        return false;
+    
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return false;
+    int memFd;
+    memcpy(&memFd, CMSG_DATA(cmsg), sizeof(int));
+    
+    struct stat st;
+    int seals = fcntl(memFd, F_GET_SEALS);
+    bool ok = hello.magic == BP_SERVER_MAGIC && hello.version == BP_SERVER_VERSION &&
+              seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(memFd, &st) == 0 && (uint64_t)st.st_size >= hello.arenaSize && hello.arenaSize > 0;
+    if(ok)
+    {
+        void * mem = mmap(NULL, hello.arenaSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+        ok = (mem != MAP_FAILED);
+        if(ok) {
+            s.arena = (uint8_t *)mem;
+            s.arenaSize = hello.arenaSize;
+        }
+    }
+    close(memFd);
+    
+    ServerReply reply = {0, ok? BP_SERVER_OK : BP_SERVER_EBADREQ, 0};
+    return SendAll(s.sock, &reply, sizeof(reply)) && ok;
+}
+
+static void ServeConnection(int sock, Effort effort)
+{
+    ServerSession * s = new ServerSession;
+    s->sock = sock;
+    s->search.effort = effort;
+    s->arena = NULL;
+    s->arenaSize = 0;
+    
+    if(AcceptSession(*s))
+    {
+        ServerRequest reqs[BP_SERVER_BATCH];
+        ServerReply replies[BP_SERVER_BATCH];
+        size_t have = 0;
+        while(true)
+        {
+            ssize_t n = recv(sock, (uint8_t *)reqs + have, sizeof(reqs) - have, 0);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                break;
+            have += n;
+            
+            // Requests split across reads wait for the rest to arrive
+            size_t numReqs = have/sizeof(ServerRequest);
+            for(size_t j = 0; j < numReqs; ++j)
+                replies[j] = Serve(*s, reqs[j]);
+            if(numReqs && !SendAll(sock, replies, numReqs*sizeof(ServerReply)))
+                break;
+            have -= numReqs*sizeof(ServerRequest);
+            memmove(reqs, (uint8_t *)reqs + numReqs*sizeof(ServerRequest), have);
+        }
+    }
+    
+    if(s->arena)
+        munmap(s->arena, s->arenaSize);
+    close(sock);
+    delete s;
+}
+
+int main(int argc, char * argv[])
+{
+    const char * isa = NULL;
+    Effort effort = BP_Effort(BP_MAX_EFFORT);
+    std::vector<const char *> fileArgs;
+    for(int j = 1; j < argc; ++j)
+    {
+        if(strncmp(argv[j], "--force-isa=", 12) == 0)
+            isa = argv[j] + 12;
+        else if(strlen(argv[j]) == 2 && argv[j][0] == '-' && argv[j][1] >= '0' + BP_MIN_EFFORT && argv[j][1] <= '0' + BP_MAX_EFFORT)
+            effort = BP_Effort(argv[j][1] - '0');
+        else
+            fileArgs.push_back(argv[j]);
+    }
+    if(fileArgs.size() != 1) {
+        printf("Usage: bpserver [-1..-9] [--force-isa=ISA] SOCKET\n");
+        exit(EXIT_FAILURE);
+    }
+    if(isa && !BP_SelectKernels(isa)) {
+        printf("Unknown or unsupported ISA: %s\n", isa);
+        exit(EXIT_FAILURE);
+    }
+    
+    const char * path = fileArgs[0];
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    
+    signal(SIGPIPE, SIG_IGN);
+    unlink(path);
+    int listenSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // The socket file gets its permissions at bind
+    mode_t mask = umask(0077);
+    bool bound = listenSock >= 0 && bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!bound || listen(listenSock, 64) != 0)
+    {
+        printf("Could not listen on %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+    
+    while(true)
+    {
+        int sock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC);
+        if(sock < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors until some connection closes
+                usleep(10000);
+                continue;
+            }
+            printf("Error accepting connection\n");
+            break;
+        }
+        std::thread(ServeConnection, sock, effort).detach();
+    }
+    
+    close(listenSock);
+    return EXIT_FAILURE;
+}
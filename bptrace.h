@@ -0,0 +1,182 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+#ifndef BPTRACE_H
+#define BPTRACE_H
+
+// Begin/end trace events for finding where the time goes in a run. Only
+// compiled in with -DBP_TRACE; otherwise every macro expands to nothing.
+// 
+// Each thread records into its own ring buffer, so recording takes no locks
+// and shares no cache lines. A ring keeps the most recent BP_TRACE_RING
+// events, overwriting the oldest. BP_TRACE_WRITE() pairs up the begin and end
+// events of every thread and writes them as Chrome trace JSON, which Perfetto
+// and chrome://tracing both load. The file written is named by the
+// BP_TRACE_FILE environment variable, if set.
+// 
+// BP_TRACE_SCOPE(name): event covering the rest of the enclosing scope
+// BP_TRACE_THREAD(name): name the calling thread in the trace
+// BP_TRACE_WRITE(path): write out the events of all threads. Threads must
+// be done recording.
+// 
+// Names must be string literals, or otherwise live until the trace is written.
+
+#ifdef BP_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#ifndef BP_TRACE_RING
+#define BP_TRACE_RING  (1 << 18)// events kept per thread, a power of 2
+#endif
+
+struct TraceEvent {
+    const char * name;
+    uint64_t time;// ns since the trace started
+    bool begin;
+};
+
+struct TraceRing {
+    TraceEvent events[BP_TRACE_RING];
+    std::atomic<uint64_t> count;// events ever recorded
+    const char * threadName;
+    int tid;
+};
+
+// Rings are registered once per thread and never freed, so they can be
+// written out after their threads have exited.
+struct TraceRegistry {
+    std::mutex lock;
+    std::vector<TraceRing *> rings;
+    std::chrono::steady_clock::time_point start;
+    TraceRegistry(): start(std::chrono::steady_clock::now()) {}
+};
+
+static TraceRegistry bp_traceRegistry;
+static thread_local TraceRing * bp_traceRing = NULL;
+
+static inline TraceRing * BP_TraceRing()
+{
+    if(!bp_traceRing)
+    {
+        TraceRing * ring = new TraceRing;
+        ring->count = 0;
+        ring->threadName = NULL;
+        std::lock_guard<std::mutex> guard(bp_traceRegistry.lock);
+        ring->tid = bp_traceRegistry.rings.size() + 1;
+        bp_traceRegistry.rings.push_back(ring);
+        bp_traceRing = ring;
+    }
+    return bp_traceRing;
+}
+
+static inline void BP_TraceEvent(const char * name, bool begin)
+{
+    TraceRing * ring = BP_TraceRing();
+    uint64_t n = ring->count.load(std::memory_order_relaxed);
+    TraceEvent & ev = ring->events[n & (BP_TRACE_RING - 1)];
+    ev.name = name;
+    ev.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - bp_traceRegistry.start).count();
+    ev.begin = begin;
+    ring->count.store(n + 1, std::memory_order_release);
+}
+
+struct TraceScope {
+    const char * name;
+    explicit TraceScope(const char * _name): name(_name) {BP_TraceEvent(name, true);}
+    ~TraceScope() {BP_TraceEvent(name, false);}
+};
+
+// Matched begin/end pairs are written as complete ("X") events. An end whose
+// begin was overwritten, or a begin that never ended, is dropped.
+static inline void BP_TraceWrite(const char * path)
+{
+    if(getenv("BP_TRACE_FILE"))
+        path = getenv("BP_TRACE_FILE");
+    FILE * f = fopen(path, "w");
+    if(!f) {
+        fprintf(stderr, "Could not write trace to %s\n", path);
+        return;
+    }
+    
+    std::lock_guard<std::mutex> guard(bp_traceRegistry.lock);
+    fprintf(f, "{\"traceEvents\": [\n");
+    bool first = true;
+    for(auto & ring : bp_traceRegistry.rings)
+    {
+        if(ring->threadName) {
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first? "" : ",\n", ring->tid, ring->threadName);
+            first = false;
+        }
+        
+        uint64_t count = ring->count.load(std::memory_order_acquire);
+        uint64_t start = (count > BP_TRACE_RING)? count - BP_TRACE_RING : 0;
+        std::vector<const TraceEvent *> open;
+        for(uint64_t n = start; n < count; ++n)
+        {
+            const TraceEvent & ev = ring->events[n & (BP_TRACE_RING - 1)];
+            if(ev.begin) {
+                open.push_back(&ev);
+                continue;
+            }
+            if(open.empty())
+                continue;
+            const TraceEvent * begin = open.back();
+            open.pop_back();
+            fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                first? "" : ",\n", begin->name, ring->tid, begin->time/1e3, (ev.time - begin->time)/1e3);
+            first = false;
+        }
+    }
+    fprintf(f, "\n], \"displayTimeUnit\": \"ns\"}\n");
+    fclose(f);
+}
+
+#define BP_TRACE_CONCAT2(a, b)  a##b
+#define BP_TRACE_CONCAT(a, b)   BP_TRACE_CONCAT2(a, b)
+#define BP_TRACE_SCOPE(name)    TraceScope BP_TRACE_CONCAT(bp_traceScope, __LINE__)(name)
+#define BP_TRACE_THREAD(name)   (BP_TraceRing()->threadName = (name))
+#define BP_TRACE_WRITE(path)    BP_TraceWrite(path)
+
+#else
+
+#define BP_TRACE_SCOPE(name)
+#define BP_TRACE_THREAD(name)
+#define BP_TRACE_WRITE(path)
+
+#endif // BP_TRACE
+
+#endif // BPTRACE_H
@@ -56,6 +56,12 @@ static struct BP_CacheEntry bp_cache[BP_PAIR_CACHE_SIZE];
 static bp_smallint_t bp_cached;
 #endif // BP_PAIR_CACHE_SIZE
 
+#if(BP_PAIR_CACHE_SIZE <= 1 && BP_SEEN_PAIRS == BP_SEEN_BITMAP)
+static uint8_t bp_seen[8192];
+#elif(BP_PAIR_CACHE_SIZE <= 1 && BP_SEEN_PAIRS == BP_SEEN_BLOOM)
+static uint8_t bp_seen[1 << (BP_BLOOM_LOG - 3)];
+#endif // BP_SEEN_PAIRS
+
 
 //******************************************************************************
 
@@ -105,6 +111,39 @@ static bool PickUnused(uint8_t * val)
 } // PickUnused()
 
 
+#if(BP_PAIR_CACHE_SIZE <= 1 && BP_SEEN_PAIRS != BP_SEEN_NONE)
+static inline void SetBit(uint16_t bit)
+{
+    bp_seen[bit >> 3] |= 1 << (bit & 7);
+}
+
+static inline bool GetBit(uint16_t bit)
+{
+    return (bp_seen[bit >> 3] >> (bit & 7)) & 1;
+}
+
+// Mark pair as met in this pass. Returns true if it already was, or, with the
+// Bloom filter, if other pairs happened to set both its bits.
+// Side effects: updates bp_seen
+static bool SeenPair(const uint8_t * pair)
+{
+    uint16_t p = ((uint16_t)pair[0] << 8) | pair[1];
+#if(BP_SEEN_PAIRS == BP_SEEN_BITMAP)
+    bool seen = GetBit(p);
+    SetBit(p);
+#else // BP_SEEN_BLOOM
+    // Top bits of two multiplicative hashes
+    uint16_t h0 = (uint16_t)(p*0x9E37u) >> (16 - BP_BLOOM_LOG);
+    uint16_t h1 = (uint16_t)((p ^ (p >> 5))*0x5BD1u) >> (16 - BP_BLOOM_LOG);
+    bool seen = GetBit(h0) && GetBit(h1);
+    SetBit(h0);
+    SetBit(h1);
+#endif // BP_SEEN_PAIRS
+    return seen;
+} // SeenPair()
+#endif // BP_SEEN_PAIRS
+
+
 // Count instances of given pair in buffer.
 // Side effects: none
 static bp_size_t CountPairs(uint8_t * pair, uint8_t * data, bp_size_t size)
@@ -243,13 +282,8 @@ static bool DoSubstitution()
         return false;// Can't compress, no substitution values possible
     }
     
-    // TODO:
-    // This is very non-optimal in terms of CPU. A bitmap with a bit for each pair could be
-    // used to quickly discard pairs that have already been encountered, instead of re-counting
-    // ones that have already been fully counted. Unfortunately, such a bitmap would require 8192
-    // bytes. Make optional, for PC/large embedded system builds.
-    // A Bloom filter might be useful on small embedded systems. Accelerate compression, at a
-    // cost in missing some pairs. A simple implementation would be to just check n bits of a pair.
+    // Without the cache, this is very non-optimal in terms of CPU unless pairs already
+    // counted are skipped with BP_SEEN_PAIRS, see bpencode.h.
 #if(BP_PAIR_CACHE_SIZE > 1)
     if(bp_cached == 0) {
         BuildCache();
@@ -278,6 +312,10 @@ static bool DoSubstitution()
     }
     bp_cached = n;// also removes the pair just substituted
 #else // BP_PAIR_CACHE_SIZE <= 1
+#if(BP_SEEN_PAIRS != BP_SEEN_NONE)
+    memset(bp_seen, 0, sizeof(bp_seen));
+    SeenPair(bfr);
+#endif // BP_SEEN_PAIRS
 //    printf("Counting pairs\n");
     bp_size_t pairCount = CountPairs(bfr, bfr + 2, size - 2);
 //    printf("Counting more pairs\n");
@@ -285,6 +323,12 @@ static bool DoSubstitution()
     for(bp_size_t j = 1; (j + 8 + 2) < size; ++j)
     {
         uint8_t * newPair = bp_bfr + j;
+#if(BP_SEEN_PAIRS != BP_SEEN_NONE)
+        // Counting from a later occurrence only sees part of what counting from
+        // the first did, so it can't find more
+        if(SeenPair(newPair))
+            continue;
+#endif // BP_SEEN_PAIRS
         bp_size_t newPairCount = CountPairs(newPair, newPair + 2, size - 2 - j);
         if(newPairCount > pairCount) {
             bfr = newPair;
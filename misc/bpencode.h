@@ -69,6 +69,31 @@
 //#define BP_PAIR_CACHE_SIZE  (128)
 //#define BP_PAIR_CACHE_SIZE  (256)
 
+// Without the cache, each pass counts a pair again from every place it occurs,
+// though the count from its first occurrence is the highest. A set of the
+// pairs met so far in the pass lets the search skip the rest, keeping the
+// count in each pass near one scan per distinct pair instead of one per byte.
+// BP_SEEN_BITMAP is exact, with a bit for each of the 65536 pairs in 8192
+// bytes of RAM, and gives the same output as the plain scan.
+// BP_SEEN_BLOOM is a Bloom filter of 2^BP_BLOOM_LOG bits, setting 2 per pair.
+// It fits small systems, but a pair whose bits were all set by others is
+// skipped without being counted, so some compression can be lost.
+// Neither is used with the cache.
+#define BP_SEEN_NONE    (0)
+#define BP_SEEN_BITMAP  (1)
+#define BP_SEEN_BLOOM   (2)
+
+#ifndef BP_SEEN_PAIRS
+#define BP_SEEN_PAIRS  (BP_SEEN_NONE)
+//#define BP_SEEN_PAIRS  (BP_SEEN_BITMAP)
+//#define BP_SEEN_PAIRS  (BP_SEEN_BLOOM)
+#endif // BP_SEEN_PAIRS
+
+// Bloom filter takes 2^(n - 3) bytes
+#ifndef BP_BLOOM_LOG
+#define BP_BLOOM_LOG  (11)
+#endif // BP_BLOOM_LOG
+
 
 extern bp_size_t bp_csize; // compressed size
 extern bp_size_t bp_dsize; // decompressed size (and end of substitution records)
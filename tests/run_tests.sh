@@ -0,0 +1,560 @@
+#!/bin/bash
+#*******************************************************************************
+# Tests for bpenc and bpdec. Both are built into a scratch directory with CXX
+# (default g++), then each case runs and prints PASS or FAIL. Exits non-zero
+# if any case fails.
+#
+# tests/run_tests.sh [CASE...]
+#*******************************************************************************
+
+cd "$(dirname "$0")/.."
+SRC=$(pwd)
+DATA=$SRC/tests/data
+CXX=${CXX:-g++}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+for prog in bpenc bpdec; do
+    if ! $CXX -Wall --std=c++11 -O2 -pthread "$SRC/$prog.cpp" -o "$WORK/$prog" 2> "$WORK/$prog.log"; then
+        cat "$WORK/$prog.log"
+        echo "FAIL build $prog"
+        exit 1
+    fi
+done
+BPENC=$WORK/bpenc
+BPDEC=$WORK/bpdec
+
+failed=0
+pass() { echo "PASS $1"; }
+fail() { echo "FAIL $1${2:+: $2}"; failed=1; }
+
+# Inputs: log-like text, a zero run, bytes of a binary, and an empty file
+LC_ALL=C awk 'BEGIN {
+    for(i = 0; i < 6000; ++i)
+        printf "2026-10-01 12:%02d:%02d INFO request id=%d status=%s path=/api/v1/items/%d\n",
+            i%60, (i*7)%60, i, (i%13)? "ok" : "error", (i*37)%1000
+}' > "$WORK/text.bin"
+head -c 300000 /dev/zero > "$WORK/zeros.bin"
+head -c 200000 "$BPENC" > "$WORK/binary.bin"
+: > "$WORK/empty.bin"
+INPUTS="text.bin zeros.bin binary.bin empty.bin"
+
+# Encode modes: the case each belongs to, then its bpenc options
+MODES='
+roundtrip
+shared      --shared
+shared      --shared -1
+shared      --shared -5
+shared      --shared --max-depth=2 --max-passes=20
+stream      --shared --stream
+stream      --shared --stream=1
+stream      --shared --stream=1 --crc
+stream      --shared --stream=1 -2
+checksum    --crc
+checksum    --crc --shared
+corrupt
+corrupt     --shared
+corrupt     --aligned
+corrupt     --wide
+corrupt     --long-blocks
+corrupt     --entropy
+corrupt     --matches
+archive
+archive     --shared
+archive     --crc
+archive     --entropy
+archive     -3 --threads=2
+aligned     --aligned
+aligned     --aligned --shared
+aligned     --aligned --crc
+aligned     --aligned --shared --crc
+wide        --wide
+wide        --wide=300
+wide        --wide=1024
+wide        --wide --crc
+entropy     --entropy
+entropy     --entropy --shared
+entropy     --entropy --crc
+entropy     --entropy -1
+longblocks  --long-blocks
+longblocks  --long-blocks=1
+longblocks  --long-blocks --crc
+longblocks  --long-blocks --shared
+longblocks  --long-blocks --entropy
+matches     --matches
+matches     --matches --crc
+matches     --matches --entropy
+matches     --matches --long-blocks
+matches     --matches --shared
+isa
+isa         --shared
+isa         --shared -3
+isa         --crc
+isa         -1
+isa         --aligned
+isa         --wide
+isa         --wide=300
+isa         --long-blocks --entropy
+isa         --matches
+isa         --beam=4
+beam        --beam
+beam        --beam=16 --max-depth=3
+beam        --beam --budget=0.001
+beam        --beam=8 --threads=3
+'
+
+# Decode modes every round trip is checked in
+DECODERS=(
+    ""
+    "--lanes=3"
+    "--threads=2"
+    "--pipeline=2"
+)
+
+# Set ENCODERS to the bpenc options of each mode of case $1
+select_modes() {
+    local mode enc
+    ENCODERS=()
+    while read -r mode enc; do
+        [ "$mode" = "$1" ] && ENCODERS+=("$enc")
+    done <<< "$MODES"
+}
+
+# Encode INPUTS and any further inputs given with each mode of case $1, and
+# decode every result in each of DECODERS, expecting the input back
+roundtrip_modes() {
+    local name=$1 enc dec input status
+    shift
+    select_modes $name
+    for enc in "${ENCODERS[@]}"; do
+        for input in $INPUTS "$@"; do
+            $BPENC $enc "$WORK/$input" "$WORK/rt.bp" > /dev/null 2>&1
+            status=$?
+            if [ $status != 0 ]; then
+                fail "$name [$enc] $input" "bpenc exited $status"
+                continue
+            fi
+            for dec in "${DECODERS[@]}"; do
+                $BPDEC $dec "$WORK/rt.bp" "$WORK/rt.out" > /dev/null 2>&1
+                status=$?
+                if [ $status != 0 ]; then
+                    fail "$name [$enc] [$dec] $input" "bpdec exited $status"
+                elif ! cmp -s "$WORK/rt.out" "$WORK/$input"; then
+                    fail "$name [$enc] [$dec] $input" "output differs"
+                else
+                    pass "$name [$enc] [$dec] $input"
+                fi
+            done
+        done
+    done
+}
+
+# Run "$@" expecting it to exit non-zero, and not to be killed by a signal
+expect_failure() {
+    local name=$1 status
+    shift
+    "$@" > /dev/null 2>&1
+    status=$?
+    if [ $status = 0 ] || [ $status -gt 128 ]; then
+        fail "$name" "exited $status"
+    else
+        pass "$name"
+    fi
+}
+
+# Invert the byte at offset $2 of file $1
+flip_byte() {
+    local b
+    b=$(od -An -tu1 -j"$2" -N1 "$1" | tr -d ' ')
+    printf "\\$(printf %o $((b ^ 0xFF)))" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# Offsets to corrupt in file $1: near the start, spread through it, and near
+# the end
+corrupt_offsets() {
+    local size
+    size=$(stat -c %s "$1")
+    echo 3 $((size/7)) $((size/3)) $((size/2)) $((size*5/6)) $((size - 2))
+}
+
+# Files written by the original encoder, which made raw blocks of up to 65535
+# bytes, must still decode. They were made from inputs with these SHA-256
+# sums: baseline_zeros.bp from 200000 zero bytes, and baseline_mixed.bp from
+# 70000 zero bytes followed by text and pseudo-random bytes.
+test_baseline() {
+    local name sum dec
+    for name in "zeros 4cbbd9be0cba685835755f827758705db5a413c5494c34262cd25946a73e7582" \
+                "mixed 376ff00258a7ff2184b3859b9334c5d72b7921e9241d61f2b987a02dc77307db"; do
+        sum=${name#* }
+        name=${name%% *}
+        for dec in "${DECODERS[@]}"; do
+            if ! $BPDEC $dec "$DATA/baseline_$name.bp" "$WORK/base.out" > /dev/null 2>&1; then
+                fail "baseline [$dec] $name" "bpdec exited $?"
+            elif [ "$(sha256sum < "$WORK/base.out" | cut -d' ' -f1)" != "$sum" ]; then
+                fail "baseline [$dec] $name" "output differs"
+            else
+                pass "baseline [$dec] $name"
+            fi
+        done
+    done
+}
+
+test_roundtrip() {
+    roundtrip_modes roundtrip
+}
+
+# Shared tables are written as masked table records, and blocks skip the
+# passes whose pair they lack
+test_shared() {
+    roundtrip_modes shared
+    $BPENC --shared "$WORK/text.bin" "$WORK/shared.bp" > /dev/null 2>&1
+    if [ "$(od -An -tx1 -N3 "$WORK/shared.bp" | tr -d ' ')" = ffff01 ]; then
+        pass "shared masked table"
+    else
+        fail "shared masked table"
+    fi
+}
+
+# A streamed shared table, found on a sample smaller than the input, must
+# round trip
+test_stream() {
+    cat "$WORK/text.bin" "$WORK/binary.bin" "$WORK/text.bin" "$WORK/zeros.bin" "$WORK/text.bin" > "$WORK/large.bin"
+    roundtrip_modes stream large.bin
+}
+
+# Checksummed streams must round trip and verify, and a flipped byte anywhere
+# must fail every decode mode and --verify
+test_checksum() {
+    local enc dec off
+    roundtrip_modes checksum
+    for enc in "${ENCODERS[@]}"; do
+        $BPENC $enc "$WORK/text.bin" "$WORK/crc.bp" > /dev/null 2>&1
+        if $BPDEC --verify=2 "$WORK/crc.bp" > /dev/null 2>&1; then
+            pass "checksum [$enc] verify"
+        else
+            fail "checksum [$enc] verify" "exited $?"
+        fi
+        for off in $(corrupt_offsets "$WORK/crc.bp"); do
+            cp "$WORK/crc.bp" "$WORK/bad.bp"
+            flip_byte "$WORK/bad.bp" $off
+            for dec in "${DECODERS[@]}" "--verify"; do
+                expect_failure "checksum [$enc] [$dec] byte $off flipped" $BPDEC $dec "$WORK/bad.bp" "$WORK/bad.out"
+            done
+        done
+    done
+}
+
+# Without checksums corruption may go unnoticed, but it must never crash a
+# decoder
+test_corrupt() {
+    local enc dec off status crashed
+    select_modes corrupt
+    for enc in "${ENCODERS[@]}"; do
+        $BPENC $enc "$WORK/text.bin" "$WORK/plain.bp" > /dev/null 2>&1
+        crashed=0
+        for off in $(corrupt_offsets "$WORK/plain.bp") 0 1 2; do
+            cp "$WORK/plain.bp" "$WORK/bad.bp"
+            flip_byte "$WORK/bad.bp" $off
+            for dec in "${DECODERS[@]}"; do
+                timeout 60 $BPDEC $dec "$WORK/bad.bp" "$WORK/bad.out" > /dev/null 2>&1
+                status=$?
+                if [ $status -ge 124 ]; then
+                    fail "corrupt [$enc] [$dec] byte $off flipped" "exited $status"
+                    crashed=1
+                fi
+            done
+        done
+        [ $crashed = 0 ] && pass "corrupt [$enc]"
+    done
+}
+
+# An archive must decode whole to its members laid end to end, list them,
+# and give each one back alone with --extract
+test_archive() {
+    local enc dec input
+    cat $(for input in $INPUTS; do echo "$WORK/$input"; done) > "$WORK/members.bin"
+    select_modes archive
+    for enc in "${ENCODERS[@]}"; do
+        if ! (cd "$WORK" && $BPENC --archive $enc archive.bp $INPUTS > /dev/null 2>&1); then
+            fail "archive [$enc]" "bpenc exited $?"
+            continue
+        fi
+        for dec in "${DECODERS[@]}"; do
+            if $BPDEC $dec "$WORK/archive.bp" "$WORK/archive.out" > /dev/null 2>&1 &&
+               cmp -s "$WORK/archive.out" "$WORK/members.bin"; then
+                pass "archive [$enc] [$dec] whole"
+            else
+                fail "archive [$enc] [$dec] whole"
+            fi
+        done
+        if [ "$enc" = "--crc" ]; then
+            if $BPDEC --verify "$WORK/archive.bp" > /dev/null 2>&1; then
+                pass "archive [$enc] verify"
+            else
+                fail "archive [$enc] verify" "exited $?"
+            fi
+        fi
+        if [ "$($BPDEC --list "$WORK/archive.bp" 2> /dev/null | awk '{print $4}' | tr '\n' ' ')" = "$INPUTS " ]; then
+            pass "archive [$enc] list"
+        else
+            fail "archive [$enc] list"
+        fi
+        for input in $INPUTS; do
+            for dec in "" "--threads=2"; do
+                if $BPDEC $dec --extract=$input "$WORK/archive.bp" "$WORK/member.out" > /dev/null 2>&1 &&
+                   cmp -s "$WORK/member.out" "$WORK/$input"; then
+                    pass "archive [$enc] [$dec] extract $input"
+                else
+                    fail "archive [$enc] [$dec] extract $input"
+                fi
+            done
+        done
+    done
+    expect_failure "archive extract missing member" $BPDEC --extract=missing.bin "$WORK/archive.bp" "$WORK/member.out"
+    expect_failure "archive extract unopenable output" $BPDEC --extract=text.bin "$WORK/archive.bp" "$WORK/missing/member.out"
+}
+
+# Aligned containers must round trip, and a flipped byte in the header,
+# arrays or payloads of a checksummed one must fail every decode mode and
+# --verify. The zero padding after payloads is not checked.
+test_aligned() {
+    local dec off size
+    roundtrip_modes aligned
+    $BPENC --aligned --crc "$WORK/text.bin" "$WORK/aligned.bp" > /dev/null 2>&1
+    if [ "$(head -c 4 "$WORK/aligned.bp")" = BPAC ]; then
+        pass "aligned magic"
+    else
+        fail "aligned magic"
+    fi
+    size=$(stat -c %s "$WORK/aligned.bp")
+    for off in 5 20 64 $((size/3)) $((size/2)); do
+        cp "$WORK/aligned.bp" "$WORK/bad.bp"
+        flip_byte "$WORK/bad.bp" $off
+        for dec in "" "--threads=2" "--verify"; do
+            expect_failure "aligned [$dec] byte $off flipped" $BPDEC $dec "$WORK/bad.bp" "$WORK/bad.out"
+        done
+    done
+}
+
+# Wide blocks must round trip at any pass count, and verify
+test_wide() {
+    roundtrip_modes wide
+    $BPENC --wide --crc "$WORK/text.bin" "$WORK/wide.bp" > /dev/null 2>&1
+    if $BPDEC --verify "$WORK/wide.bp" > /dev/null 2>&1; then
+        pass "wide verify"
+    else
+        fail "wide verify" "exited $?"
+    fi
+}
+
+# Entropy-coded blocks must round trip, make text smaller, and fail to decode
+# once corrupted if checksummed
+test_entropy() {
+    local dec off
+    roundtrip_modes entropy
+    $BPENC "$WORK/text.bin" "$WORK/plain.bp" > /dev/null 2>&1
+    $BPENC --entropy --crc "$WORK/text.bin" "$WORK/coded.bp" > /dev/null 2>&1
+    if [ "$(stat -c %s "$WORK/coded.bp")" -lt "$(stat -c %s "$WORK/plain.bp")" ]; then
+        pass "entropy smaller"
+    else
+        fail "entropy smaller" "$(stat -c %s "$WORK/coded.bp") bytes against $(stat -c %s "$WORK/plain.bp")"
+    fi
+    for off in $(corrupt_offsets "$WORK/coded.bp"); do
+        cp "$WORK/coded.bp" "$WORK/bad.bp"
+        flip_byte "$WORK/bad.bp" $off
+        for dec in "${DECODERS[@]}" "--verify"; do
+            expect_failure "entropy [$dec] byte $off flipped" $BPDEC $dec "$WORK/bad.bp" "$WORK/bad.out"
+        done
+    done
+}
+
+# Long blocks must round trip, and take the place of several 2-byte size
+# blocks where the data allows. A table whose keys would take gigabytes to
+# expand must be refused quickly by the decoders that build one.
+test_longblocks() {
+    local dec status
+    roundtrip_modes longblocks
+    $BPENC "$WORK/zeros.bin" "$WORK/short.bp" > /dev/null 2>&1
+    $BPENC --long-blocks "$WORK/zeros.bin" "$WORK/long.bp" > /dev/null 2>&1
+    if [ "$(stat -c %s "$WORK/long.bp")" -lt "$(stat -c %s "$WORK/short.bp")" ]; then
+        pass "longblocks smaller"
+    else
+        fail "longblocks smaller" "$(stat -c %s "$WORK/long.bp") bytes against $(stat -c %s "$WORK/short.bp")"
+    fi
+    # 255 passes: key 1 doubles up to 8 MiB, then key 2 is rebuilt as a
+    # 16 MiB pair of it 232 times, for one byte of data
+    {
+        printf '\x00\x00\xff\x00\x00'
+        for i in $(seq 254); do printf '\x01\x01'; done
+        printf '\xff\xff\x05\x01'
+        for i in $(seq 23); do printf '\x01'; done
+        for i in $(seq 232); do printf '\x02'; done
+        printf '\x00'
+    } > "$WORK/huge.bp"
+    for dec in "" "--threads=2" "--pipeline=2" "--verify"; do
+        timeout 10 $BPDEC $dec "$WORK/huge.bp" "$WORK/huge.out" > /dev/null 2>&1
+        status=$?
+        if [ $status = 0 ] || [ $status -ge 124 ]; then
+            fail "longblocks [$dec] oversized table" "exited $status"
+        else
+            pass "longblocks [$dec] oversized table"
+        fi
+    done
+}
+
+# Long-range matches must round trip alone and with the other block records.
+# With --crc, the checksum of the first block of a segment covers its match
+# record, so a flipped byte in the match record must fail too.
+test_matches() {
+    local dec off size
+    cat "$WORK/binary.bin" "$WORK/text.bin" "$WORK/binary.bin" > "$WORK/repeats.bin"
+    roundtrip_modes matches repeats.bin
+    $BPENC --matches --crc "$WORK/repeats.bin" "$WORK/matches.bp" > /dev/null 2>&1
+    size=$(( $(od -An -tu1 -j3 -N4 "$WORK/matches.bp" | awk '{print (($1*256 + $2)*256 + $3)*256 + $4}') ))
+    for off in 8 $((7 + size/2)) $((6 + size)); do
+        cp "$WORK/matches.bp" "$WORK/bad.bp"
+        flip_byte "$WORK/bad.bp" $off
+        for dec in "${DECODERS[@]}" "--verify"; do
+            expect_failure "matches [$dec] match record byte $off flipped" $BPDEC $dec "$WORK/bad.bp" "$WORK/bad.out"
+        done
+    done
+}
+
+# Every kernel version that BP_SelectKernels accepts on this machine must
+# encode each input to the same bytes as the generic one, and decode the
+# result in every decode mode
+test_isa() {
+    local isa isas= enc dec input status
+    for isa in generic sse4.2 avx2 avx512; do
+        if $BPENC --force-isa=$isa "$WORK/empty.bin" "$WORK/isa.bp" > /dev/null 2>&1; then
+            isas="$isas $isa"
+        else
+            echo "SKIP isa $isa: not supported"
+        fi
+    done
+    select_modes isa
+    for enc in "${ENCODERS[@]}"; do
+        for input in $INPUTS; do
+            for isa in $isas; do
+                $BPENC --force-isa=$isa $enc "$WORK/$input" "$WORK/isa-$isa.bp" > /dev/null 2>&1
+                status=$?
+                if [ $status != 0 ]; then
+                    fail "isa [$enc] $isa $input" "bpenc exited $status"
+                elif ! cmp -s "$WORK/isa-$isa.bp" "$WORK/isa-generic.bp"; then
+                    fail "isa [$enc] $isa $input" "output differs from generic"
+                else
+                    pass "isa [$enc] $isa $input"
+                fi
+            done
+            for isa in $isas; do
+                for dec in "${DECODERS[@]}"; do
+                    if $BPDEC --force-isa=$isa $dec "$WORK/isa-generic.bp" "$WORK/isa.out" > /dev/null 2>&1 &&
+                       cmp -s "$WORK/isa.out" "$WORK/$input"; then
+                        pass "isa [$enc] [$dec] $isa $input decoded"
+                    else
+                        fail "isa [$enc] [$dec] $isa $input decoded"
+                    fi
+                done
+            done
+        done
+    done
+}
+
+# --stats=json must write valid JSON whatever the input is called
+test_stats() {
+    if ! command -v python3 > /dev/null; then
+        echo "SKIP stats: no python3"
+        return
+    fi
+    local input=$WORK/$'we"ird\\name\t.bin'
+    cp "$WORK/text.bin" "$input"
+    local enc
+    for enc in "" "--shared"; do
+        if ! $BPENC $enc --stats=json --stats-file="$WORK/stats.json" "$input" "$WORK/stats.bp" > /dev/null 2>&1; then
+            fail "stats [$enc]" "bpenc exited $?"
+        elif ! python3 -c 'import json, sys; d = json.load(open(sys.argv[1])); assert d["input"] == sys.argv[2]' \
+                "$WORK/stats.json" "$input" 2> "$WORK/stats.log"; then
+            fail "stats [$enc]" "$(tail -1 "$WORK/stats.log")"
+        else
+            pass "stats [$enc]"
+        fi
+    done
+}
+
+# Beam search must round trip with and without limits, and when the budget
+# runs out partway through a table. Its time counts as search time in --stats.
+test_beam() {
+    roundtrip_modes beam
+    if ! command -v python3 > /dev/null; then
+        echo "SKIP beam stats: no python3"
+        return
+    fi
+    if ! $BPENC --beam --stats=json --stats-file="$WORK/beam.json" "$WORK/text.bin" "$WORK/beam.bp" > /dev/null 2>&1; then
+        fail "beam stats" "bpenc exited $?"
+    elif ! python3 -c 'import json, sys; assert json.load(open(sys.argv[1]))["searchTime"] > 0' "$WORK/beam.json" 2> /dev/null; then
+        fail "beam stats" "no search time"
+    else
+        pass "beam stats"
+    fi
+}
+
+# A stream cut off partway through a record, input that can't be read, and
+# output that can't be opened or written, must fail in every decode mode
+test_exitcodes() {
+    local enc dec size
+    $BPENC "$WORK/text.bin" "$WORK/full.bp" > /dev/null 2>&1
+    size=$(stat -c %s "$WORK/full.bp")
+    head -c $((size/2 + 1)) "$WORK/full.bp" > "$WORK/trunc.bp"
+    for dec in "${DECODERS[@]}" "--pipeline=2 --no-uring"; do
+        expect_failure "exitcode [$dec] truncated input" $BPDEC $dec "$WORK/trunc.bp" "$WORK/trunc.out"
+        [ -w /dev/full ] && expect_failure "exitcode [$dec] unwritable output" $BPDEC $dec "$WORK/full.bp" /dev/full
+        expect_failure "exitcode [$dec] unopenable output" $BPDEC $dec "$WORK/full.bp" "$WORK/missing/out.bin"
+        expect_failure "exitcode [$dec] unreadable input" $BPDEC $dec "$WORK" "$WORK/dir.out"
+    done
+    expect_failure "exitcode verify truncated input" $BPDEC --verify "$WORK/trunc.bp"
+    expect_failure "exitcode verify unreadable input" $BPDEC --verify "$WORK"
+    for dec in "${DECODERS[@]}"; do
+        expect_failure "exitcode [$dec] missing input" $BPDEC $dec "$WORK/missing.bp" "$WORK/missing.out"
+    done
+    for enc in "" "--no-uring" "--shared --stream=1"; do
+        expect_failure "exitcode bpenc [$enc] unreadable input" $BPENC $enc "$WORK" "$WORK/dir.bp"
+    done
+    expect_failure "exitcode bpenc unopenable output" $BPENC "$WORK/text.bin" "$WORK/missing/out.bp"
+}
+
+# bpserver protocol checks from server_test.cpp, on a server of its own
+test_server() {
+    if ! $CXX -Wall --std=c++11 -O2 -pthread "$SRC/bpserver.cpp" -o "$WORK/bpserver" 2> "$WORK/bpserver.log" ||
+       ! $CXX -Wall --std=c++11 -O2 -I"$SRC" "$SRC/tests/server_test.cpp" -o "$WORK/server_test" 2>> "$WORK/bpserver.log"; then
+        cat "$WORK/bpserver.log"
+        fail "server build"
+        return
+    fi
+    local sock=$WORK/server.sock
+    "$WORK/bpserver" "$sock" > /dev/null &
+    local pid=$!
+    for i in $(seq 50); do
+        [ -S "$sock" ] && break
+        sleep 0.1
+    done
+    if [ "$(stat -c %a "$sock")" = 700 ]; then
+        pass "server socket permissions"
+    else
+        fail "server socket permissions" "mode $(stat -c %a "$sock")"
+    fi
+    "$WORK/server_test" "$sock" "$WORK/text.bin" || failed=1
+    if kill -0 $pid 2> /dev/null; then
+        pass "server still running"
+    else
+        fail "server still running"
+    fi
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+}
+
+CASES=${*:-"baseline roundtrip shared stream checksum corrupt archive aligned wide entropy longblocks matches isa stats beam exitcodes server"}
+for c in $CASES; do
+    test_$c
+done
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
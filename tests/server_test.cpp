@@ -0,0 +1,144 @@
+//******************************************************************************
+//    Copyright (c) 2013, Christopher James Huff
+//    All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//  * Neither the name of the copyright holders nor the names of contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//******************************************************************************
+
+// Protocol checks for bpserver, run by tests/run_tests.sh against a server
+// listening on SOCKET. Prints one PASS or FAIL line per check and exits
+// non-zero if any fail.
+//
+// g++ --std=c++11 -O2 -I.. server_test.cpp -o server_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "bpclient.h"
+
+static int failed = 0;
+
+static void Check(bool ok, const char * name)
+{
+    printf("%s server %s\n", ok? "PASS" : "FAIL", name);
+    if(!ok)
+        failed = 1;
+}
+
+// Connect with a hand-made arena, sealed with seals (0 for none). Returns
+// the hello's reply status, or 1 if the exchange itself failed.
+static int RawConnect(const char * path, unsigned seals)
+{
+    const size_t arenaSize = 1 << 16;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int memFd = memfd_create("server_test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(memFd < 0 || sock < 0 || ftruncate(memFd, arenaSize) != 0 ||
+       (seals && fcntl(memFd, F_ADD_SEALS, seals) != 0) ||
+       connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return 1;
+    
+    ServerHello hello = {BP_SERVER_MAGIC, BP_SERVER_VERSION, arenaSize};
+    struct iovec iov = {&hello, sizeof(hello)};
+    union {
+        char bfr[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.bfr;
+    msg.msg_controllen = sizeof(ctrl.bfr);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memFd, sizeof(int));
+    
+    ServerReply reply;
+    int status = 1;
+    if(sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hello) && RecvAll(sock, &reply, sizeof(reply)))
+        status = reply.status;
+    close(memFd);
+    close(sock);
+    return status;
+}
+
+int main(int argc, char * argv[])
+{
+    if(argc != 3) {
+        printf("Usage: server_test SOCKET INFILE\n");
+        exit(EXIT_FAILURE);
+    }
+    const char * path = argv[1];
+    std::vector<uint8_t> input;
+    FILE * fin = fopen(argv[2], "rb");
+    if(!fin) {
+        printf("Could not open %s\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t bfr[4096];
+    for(size_t n; (n = fread(bfr, 1, sizeof(bfr), fin)) > 0; )
+        input.insert(input.end(), bfr, bfr + n);
+    fclose(fin);
+    
+    ServerClient client;
+    Check(client.Connect(path, 4*input.size() + (1 << 16)), "connect");
+    
+    for(int flags = 0; flags <= (BP_SERVER_CHECKSUM | BP_SERVER_ENTROPY); ++flags)
+    {
+        std::vector<uint8_t> encoded, decoded;
+        std::string name = "roundtrip flags=" + std::to_string(flags);
+        bool ok = client.Encode(&input[0], input.size(), encoded, flags) == BP_SERVER_OK &&
+                  client.Decode(&encoded[0], encoded.size(), decoded) == BP_SERVER_OK && decoded == input;
+        Check(ok, name.c_str());
+        
+        // Flip a byte in each block's data: a checksummed stream must be
+        // refused, any other may decode to something else but must not
+        // take the server down
+        if(ok && (flags & BP_SERVER_CHECKSUM)) {
+            encoded[encoded.size() - 1] ^= 0x5A;
+            Check(client.Decode(&encoded[0], encoded.size(), decoded) == BP_SERVER_ECORRUPT, "corrupt checksummed input");
+        }
+    }
+    std::vector<uint8_t> junk(100, 0xFF), out;
+    Check(client.Decode(&junk[0], junk.size(), out) == BP_SERVER_ECORRUPT, "junk input");
+    
+    Check(RawConnect(path, 0) == BP_SERVER_EBADREQ, "unsealed arena refused");
+    Check(RawConnect(path, F_SEAL_SHRINK) == BP_SERVER_OK, "sealed arena accepted");
+    
+    // The server still answers on the first connection
+    std::vector<uint8_t> encoded;
+    Check(client.Encode(&input[0], input.size(), encoded) == BP_SERVER_OK, "alive after refusals");
+    return failed? EXIT_FAILURE : EXIT_SUCCESS;
+}